@@ -118,6 +118,24 @@ struct aio_t {
 #endif
   }
 
+#if defined(HAVE_LIBAIO)
+  bool is_write() const {
+    return iocb.aio_lio_opcode == IO_CMD_PWRITEV;
+  }
+
+  // fold next, the IO in the same direction on the bytes right after this
+  // one, into this one; neither is submitted yet
+  void merge(const aio_t& next) {
+    iov.insert(iov.end(), next.iov.begin(), next.iov.end());
+    // prepare again, the iocb points at iov which may have moved
+    if (is_write()) {
+      pwritev(offset, length + next.length);
+    } else {
+      preadv(offset, length + next.length);
+    }
+  }
+#endif
+
   long get_return_value() {
     return rval;
   }
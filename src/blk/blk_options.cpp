@@ -0,0 +1,3 @@
+#include "blk/blk_options.hpp"
+
+blk_options_t blk_options;
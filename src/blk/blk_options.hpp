@@ -0,0 +1,189 @@
+#ifndef STUPID__BLK_OPTIONS_HPP
+#define STUPID__BLK_OPTIONS_HPP
+
+#include <cstdint>
+#include <string>
+
+// What to do when a thread submits IO to a nvme controller which is attached
+// to another NUMA node than the one the thread is running on.
+enum class numa_policy_t {
+  ignore,  // do nothing
+  warn,    // print a warning when the thread's queue is set up
+  refuse,  // fail the IO with -EXDEV
+  bind,    // move the submitting (polling) thread to the controller's node
+};
+
+// Runtime knobs of the block device layer. They stand in for the bluestore_*
+// config options the code is derived from, and must be set before the first
+// BlockDevice::open().
+struct blk_options_t {
+  // KernelDevice
+  uint64_t bdev_block_size = 4096;
+  // io_setup() depth of the aio context
+  uint32_t bdev_aio_max_queue_depth = 1024;
+  // completions reaped (and delivered as one batch) per io_getevents()
+  uint32_t bdev_aio_reap_max = 64;
+  uint32_t bdev_aio_poll_ms = 250;
+  // IOContexts queued with queue_reap_ioc() are deleted by the completion
+  // thread once it is idle, or once that many have piled up
+  uint32_t bdev_ioc_reap_batch = 256;
+
+  // aio_submit() (both backends) merges the LBA-contiguous pending IOs of an
+  // IOContext going the same direction into one vectored command, up to the
+  // device max transfer size and at most bdev_merge_max bytes
+  bool bdev_merge_ios = true;
+  uint64_t bdev_merge_max = 1024 * 1024;
+
+  // rotational KernelDevices hand the aios to the disk in offset order
+  // (C-SCAN, see AioElevator), at most bdev_elevator_depth at a time; one
+  // waiting longer than bdev_elevator_expire_ms goes next regardless
+  bool bdev_elevator = true;
+  uint32_t bdev_elevator_depth = 16;
+  uint32_t bdev_elevator_expire_ms = 500;
+
+  // userspace block cache in front of every device (CachedBlockDevice), in
+  // bytes; 0 disables it. blocks are rounded up to a power of 2 and to the
+  // device block size.
+  uint64_t bdev_cache_size = 0;
+  uint32_t bdev_cache_block_size = 4096;
+  uint32_t bdev_cache_shards = 16;
+
+  // sequential readahead (ReadaheadBlockDevice) for sync reads: the window
+  // starts at bdev_readahead_min and doubles up to bdev_readahead_max bytes
+  // once a stream has seen bdev_readahead_trigger reads; 0 disables it. each
+  // of the bdev_readahead_streams tracked streams buffers 2 windows.
+  uint64_t bdev_readahead_max = 0;
+  uint64_t bdev_readahead_min = 128 * 1024;
+  uint32_t bdev_readahead_trigger = 2;
+  uint32_t bdev_readahead_streams = 8;
+
+  // StripedBlockDevice: bytes dealt to one member before moving to the next,
+  // rounded up to the block size
+  uint64_t bdev_stripe_unit = 64 * 1024;
+
+  // MirroredBlockDevice: a read of at most bdev_mirror_hedge_max bytes still
+  // unanswered after the bdev_mirror_hedge_percentile latency of its replica
+  // (over its last bdev_mirror_window reads, and at least
+  // bdev_mirror_hedge_min_us) is sent to the other replica too
+  bool bdev_mirror_hedge = true;
+  uint64_t bdev_mirror_hedge_max = 128 * 1024;
+  double bdev_mirror_hedge_percentile = 99;
+  uint32_t bdev_mirror_hedge_min_us = 200;
+  uint32_t bdev_mirror_window = 1024;
+
+  // WriteBackBlockDevice: writes of up to bdev_wb_max_write bytes go to the
+  // log on the fast device. The destager moves bdev_wb_destage_batch bytes of
+  // log at a time to the slow device, as soon as bdev_wb_destage_ratio of the
+  // log is dirty, and every bdev_wb_destage_interval_ms otherwise.
+  uint64_t bdev_wb_max_write = 256 * 1024;
+  uint64_t bdev_wb_destage_batch = 8 * 1024 * 1024;
+  double bdev_wb_destage_ratio = 0.5;
+  uint32_t bdev_wb_destage_interval_ms = 1000;
+
+  // MemBlockDevice and NullBlockDevice: the size when the path has none;
+  // huge pages for the RAM disk; complete the aios in aio_submit() instead
+  // of on a completion thread
+  uint64_t bdev_mem_size = 1024 * 1024 * 1024;
+  bool bdev_mem_hugepage = false;
+  bool bdev_mem_inline_completion = false;
+  // emulated service time of an aio_submit(), and how many are served at
+  // once; 0 to complete at once
+  uint32_t bdev_null_latency_us = 0;
+  uint32_t bdev_null_channels = 32;
+
+  // ThrottledBlockDevice: IOPS and bandwidth limits of every IOContext::prio
+  // class (urgent, high, medium, low), 0 for none, with bursts of
+  // bdev_qos_burst_ms worth of tokens. For the bandwidth, an IO costs its
+  // bytes plus the fixed bdev_qos_io_cost_{hdd,ssd}.
+  bool bdev_qos = false;
+  uint64_t bdev_qos_iops[4] = {0, 0, 0, 0};
+  uint64_t bdev_qos_bps[4] = {0, 0, 0, 0};
+  uint32_t bdev_qos_burst_ms = 100;
+  uint64_t bdev_qos_io_cost_hdd = 670000;
+  uint64_t bdev_qos_io_cost_ssd = 4000;
+
+  // MClockBlockDevice: the reservation and limit (IOPS, 0 for none) and
+  // weight of the tenants not given theirs with set_qos_client(); the bounds
+  // of the adaptive device queue depth, and how often it is adjusted
+  bool bdev_mclock = false;
+  double bdev_mclock_reservation = 0;
+  double bdev_mclock_weight = 1;
+  double bdev_mclock_limit = 0;
+  uint32_t bdev_mclock_depth_min = 4;
+  uint32_t bdev_mclock_depth_max = 256;
+  uint32_t bdev_mclock_window_ms = 100;
+
+  // KyberBlockDevice: every bdev_kyber_window_ms, the write depth (at most
+  // bdev_kyber_write_depth_max IOs) shrinks if the bdev_kyber_percentile
+  // read latency is over its target, and grows back once it is not
+  bool bdev_kyber = false;
+  uint32_t bdev_kyber_read_target_us = 2000;
+  uint32_t bdev_kyber_write_target_us = 10000;
+  uint32_t bdev_kyber_write_depth_max = 64;
+  uint32_t bdev_kyber_window_ms = 100;
+  double bdev_kyber_percentile = 99;
+
+  // ChecksumBlockDevice: crc32c of every block written, checked on read.
+  // The table is kept in the bdev_csum_path file and written out by flush();
+  // without it the table only lives in memory and is lost on close
+  bool bdev_csum = false;
+  std::string bdev_csum_path;
+
+  // NVMEDevice
+  // cores given to the spdk environment, the first one is the master core
+  std::string spdk_coremask = "0x1";
+  // hugepage memory reserved by the spdk environment, in MB
+  uint32_t spdk_mem = 512;
+  // io queues requested from every nvme controller; each submitting thread
+  // takes one of them
+  uint32_t spdk_num_io_queues = 96;
+  numa_policy_t spdk_numa_policy = numa_policy_t::warn;
+  // NVMe/TCP controllers: every io qpair is a TCP connection and the target
+  // bounds the queue size (MaxQueueDepth), so ask for fewer and smaller ones
+  uint32_t spdk_tcp_num_io_queues = 16;
+  uint32_t spdk_tcp_io_queue_size = 128;
+  bool spdk_tcp_header_digest = false;
+  bool spdk_tcp_data_digest = false;
+  // host NQN presented to fabrics targets, spdk's default if empty
+  std::string spdk_hostnqn;
+  // queue contexts (qpairs and dma buffers) per controller; a submitting
+  // thread leases one for each aio_submit, and waits if all of them are busy
+  uint32_t spdk_max_queues = 32;
+  // queue contexts created by open(), so the first IOs do not pay for them
+  uint32_t spdk_queue_warmup = 2;
+  // hybrid completion polling: after issuing IO to an idle queue, sleep for
+  // half the completion latency expected for its command and size (a moving
+  // average), then spin. without it, or while the estimate is overrun, an
+  // empty poll sleeps spdk_poll_sleep_us.
+  bool spdk_hybrid_poll = true;
+  uint32_t spdk_poll_sleep_us = 5;
+  // serve sync IOs which fit in one data buffer (8K) with a single command,
+  // skipping Tasks and IOContext; not in shared qpair mode
+  bool spdk_fast_path = true;
+  // stripe the 128K tasks of one large IO over that many qpairs of the same
+  // class (1: off), when it splits into at least spdk_stripe_min_tasks tasks
+  uint32_t spdk_stripe_lanes = 1;
+  uint32_t spdk_stripe_min_tasks = 4;
+  // shared qpair mode: instead of leasing a queue context per aio_submit,
+  // submitters hand their IO to one poller thread per controller through a
+  // lock-free ring of spdk_shared_ring_size entries; see SharedQueuePoller
+  bool spdk_shared_qpair = false;
+  uint32_t spdk_shared_ring_size = 4096;
+  // ask the controllers for weighted round robin arbitration between the
+  // IOContext priority classes; a controller without it is attached with
+  // round robin and the classes are weighted in software instead.
+  bool spdk_wrr = false;
+  // weights of the high/medium/low classes (1..256); urgent always goes first
+  uint32_t spdk_wrr_high_weight = 16;
+  uint32_t spdk_wrr_medium_weight = 4;
+  uint32_t spdk_wrr_low_weight = 1;
+  // software weighting: while a more urgent class has IO in flight, a class
+  // may keep at most weight * spdk_sw_prio_depth_per_weight commands in flight
+  uint32_t spdk_sw_prio_depth_per_weight = 4;
+  // give reads their own qpairs, apart from writes and flushes, in every class
+  bool spdk_separate_rw_qpairs = true;
+};
+
+extern blk_options_t blk_options;
+
+#endif //STUPID__BLK_OPTIONS_HPP
@@ -1,9 +1,21 @@
 #include <assert.h>
+#include <string.h>
 
 #include <iostream>
 #include <string>
 
+#include "blk/blk_options.hpp"
 #include "blk/block_device.hpp"
+#include "blk/cached_device.hpp"
+#include "blk/checksum_device.hpp"
+#include "blk/kyber_device.hpp"
+#include "blk/mclock_device.hpp"
+#include "blk/mem_device.hpp"
+#include "blk/mirrored_device.hpp"
+#include "blk/readahead_device.hpp"
+#include "blk/striped_device.hpp"
+#include "blk/throttled_device.hpp"
+#include "blk/writeback_device.hpp"
 
 #include "blk/kernel/kernel_device.hpp"
 
@@ -11,9 +23,30 @@
 #include "blk/spdk/nvme_device.hpp"
 #endif
 
+static bool is_type_path(const std::string& path, const char *type)
+{
+  size_t n = strlen(type);
+  return path.compare(0, n, type) == 0 && (path.size() == n || path[n] == ':');
+}
+
 // path: a string like '/var/lib/ceph/osd/ceph-0/spdk:trtype:pcie traddr:0000:65:00.0'
 BlockDevice::block_device_t BlockDevice::detect_device_type(const std::string& path)
 {
+  if (path.compare(0, sizeof(STRIPE_PREFIX) - 1, STRIPE_PREFIX) == 0) {
+    return block_device_t::stripe;
+  }
+  if (path.compare(0, sizeof(MIRROR_PREFIX) - 1, MIRROR_PREFIX) == 0) {
+    return block_device_t::mirror;
+  }
+  if (path.compare(0, sizeof(WRITEBACK_PREFIX) - 1, WRITEBACK_PREFIX) == 0) {
+    return block_device_t::writeback;
+  }
+  if (is_type_path(path, MEM_PREFIX)) {
+    return block_device_t::mem;
+  }
+  if (is_type_path(path, NULL_PREFIX)) {
+    return block_device_t::null;
+  }
 #if defined(HAVE_SPDK)
   if (NVMEDevice::support(path)) {
     return block_device_t::spdk;
@@ -38,6 +71,21 @@ BlockDevice::block_device_t BlockDevice::device_type_from_name(const std::string
     return block_device_t::spdk;
   }
 #endif
+  if (blk_dev_type_name == "stripe") {
+    return block_device_t::stripe;
+  }
+  if (blk_dev_type_name == "mirror") {
+    return block_device_t::mirror;
+  }
+  if (blk_dev_type_name == "writeback") {
+    return block_device_t::writeback;
+  }
+  if (blk_dev_type_name == "mem") {
+    return block_device_t::mem;
+  }
+  if (blk_dev_type_name == "null") {
+    return block_device_t::null;
+  }
   return block_device_t::unknown;
 }
 
@@ -52,6 +100,16 @@ BlockDevice* BlockDevice::create_with_type(block_device_t device_type, const std
   case block_device_t::spdk:
     return new NVMEDevice(cb, cbpriv);
 #endif
+  case block_device_t::stripe:
+    return new StripedBlockDevice(cb, cbpriv);
+  case block_device_t::mirror:
+    return new MirroredBlockDevice(cb, cbpriv);
+  case block_device_t::writeback:
+    return new WriteBackBlockDevice(cb, cbpriv);
+  case block_device_t::mem:
+    return new MemBlockDevice(cb, cbpriv);
+  case block_device_t::null:
+    return new NullBlockDevice(cb, cbpriv);
   default:
     assert(false);
     return nullptr;
@@ -66,7 +124,77 @@ BlockDevice *BlockDevice::create(const std::string& blk_dev_type_name, const std
   } else {
     device_type = device_type_from_name(blk_dev_type_name);
   }
-  return create_with_type(device_type, path, cb, cbpriv, d_cb, d_cbpriv);
+  BlockDevice *dev = create_with_type(device_type, path, cb, cbpriv, d_cb, d_cbpriv);
+  // right on the device, so cache hits are not checked again
+  if (dev && blk_options.bdev_csum) {
+    dev = new ChecksumBlockDevice(dev, cb, cbpriv);
+  }
+  if (dev && blk_options.bdev_cache_size) {
+    dev = new CachedBlockDevice(dev, cb, cbpriv);
+  }
+  // readahead on top, where it sees every read of a stream, cached or not
+  if (dev && blk_options.bdev_readahead_max) {
+    dev = new ReadaheadBlockDevice(dev, cb, cbpriv);
+  }
+  // under the tenant scheduler: it is about the device queue only
+  if (dev && blk_options.bdev_kyber) {
+    dev = new KyberBlockDevice(dev, cb, cbpriv);
+  }
+  if (dev && blk_options.bdev_mclock) {
+    dev = new MClockBlockDevice(dev, cb, cbpriv);
+  }
+  // outermost, the rate limits see the IOs of the upper layer only
+  if (dev && blk_options.bdev_qos) {
+    dev = new ThrottledBlockDevice(dev, cb, cbpriv);
+  }
+  return dev;
+}
+
+void BlockDevice::aio_complete_batch(std::vector<IOContext*>& iocs)
+{
+  if (iocs.empty()) {
+    return;
+  }
+
+  if (aio_batch_callback) {
+    aio_batch_callback(aio_batch_callback_priv, iocs);
+  } else {
+    for (auto ioc : iocs) {
+      aio_callback(aio_callback_priv, ioc->priv);
+    }
+  }
+  iocs.clear();
+}
+
+BlockDevice::~BlockDevice()
+{
+  reap_ioc();
+}
+
+void BlockDevice::queue_reap_ioc(IOContext *ioc)
+{
+  std::lock_guard l(ioc_reap_lock);
+  ioc_reap_queue.push_back(ioc);
+  ++ioc_reap_count;
+}
+
+void BlockDevice::reap_ioc(bool force)
+{
+  int n = ioc_reap_count.load(std::memory_order_relaxed);
+  if (n == 0 || (!force && n < (int)blk_options.bdev_ioc_reap_batch)) {
+    return;
+  }
+
+  // delete them outside the lock, completions may keep queueing meanwhile
+  std::vector<IOContext*> reap;
+  {
+    std::lock_guard l(ioc_reap_lock);
+    reap.swap(ioc_reap_queue);
+    ioc_reap_count -= reap.size();
+  }
+  for (auto ioc : reap) {
+    delete ioc;
+  }
 }
 
 bool BlockDevice::is_valid_io(uint64_t off, uint64_t len) const {
@@ -9,6 +9,15 @@
 #include "blk/io_context.hpp"
 
 #define SPDK_PREFIX "spdk:"
+// a striped device over the comma separated member paths which follow
+#define STRIPE_PREFIX "stripe:"
+// a mirror over the comma separated member paths which follow
+#define MIRROR_PREFIX "mirror:"
+// a write-back cache: the fast device path, then the slow device path
+#define WRITEBACK_PREFIX "writeback:"
+// RAM disk and null device, "mem" or "mem:<size>", "null" or "null:<size>"
+#define MEM_PREFIX "mem"
+#define NULL_PREFIX "null"
 
 #if defined(__linux__)
 #if !defined(F_SET_FILE_RW_HINT)
@@ -39,12 +48,21 @@
 class BlockDevice {
 public:
   typedef void (*aio_callback_t)(void *handle, void *aio);
+  // receives all the IOContexts which finished in one poll (nvme) or reap
+  // (kernel) cycle; the vector is reused by the caller after return.
+  typedef void (*aio_batch_callback_t)(void *handle, std::vector<IOContext*>& iocs);
 
 private:
+  // IOContexts handed over by the upper layer to be deleted by the device,
+  // see queue_reap_ioc(); ioc_reap_count mirrors the queue's size so that
+  // reap_ioc() can skip the lock when there is nothing to do.
   stupid::common::mutex ioc_reap_lock = stupid::common::make_mutex("BlockDevice::ioc_reap_lock");
   std::vector<IOContext*> ioc_reap_queue;
   std::atomic_int ioc_reap_count = {0};
 
+protected:
+  // composite devices create their members with these, without the
+  // decorators create() adds
   enum class block_device_t {
     unknown,
 #if defined(HAVE_LIBAIO) || defined(HAVE_POSIXAIO)
@@ -53,13 +71,17 @@ private:
 #if defined(HAVE_SPDK)
     spdk,
 #endif
+    stripe,
+    mirror,
+    writeback,
+    mem,
+    null,
   };
 
   static block_device_t detect_device_type(const std::string& path);
   static block_device_t device_type_from_name(const std::string& blk_dev_type_name);
   static BlockDevice* create_with_type(block_device_t device_type, const std::string& path, aio_callback_t cb, void *cbpriv, aio_callback_t d_cb, void *d_cbpriv);
 
-protected:
   uint64_t size = 0;
   uint64_t block_size = 0;
   uint64_t optimal_io_size = 0;
@@ -80,11 +102,39 @@ protected:
 public:
   aio_callback_t aio_callback;
   void *aio_callback_priv;
+  aio_batch_callback_t aio_batch_callback = nullptr;
+  void *aio_batch_callback_priv = nullptr;
 
   BlockDevice(aio_callback_t cb, void *cbpriv) : aio_callback(cb), aio_callback_priv(cbpriv)
   {}
 
-  virtual ~BlockDevice() = default;
+  // redirect the completions, for a decorator which needs to see them first
+  virtual void set_aio_callback(aio_callback_t cb, void *cbpriv) {
+    aio_callback = cb;
+    aio_callback_priv = cbpriv;
+  }
+
+  // optional: deliver finished IOContexts in batches instead of calling
+  // aio_callback once per IOContext, so that the upper layer can take its
+  // locks and do its wakeups once per batch.
+  virtual void set_aio_batch_callback(aio_batch_callback_t cb, void *cbpriv) {
+    aio_batch_callback = cb;
+    aio_batch_callback_priv = cbpriv;
+  }
+
+  // hand the IOContexts (all with priv set) whose last IO completed in this
+  // cycle to the upper layer, and clear the vector.
+  void aio_complete_batch(std::vector<IOContext*>& iocs);
+
+  // Instead of deleting a finished IOContext in its completion callback,
+  // which runs on the polling/reaping thread, the upper layer may queue it
+  // here; the device deletes the queued ones in a batch when it is idle.
+  virtual void queue_reap_ioc(IOContext *ioc);
+  // delete the queued IOContexts; if force is false, only once at least
+  // blk_options.bdev_ioc_reap_batch of them have piled up
+  void reap_ioc(bool force = true);
+
+  virtual ~BlockDevice();
 
   static BlockDevice* create(const std::string& blk_dev_type_name, const std::string& path, aio_callback_t cb, void *cbpriv, aio_callback_t d_cb, void *d_cbpriv);
   virtual bool supported_bdev_label() { return true; }
@@ -114,6 +164,21 @@ public:
 
   virtual void aio_submit(IOContext *ioc) = 0;
 
+  // Reservation and limit (IOPS, 0 for none) and weight of the IOContexts
+  // with qos_client == client, where a fair-share scheduler is configured
+  // (see MClockBlockDevice).
+  virtual int set_qos_client(uint32_t client, double reservation, double weight, double limit) {
+    return -EOPNOTSUPP;
+  }
+
+  // Register a long-lived buffer of the upper layer for DMA, so that IO
+  // to/from it skips the bounce copy where the backend has one. Buffers need
+  // not be registered for IO to work. The range need not be aligned, but a
+  // backend may register more around it (NVMEDevice: the whole 2MB pages it
+  // touches, which must be mapped).
+  virtual int register_memory(void *addr, uint64_t len) { return -EOPNOTSUPP; }
+  virtual int unregister_memory(void *addr, uint64_t len) { return -EOPNOTSUPP; }
+
   void set_no_exclusive_lock() {
     lock_exclusive = false;
   }
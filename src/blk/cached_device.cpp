@@ -0,0 +1,429 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "common/bit_op.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/cached_device.hpp"
+
+BlockCacheShard::BlockCacheShard(uint64_t unit, size_t capacity, std::atomic<uint64_t> *write_gen)
+  : unit(unit), capacity(std::max<size_t>(capacity, 1)), write_gen(write_gen)
+{
+  // the proportions suggested by the 2Q paper
+  kin = std::max<size_t>(this->capacity / 4, 1);
+  kout = std::max<size_t>(this->capacity / 2, 1);
+}
+
+void BlockCacheShard::remember(uint64_t blk)
+{
+  a1out.push_front(blk);
+  ghosts[blk] = a1out.begin();
+  if (a1out.size() > kout) {
+    ghosts.erase(a1out.back());
+    a1out.pop_back();
+  }
+}
+
+std::unique_ptr<char[]> BlockCacheShard::evict()
+{
+  uint64_t victim;
+  if (a1in.size() > kin || am.empty()) {
+    victim = a1in.back();
+    a1in.pop_back();
+    remember(victim);
+  } else {
+    victim = am.back();
+    am.pop_back();
+  }
+  auto it = entries.find(victim);
+  std::unique_ptr<char[]> data = std::move(it->second.data);
+  entries.erase(it);
+  return data;
+}
+
+bool BlockCacheShard::lookup(uint64_t blk, uint64_t from, uint64_t len, char *dst)
+{
+  std::lock_guard l(lock);
+  auto it = entries.find(blk);
+  if (it == entries.end()) {
+    return false;
+  }
+  entry_t &e = it->second;
+  // a hit in a1in does not promote: it may be a scan touching it twice
+  if (e.where == where_t::am) {
+    am.splice(am.begin(), am, e.pos);
+  }
+  memcpy(dst, e.data.get() + from, len);
+  return true;
+}
+
+void BlockCacheShard::insert(uint64_t blk, const char *src, uint64_t gen)
+{
+  std::lock_guard l(lock);
+  // the writers bump write_gen under this lock before they drop the block,
+  // so src is stale exactly when it moved
+  if (write_gen->load() != gen || writing.count(blk) || entries.count(blk)) {
+    return;
+  }
+
+  std::unique_ptr<char[]> data;
+  if (entries.size() >= capacity) {
+    data = evict();
+  } else {
+    data.reset(new char[unit]);
+  }
+  memcpy(data.get(), src, unit);
+
+  entry_t e;
+  e.data = std::move(data);
+  if (auto g = ghosts.find(blk); g != ghosts.end()) {
+    // evicted from a1in not long ago and wanted again: it is hot
+    a1out.erase(g->second);
+    ghosts.erase(g);
+    am.push_front(blk);
+    e.where = where_t::am;
+    e.pos = am.begin();
+  } else {
+    a1in.push_front(blk);
+    e.where = where_t::a1in;
+    e.pos = a1in.begin();
+  }
+  entries.emplace(blk, std::move(e));
+}
+
+void BlockCacheShard::update(uint64_t blk, const char *src)
+{
+  std::lock_guard l(lock);
+  ++*write_gen;
+  if (writing.count(blk)) {
+    // an aio write lands who knows when, before or after this one
+    drop(blk);
+  } else if (auto it = entries.find(blk); it != entries.end()) {
+    memcpy(it->second.data.get(), src, unit);
+  }
+}
+
+void BlockCacheShard::invalidate(uint64_t blk)
+{
+  std::lock_guard l(lock);
+  ++*write_gen;
+  drop(blk);
+}
+
+void BlockCacheShard::write_begin(uint64_t blk)
+{
+  std::lock_guard l(lock);
+  ++*write_gen;
+  ++writing[blk];
+  drop(blk);
+}
+
+void BlockCacheShard::write_end(uint64_t blk)
+{
+  std::lock_guard l(lock);
+  ++*write_gen;
+  if (auto it = writing.find(blk); it != writing.end() && --it->second == 0) {
+    writing.erase(it);
+  }
+  drop(blk);
+}
+
+void BlockCacheShard::drop(uint64_t blk)
+{
+  auto it = entries.find(blk);
+  if (it == entries.end()) {
+    return;
+  }
+  if (it->second.where == where_t::am) {
+    am.erase(it->second.pos);
+  } else {
+    a1in.erase(it->second.pos);
+  }
+  entries.erase(it);
+}
+
+size_t BlockCacheShard::size()
+{
+  std::lock_guard l(lock);
+  return entries.size();
+}
+
+int CachedBlockDevice::open(const std::string& path)
+{
+  int r = dev->open(path);
+  if (r < 0) {
+    return r;
+  }
+
+  copy_geometry();
+
+  unit = std::max<uint64_t>(blk_options.bdev_cache_block_size, block_size);
+  // a power of 2, hence a multiple of the block size
+  unit = 1ull << (64 - __builtin_clzll(unit - 1));
+  uint32_t nr_shards = std::max<uint32_t>(blk_options.bdev_cache_shards, 1);
+  size_t blocks_per_shard = blk_options.bdev_cache_size / unit / nr_shards;
+  shards.clear();
+  for (uint32_t i = 0; i < nr_shards; ++i) {
+    shards.emplace_back(new BlockCacheShard(unit, blocks_per_shard, &write_gen));
+  }
+
+  std::cout << __func__ << " cache " << blk_options.bdev_cache_size << " bytes in "
+    << nr_shards << " shards of " << blocks_per_shard << " x " << unit << " byte blocks" << std::endl;
+  return 0;
+}
+
+void CachedBlockDevice::close()
+{
+  dev->close();
+  shards.clear();
+}
+
+int CachedBlockDevice::read_through(uint64_t off, uint64_t len, char *buf, IOContext *ioc)
+{
+  if (ioc) {
+    return dev->read(off, len, buf, ioc, false);
+  }
+  return dev->read_random(off, len, buf, false);
+}
+
+int CachedBlockDevice::cached_read(uint64_t off, uint64_t len, char *buf, IOContext *ioc)
+{
+  const uint64_t end = off + len;
+  uint64_t u = stupid::common::p2align(off, unit);
+
+  // the blocks which missed, read from the device in runs
+  uint64_t run_start = 0, run_end = 0;
+  auto read_run = [&]() -> int {
+    if (run_start == run_end) {
+      return 0;
+    }
+    // the device may end in the middle of the last block
+    uint64_t dev_end = std::min(run_end, size);
+    uint64_t run_len = dev_end - run_start;
+    char *tmp = static_cast<char*>(aligned_alloc(4096, stupid::common::p2roundup<uint64_t>(run_len, 4096)));
+    if (!tmp) {
+      return -ENOMEM;
+    }
+    uint64_t gen = write_gen.load();
+    int r = read_through(run_start, run_len, tmp, ioc);
+    if (r >= 0) {
+      // a write which went by during the read may have made tmp stale, let
+      // the next read fetch it again
+      for (uint64_t b = run_start; b < dev_end; b += unit) {
+        if (b + unit <= dev_end) {
+          shard_of(b / unit).insert(b / unit, tmp + (b - run_start), gen);
+        }
+        uint64_t from = std::max(off, b), to = std::min(end, b + unit);
+        memcpy(buf + (from - off), tmp + (from - run_start), to - from);
+      }
+    }
+    free(tmp);
+    run_start = run_end = 0;
+    return r < 0 ? r : 0;
+  };
+
+  for (; u < end; u += unit) {
+    uint64_t from = std::max(off, u), to = std::min(end, u + unit);
+    if (shard_of(u / unit).lookup(u / unit, from - u, to - from, buf + (from - off))) {
+      ++hits;
+      if (int r = read_run(); r < 0) {
+        return r;
+      }
+      continue;
+    }
+    ++misses;
+    if (run_start == run_end) {
+      run_start = u;
+    }
+    run_end = u + unit;
+  }
+  return read_run();
+}
+
+int CachedBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  if (shards.empty() || (ioc && ioc->skip_cache())) {
+    ++bypassed;
+    return dev->read(off, len, buf, ioc, buffered);
+  }
+  return cached_read(off, len, buf, ioc);
+}
+
+int CachedBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  if (shards.empty()) {
+    ++bypassed;
+    return dev->read_random(off, len, buf, buffered);
+  }
+  return cached_read(off, len, buf, nullptr);
+}
+
+CachedBlockDevice::req_t *CachedBlockDevice::req_of(IOContext *parent)
+{
+  req_t *req = static_cast<req_t*>(parent->fanout);
+  if (!req) {
+    req = new req_t;
+    req->parent = parent;
+    req->child = new IOContext(req, parent->allow_eio);
+    req->child->prio = parent->prio;
+    req->child->flags = parent->flags;
+    req->child->qos_client = parent->qos_client;
+    parent->fanout = req;
+  }
+  return req;
+}
+
+void CachedBlockDevice::aio_submit(IOContext *ioc)
+{
+  req_t *req = static_cast<req_t*>(ioc->fanout);
+  if (!req) {
+    return;
+  }
+  // the next aios queued into ioc make a new request
+  ioc->fanout = nullptr;
+  ioc->num_pending = 0;
+  if (!req->child->has_pending_aios()) {
+    // the aios failed when queued, or the device did them synchronously
+    delete req->child;
+    delete req;
+    return;
+  }
+  ++ioc->num_running;
+  dev->aio_submit(req->child);
+}
+
+void CachedBlockDevice::finished(req_t *req, std::vector<IOContext*>& done)
+{
+  IOContext *parent = req->parent;
+  if (int r = req->child->get_return_value(); r < 0) {
+    parent->set_return_value(r);
+  }
+  // failed or not, the device may hold new data now
+  for (auto &w : req->writes) {
+    aio_written(w.off, w.len, true);
+  }
+  // we are on the wrapped device's completion path, it frees the ioc later
+  dev->queue_reap_ioc(req->child);
+  delete req;
+
+  // see KernelDevice::_aio_thread for the waker logic
+  if (parent->priv) {
+    if (--parent->num_running == 0) {
+      done.push_back(parent);
+    }
+  } else {
+    parent->try_aio_wake();
+  }
+}
+
+void CachedBlockDevice::child_aio_cb(void *priv, void *child_priv)
+{
+  CachedBlockDevice *self = static_cast<CachedBlockDevice*>(priv);
+  std::vector<IOContext*> done;
+  self->finished(static_cast<req_t*>(child_priv), done);
+  self->aio_complete_batch(done);
+}
+
+void CachedBlockDevice::child_batch_cb(void *priv, std::vector<IOContext*>& iocs)
+{
+  CachedBlockDevice *self = static_cast<CachedBlockDevice*>(priv);
+  std::vector<IOContext*> done;
+  for (IOContext *child : iocs) {
+    self->finished(static_cast<req_t*>(child->priv), done);
+  }
+  self->aio_complete_batch(done);
+}
+
+int CachedBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  // the data only arrives at completion, it is not cached
+  ++bypassed;
+  req_t *req = req_of(ioc);
+  int before = req->child->num_pending;
+  int r = dev->aio_read(off, len, buf, req->child);
+  ioc->num_pending += req->child->num_pending - before;
+  return r;
+}
+
+void CachedBlockDevice::aio_written(uint64_t off, uint64_t len, bool done)
+{
+  const uint64_t end = off + len;
+  for (uint64_t u = stupid::common::p2align(off, unit); u < end; u += unit) {
+    if (done) {
+      shard_of(u / unit).write_end(u / unit);
+    } else {
+      shard_of(u / unit).write_begin(u / unit);
+    }
+  }
+}
+
+void CachedBlockDevice::written(uint64_t off, uint64_t len, const char *buf, bool update)
+{
+  const uint64_t end = off + len;
+  for (uint64_t u = stupid::common::p2align(off, unit); u < end; u += unit) {
+    BlockCacheShard &s = shard_of(u / unit);
+    if (update && u >= off && u + unit <= end) {
+      s.update(u / unit, buf + (u - off));
+    } else {
+      s.invalidate(u / unit);
+    }
+  }
+}
+
+int CachedBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  int r = dev->write(off, len, buf, buffered, write_hint);
+  if (!shards.empty()) {
+    // a failed write may have reached the device partly
+    written(off, len, buf, r >= 0);
+  }
+  return r;
+}
+
+int CachedBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  req_t *req = req_of(ioc);
+  if (!shards.empty()) {
+    aio_written(off, len, false);
+  }
+  int before = req->child->num_pending;
+  int r = dev->aio_write(off, len, buf, req->child, buffered, write_hint);
+  if (int n = req->child->num_pending - before; n > 0) {
+    if (!shards.empty()) {
+      req->writes.push_back(range_t{off, len});
+    }
+    ioc->num_pending += n;
+  } else if (!shards.empty()) {
+    // done synchronously, or failed when queued
+    aio_written(off, len, true);
+  }
+  return r;
+}
+
+int CachedBlockDevice::invalidate_cache(uint64_t off, uint64_t len)
+{
+  if (!shards.empty()) {
+    written(off, len, nullptr, false);
+  }
+  return dev->invalidate_cache(off, len);
+}
+
+int CachedBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  int r = dev->collect_metadata(prefix, pm);
+  size_t blocks = 0;
+  for (auto &s : shards) {
+    blocks += s->size();
+  }
+  (*pm)[prefix + "cache_size"] = std::to_string(blk_options.bdev_cache_size);
+  (*pm)[prefix + "cache_block_size"] = std::to_string(unit);
+  (*pm)[prefix + "cache_blocks"] = std::to_string(blocks);
+  (*pm)[prefix + "cache_hits"] = std::to_string(hits.load());
+  (*pm)[prefix + "cache_misses"] = std::to_string(misses.load());
+  (*pm)[prefix + "cache_bypassed"] = std::to_string(bypassed.load());
+  return r;
+}
@@ -0,0 +1,169 @@
+#ifndef STUPID__BLK_CACHED_DEVICE_HPP
+#define STUPID__BLK_CACHED_DEVICE_HPP
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "common/mutex.hpp"
+
+#include "blk/device_decorator.hpp"
+
+// One shard of the block cache, managed with the 2Q policy: a block read for
+// the first time goes into the a1in FIFO; if it is evicted from there and
+// read again while its key is still remembered in the a1out ghost FIFO, it
+// is promoted into the am LRU. A one-off scan thus only churns a1in and
+// never pushes the hot blocks out of am.
+class BlockCacheShard {
+  enum class where_t { a1in, am };
+
+  struct entry_t {
+    where_t where;
+    std::list<uint64_t>::iterator pos;
+    std::unique_ptr<char[]> data;
+  };
+
+  stupid::common::mutex lock = stupid::common::make_mutex("BlockCacheShard::lock");
+  uint64_t unit;
+  size_t capacity;     // blocks held in a1in + am
+  size_t kin, kout;    // a1in size target, a1out length
+  // shared by the shards of a device, bumped under the shard lock by
+  // everything which changes a block
+  std::atomic<uint64_t> *write_gen;
+
+  std::unordered_map<uint64_t, entry_t> entries;
+  std::list<uint64_t> a1in;   // front is the newest
+  std::list<uint64_t> am;     // front is the most recently used
+  std::list<uint64_t> a1out;  // keys only, front is the newest
+  std::unordered_map<uint64_t, std::list<uint64_t>::iterator> ghosts;
+  // blocks with aio writes in flight, never cached until they are done
+  std::unordered_map<uint64_t, uint32_t> writing;
+
+  void remember(uint64_t blk);
+  void drop(uint64_t blk);
+  // make room for one more block, returning the buffer of the evicted one
+  std::unique_ptr<char[]> evict();
+
+public:
+  BlockCacheShard(uint64_t unit, size_t capacity, std::atomic<uint64_t> *write_gen);
+
+  // copy [from, from + len) of the cached block into dst
+  bool lookup(uint64_t blk, uint64_t from, uint64_t len, char *dst);
+  // cache the block read from the device, unless anything was written since
+  // *write_gen was gen or a write of the block is in flight
+  void insert(uint64_t blk, const char *src, uint64_t gen);
+  // overwrite the block if it is cached
+  void update(uint64_t blk, const char *src);
+  void invalidate(uint64_t blk);
+  // an aio write of the block was queued / has completed
+  void write_begin(uint64_t blk);
+  void write_end(uint64_t blk);
+  size_t size();
+};
+
+// Decorator adding a userspace cache of aligned blocks in front of any
+// BlockDevice; SPDK and O_DIRECT bypass the page cache, so this is the only
+// cache the hot metadata reads get.
+//
+// Sync reads (read, read_random) are served from and fill the cache, unless
+// the IOContext has FLAG_DONT_CACHE. Writes go through to the device and
+// update the blocks they fully cover; aio writes, and blocks only partly
+// covered, are invalidated instead. An aio write keeps its blocks out of the
+// cache until it has completed, and invalidates them again then, so a read
+// going by meanwhile does not cache the old data. aio_read/aio_write queue
+// into a child IOContext to see those completions; aio_read is not cached.
+// Created by BlockDevice::create() when blk_options.bdev_cache_size is set.
+class CachedBlockDevice : public BlockDeviceDecorator {
+  struct range_t {
+    uint64_t off, len;
+  };
+  struct req_t {
+    IOContext *parent;
+    IOContext *child;
+    std::vector<range_t> writes;
+  };
+
+  uint64_t unit = 0;
+  std::vector<std::unique_ptr<BlockCacheShard>> shards;
+
+  std::atomic<uint64_t> hits = {0}, misses = {0}, bypassed = {0};
+  // bumped by every write and invalidation; a read only fills the cache if
+  // it did not change while the read was in progress
+  std::atomic<uint64_t> write_gen = {0};
+
+  BlockCacheShard &shard_of(uint64_t blk) {
+    return *shards[(blk * 0x9e3779b97f4a7c15ull >> 32) % shards.size()];
+  }
+
+  int cached_read(uint64_t off, uint64_t len, char *buf, IOContext *ioc);
+  int read_through(uint64_t off, uint64_t len, char *buf, IOContext *ioc);
+  // a write to [off, off + len) has reached the device
+  void written(uint64_t off, uint64_t len, const char *buf, bool update);
+  // an aio write of [off, off + len) was queued / has completed
+  void aio_written(uint64_t off, uint64_t len, bool done);
+
+  req_t *req_of(IOContext *parent);
+  void finished(req_t *req, std::vector<IOContext*>& done);
+  static void child_aio_cb(void *priv, void *child_priv);
+  static void child_batch_cb(void *priv, std::vector<IOContext*>& iocs);
+
+public:
+  CachedBlockDevice(BlockDevice *dev, aio_callback_t cb, void *cbpriv)
+    : BlockDeviceDecorator(dev, cb, cbpriv) {
+    // the completions of the wrapped device come here first
+    this->dev->set_aio_callback(child_aio_cb, this);
+    this->dev->set_aio_batch_callback(child_batch_cb, this);
+  }
+
+  void set_aio_callback(aio_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_callback(cb, cbpriv);
+  }
+  void set_aio_batch_callback(aio_batch_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_batch_callback(cb, cbpriv);
+  }
+
+  void aio_submit(IOContext *ioc) override;
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int invalidate_cache(uint64_t off, uint64_t len) override;
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_CACHED_DEVICE_HPP
@@ -0,0 +1,515 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "common/bit_op.hpp"
+#include "common/crc32c.hpp"
+#include "common/util.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/checksum_device.hpp"
+
+namespace {
+
+const char TABLE_MAGIC[8] = {'S', 'T', 'P', 'C', 'S', 'U', 'M', '1'};
+
+struct table_header_t {
+  char magic[8];
+  uint64_t size;
+  uint64_t block_size;
+  // followed by the bitmap of the open chunks
+};
+
+int table_io(int fd, bool write, char *p, uint64_t len, uint64_t off)
+{
+  uint64_t done = 0;
+  while (done < len) {
+    ssize_t r = write ?
+      ::pwrite(fd, p + done, len - done, off + done) :
+      ::pread(fd, p + done, len - done, off + done);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      r = -errno;
+      std::cerr << __func__ << (write ? " pwrite " : " pread ") << off + done << "~" << len - done
+        << " error: " << stupid::common::cpp_strerror(r) << std::endl;
+      return r;
+    }
+    if (r == 0) {
+      // past the end of the file, nothing was recorded there
+      memset(p + done, 0, len - done);
+      break;
+    }
+    done += r;
+  }
+  return 0;
+}
+
+}
+
+ChecksumBlockDevice::~ChecksumBlockDevice()
+{
+  for (uint64_t i = 0; chunks && i < nr_chunks; ++i) {
+    delete[] chunks[i].load();
+  }
+}
+
+int ChecksumBlockDevice::open(const std::string& path)
+{
+  int r = dev->open(path);
+  if (r < 0) {
+    return r;
+  }
+  copy_geometry();
+
+  uint64_t blocks = size / block_size;
+  nr_chunks = (blocks >> CHUNK_SHIFT) + 1;
+  chunks.reset(new std::atomic<std::atomic<uint64_t>*>[nr_chunks]);
+  for (uint64_t i = 0; i < nr_chunks; ++i) {
+    chunks[i] = nullptr;
+  }
+  nr_allocated = 0;
+  dropped = 0;
+
+  if (!blk_options.bdev_csum_path.empty()) {
+    if (r = table_open(blk_options.bdev_csum_path); r < 0) {
+      dev->close();
+      return r;
+    }
+  }
+
+  std::cout << __func__ << " crc32c (" << stupid::common::crc32c_impl() << ") per "
+    << block_size << " byte block, table in "
+    << (table_fd >= 0 ? blk_options.bdev_csum_path : "memory") << std::endl;
+  return 0;
+}
+
+void ChecksumBlockDevice::close()
+{
+  if (table_fd >= 0) {
+    table_flush();
+    ::close(table_fd);
+    table_fd = -1;
+  }
+  dev->close();
+  for (uint64_t i = 0; chunks && i < nr_chunks; ++i) {
+    delete[] chunks[i].exchange(nullptr);
+  }
+  nr_allocated = 0;
+}
+
+int ChecksumBlockDevice::table_open(const std::string& path)
+{
+  table_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (table_fd < 0) {
+    int r = -errno;
+    std::cerr << __func__ << " open " << path << " got: " << stupid::common::cpp_strerror(r) << std::endl;
+    return r;
+  }
+
+  header_len = stupid::common::p2roundup<uint64_t>(sizeof(table_header_t) + (nr_chunks + 7) / 8, 4096);
+  open_chunks.assign((nr_chunks + 7) / 8, 0);
+  chunk_seq.assign(nr_chunks, 0);
+  table_seq = 0;
+
+  std::unique_ptr<char[]> header(new char[header_len]);
+  int r = table_io(table_fd, false, header.get(), header_len, 0);
+  table_header_t h;
+  memcpy(&h, header.get(), sizeof(h));
+  if (r < 0 || memcmp(h.magic, TABLE_MAGIC, sizeof(TABLE_MAGIC)) ||
+      h.size != size || h.block_size != block_size) {
+    // new, or of another device: start over
+    std::cout << __func__ << " " << path << " does not match the device, starting an empty table" << std::endl;
+    if (::ftruncate(table_fd, 0) < 0 || (r = table_write_header()) < 0) {
+      r = r < 0 ? r : -errno;
+      ::close(table_fd);
+      table_fd = -1;
+      return r;
+    }
+    return 0;
+  }
+
+  const uint64_t per_chunk = 1ull << CHUNK_SHIFT;
+  std::unique_ptr<uint64_t[]> buf(new uint64_t[per_chunk]);
+  uint64_t blocks = size / block_size;
+  const uint8_t *was_open = reinterpret_cast<const uint8_t*>(header.get() + sizeof(h));
+  for (uint64_t c = 0; c < nr_chunks; ++c) {
+    if (was_open[c / 8] & (1 << (c % 8))) {
+      // written when the device went away; the next flush writes the chunk
+      // out again, empty
+      open_chunks[c / 8] |= 1 << (c % 8);
+      ++dropped;
+      continue;
+    }
+    uint64_t n = std::min(per_chunk, blocks - std::min(blocks, c * per_chunk));
+    if (n == 0) {
+      break;
+    }
+    if (r = table_io(table_fd, false, reinterpret_cast<char*>(buf.get()), n * sizeof(uint64_t),
+          header_len + c * per_chunk * sizeof(uint64_t)); r < 0) {
+      ::close(table_fd);
+      table_fd = -1;
+      return r;
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+      if (buf[i]) {
+        slot(c * per_chunk + i, true)->store(buf[i], std::memory_order_relaxed);
+      }
+    }
+  }
+  if (dropped) {
+    std::cerr << __func__ << " " << path << " was not flushed, dropped the checksums of "
+      << dropped.load() << " chunks" << std::endl;
+  }
+  return 0;
+}
+
+int ChecksumBlockDevice::table_write_header()
+{
+  std::unique_ptr<char[]> header(new char[header_len]());
+  table_header_t h;
+  memcpy(h.magic, TABLE_MAGIC, sizeof(TABLE_MAGIC));
+  h.size = size;
+  h.block_size = block_size;
+  memcpy(header.get(), &h, sizeof(h));
+  memcpy(header.get() + sizeof(h), open_chunks.data(), open_chunks.size());
+  if (int r = table_io(table_fd, true, header.get(), header_len, 0); r < 0) {
+    return r;
+  }
+  if (::fdatasync(table_fd) < 0) {
+    int r = -errno;
+    std::cerr << __func__ << " fdatasync got: " << stupid::common::cpp_strerror(r) << std::endl;
+    return r;
+  }
+  return 0;
+}
+
+int ChecksumBlockDevice::table_flush()
+{
+  const uint64_t per_chunk = 1ull << CHUNK_SHIFT;
+  std::unique_ptr<uint64_t[]> buf(new uint64_t[per_chunk]);
+  uint64_t blocks = size / block_size;
+
+  // write out the open chunks; the data of what they record has completed,
+  // the flush of the device below makes it durable
+  uint64_t seq;
+  {
+    std::lock_guard l(table_lock);
+    seq = table_seq;
+  }
+  for (uint64_t c = 0; c < nr_chunks; ++c) {
+    uint64_t n = std::min(per_chunk, blocks - std::min(blocks, c * per_chunk));
+    {
+      std::lock_guard l(table_lock);
+      if (!(open_chunks[c / 8] & (1 << (c % 8))) || n == 0) {
+        continue;
+      }
+      std::atomic<uint64_t> *chunk = chunks[c].load(std::memory_order_acquire);
+      for (uint64_t i = 0; i < n; ++i) {
+        buf[i] = chunk ? chunk[i].load(std::memory_order_relaxed) : 0;
+      }
+    }
+    if (int r = table_io(table_fd, true, reinterpret_cast<char*>(buf.get()), n * sizeof(uint64_t),
+          header_len + c * per_chunk * sizeof(uint64_t)); r < 0) {
+      return r;
+    }
+  }
+
+  if (int r = dev->flush(); r < 0) {
+    return r;
+  }
+  if (::fdatasync(table_fd) < 0) {
+    int r = -errno;
+    std::cerr << __func__ << " fdatasync got: " << stupid::common::cpp_strerror(r) << std::endl;
+    return r;
+  }
+
+  // only the chunks not written since stay open
+  std::lock_guard l(table_lock);
+  bool closed = false;
+  for (uint64_t c = 0; c < nr_chunks; ++c) {
+    if ((open_chunks[c / 8] & (1 << (c % 8))) && chunk_seq[c] <= seq) {
+      open_chunks[c / 8] &= ~(1 << (c % 8));
+      closed = true;
+    }
+  }
+  return closed ? table_write_header() : 0;
+}
+
+int ChecksumBlockDevice::flush()
+{
+  if (table_fd < 0) {
+    return dev->flush();
+  }
+  return table_flush();
+}
+
+std::atomic<uint64_t> *ChecksumBlockDevice::slot(uint64_t blk, bool create)
+{
+  std::atomic<std::atomic<uint64_t>*> &c = chunks[blk >> CHUNK_SHIFT];
+  std::atomic<uint64_t> *chunk = c.load(std::memory_order_acquire);
+  if (!chunk) {
+    if (!create) {
+      return nullptr;
+    }
+    std::atomic<uint64_t> *fresh = new std::atomic<uint64_t>[1ull << CHUNK_SHIFT]();
+    if (c.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) {
+      chunk = fresh;
+      ++nr_allocated;
+    } else {
+      // another writer got there first, chunk is theirs
+      delete[] fresh;
+    }
+  }
+  return &chunk[blk & ((1ull << CHUNK_SHIFT) - 1)];
+}
+
+void ChecksumBlockDevice::record(uint64_t off, uint64_t len, const char *buf)
+{
+  for (uint64_t b = 0; b < len; b += block_size) {
+    uint32_t crc = stupid::common::crc32c(0, buf + b, block_size);
+    slot((off + b) / block_size, true)->store(1ull << 32 | crc, std::memory_order_relaxed);
+  }
+}
+
+int ChecksumBlockDevice::forget(uint64_t off, uint64_t len)
+{
+  if (table_fd >= 0) {
+    // the table file must not vouch for the old data once the new may be
+    // on the device
+    uint64_t first = off / block_size >> CHUNK_SHIFT;
+    uint64_t last = (off + len - 1) / block_size >> CHUNK_SHIFT;
+    std::lock_guard l(table_lock);
+    ++table_seq;
+    bool opened = false;
+    for (uint64_t c = first; c <= last; ++c) {
+      chunk_seq[c] = table_seq;
+      if (!(open_chunks[c / 8] & (1 << (c % 8)))) {
+        open_chunks[c / 8] |= 1 << (c % 8);
+        opened = true;
+      }
+    }
+    if (opened) {
+      if (int r = table_write_header(); r < 0) {
+        return r;
+      }
+    }
+  }
+
+  for (uint64_t b = 0; b < len; b += block_size) {
+    if (auto s = slot((off + b) / block_size, false); s) {
+      s->store(0, std::memory_order_relaxed);
+    }
+  }
+  return 0;
+}
+
+int ChecksumBlockDevice::verify(uint64_t off, uint64_t len, const char *buf)
+{
+  for (uint64_t b = 0; b < len; b += block_size) {
+    auto s = slot((off + b) / block_size, false);
+    uint64_t want = s ? s->load(std::memory_order_relaxed) : 0;
+    if (!want) {
+      continue;
+    }
+    uint32_t crc = stupid::common::crc32c(0, buf + b, block_size);
+    ++verified;
+    if (crc != (uint32_t)want) {
+      ++errors;
+      std::cerr << __func__ << " checksum mismatch in block at 0x" << std::hex << off + b
+        << ": crc32c 0x" << crc << ", expected 0x" << (uint32_t)want << std::dec << std::endl;
+      return -EIO;
+    }
+  }
+  return 0;
+}
+
+ChecksumBlockDevice::req_t *ChecksumBlockDevice::req_of(IOContext *parent)
+{
+  req_t *req = static_cast<req_t*>(parent->fanout);
+  if (!req) {
+    req = new req_t;
+    req->dev = this;
+    req->parent = parent;
+    req->child = new IOContext(req, parent->allow_eio);
+    req->child->prio = parent->prio;
+    req->child->flags = parent->flags;
+    req->child->qos_client = parent->qos_client;
+    parent->fanout = req;
+  }
+  return req;
+}
+
+void ChecksumBlockDevice::aio_submit(IOContext *ioc)
+{
+  req_t *req = static_cast<req_t*>(ioc->fanout);
+  if (!req) {
+    return;
+  }
+  // the next aios queued into ioc make a new request
+  ioc->fanout = nullptr;
+  ioc->num_pending = 0;
+  if (!req->child->has_pending_aios()) {
+    // the aios failed when queued, or the device did them synchronously
+    delete req->child;
+    delete req;
+    return;
+  }
+  ++ioc->num_running;
+  dev->aio_submit(req->child);
+}
+
+void ChecksumBlockDevice::finished(req_t *req, std::vector<IOContext*>& done)
+{
+  IOContext *parent = req->parent;
+  int r = req->child->get_return_value();
+  if (r >= 0) {
+    // the buffers stay the caller's until the parent completes
+    for (auto &p : req->writes) {
+      record(p.off, p.len, p.buf);
+    }
+    for (auto &p : req->reads) {
+      if (r = verify(p.off, p.len, p.buf); r < 0) {
+        break;
+      }
+    }
+  }
+  if (r < 0) {
+    parent->set_return_value(r);
+  }
+  // we are on the wrapped device's completion path, it frees the ioc later
+  dev->queue_reap_ioc(req->child);
+  delete req;
+
+  // see KernelDevice::_aio_thread for the waker logic
+  if (parent->priv) {
+    if (--parent->num_running == 0) {
+      done.push_back(parent);
+    }
+  } else {
+    parent->try_aio_wake();
+  }
+}
+
+void ChecksumBlockDevice::child_aio_cb(void *priv, void *child_priv)
+{
+  ChecksumBlockDevice *self = static_cast<ChecksumBlockDevice*>(priv);
+  std::vector<IOContext*> done;
+  self->finished(static_cast<req_t*>(child_priv), done);
+  self->aio_complete_batch(done);
+}
+
+void ChecksumBlockDevice::child_batch_cb(void *priv, std::vector<IOContext*>& iocs)
+{
+  ChecksumBlockDevice *self = static_cast<ChecksumBlockDevice*>(priv);
+  std::vector<IOContext*> done;
+  for (IOContext *child : iocs) {
+    self->finished(static_cast<req_t*>(child->priv), done);
+  }
+  self->aio_complete_batch(done);
+}
+
+int ChecksumBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  assert(is_valid_io(off, len));
+  int r = dev->read(off, len, buf, ioc, buffered);
+  if (r < 0) {
+    return r;
+  }
+  return verify(off, len, buf);
+}
+
+int ChecksumBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  uint64_t aligned_off = stupid::common::p2align(off, block_size);
+  uint64_t aligned_len = stupid::common::p2roundup(off + len, block_size) - aligned_off;
+  if (aligned_off == off && aligned_len == len) {
+    int r = dev->read_random(off, len, buf, buffered);
+    return r < 0 ? r : verify(off, len, buf);
+  }
+
+  // only whole blocks can be checked, widen to them
+  char *tmp = static_cast<char*>(aligned_alloc(4096, stupid::common::p2roundup<uint64_t>(aligned_len, 4096)));
+  if (!tmp) {
+    return -ENOMEM;
+  }
+  int r = dev->read_random(aligned_off, aligned_len, tmp, buffered);
+  if (r >= 0) {
+    r = verify(aligned_off, aligned_len, tmp);
+  }
+  if (r >= 0) {
+    memcpy(buf, tmp + (off - aligned_off), len);
+  }
+  free(tmp);
+  return r;
+}
+
+int ChecksumBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  req_t *req = req_of(ioc);
+  int before = req->child->num_pending;
+  int r = dev->aio_read(off, len, buf, req->child);
+  if (int n = req->child->num_pending - before; n > 0) {
+    req->reads.push_back(piece_t{off, len, buf});
+    ioc->num_pending += n;
+  } else if (r >= 0) {
+    // done synchronously, the data is already there
+    r = verify(off, len, buf);
+  }
+  return r;
+}
+
+int ChecksumBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  assert(is_valid_io(off, len));
+  // until the write is done the device may hold the old data, or part of
+  // the new; a failed write leaves the blocks unchecked
+  if (int r = forget(off, len); r < 0) {
+    return r;
+  }
+  int r = dev->write(off, len, buf, buffered, write_hint);
+  if (r >= 0) {
+    record(off, len, buf);
+  }
+  return r;
+}
+
+int ChecksumBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  assert(is_valid_io(off, len));
+  // as in write(), recorded once the write is done
+  if (int r = forget(off, len); r < 0) {
+    return r;
+  }
+  req_t *req = req_of(ioc);
+  int before = req->child->num_pending;
+  int r = dev->aio_write(off, len, buf, req->child, buffered, write_hint);
+  if (int n = req->child->num_pending - before; n > 0) {
+    req->writes.push_back(piece_t{off, len, buf});
+    ioc->num_pending += n;
+  } else if (r >= 0) {
+    // done synchronously
+    record(off, len, buf);
+  }
+  return r < 0 ? r : 0;
+}
+
+int ChecksumBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  int r = dev->collect_metadata(prefix, pm);
+  (*pm)[prefix + "csum_impl"] = stupid::common::crc32c_impl();
+  (*pm)[prefix + "csum_table_bytes"] = std::to_string(nr_allocated.load() * (sizeof(uint64_t) << CHUNK_SHIFT));
+  // in memory only, the checksums of the blocks written before open() are
+  // not known and those blocks are not checked
+  (*pm)[prefix + "csum_table"] = table_fd >= 0 ? blk_options.bdev_csum_path : "memory";
+  (*pm)[prefix + "csum_dropped_chunks"] = std::to_string(dropped.load());
+  (*pm)[prefix + "csum_verified"] = std::to_string(verified.load());
+  (*pm)[prefix + "csum_errors"] = std::to_string(errors.load());
+  return r;
+}
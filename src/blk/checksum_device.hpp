@@ -0,0 +1,136 @@
+#ifndef STUPID__BLK_CHECKSUM_DEVICE_HPP
+#define STUPID__BLK_CHECKSUM_DEVICE_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "common/mutex.hpp"
+
+#include "blk/device_decorator.hpp"
+
+// Decorator keeping a crc32c of every block written and checking the blocks
+// read against it; a mismatch fails the read with -EIO. The checksums go to
+// a side table in memory, allocated in chunks of 64K blocks as they are
+// first written, so blocks without a checksum are not checked. A write
+// drops the checksums of its blocks when it is queued and records the new
+// ones once it has succeeded; the blocks of a failed write stay unchecked.
+//
+// With blk_options.bdev_csum_path the table is loaded by open() and written
+// out by flush() and close(), once the wrapped device has flushed: a header
+// block, then 8 bytes per block. Before a chunk is first written after a
+// flush, it is marked open in the header (synchronously); after a crash the
+// checksums of the open chunks are dropped, their data may be newer than
+// the table. Without it, nothing survives close().
+//
+// aio_read/aio_write queue into a child IOContext, whose reads are checked
+// on the completion path of the wrapped device before the parent completes.
+// Created by BlockDevice::create() under the cache when blk_options.bdev_csum
+// is set.
+class ChecksumBlockDevice : public BlockDeviceDecorator {
+  static const unsigned CHUNK_SHIFT = 16;
+
+  struct piece_t {
+    uint64_t off, len;
+    char *buf;
+  };
+  struct req_t {
+    ChecksumBlockDevice *dev;
+    IOContext *parent;
+    IOContext *child;
+    std::vector<piece_t> reads;
+    std::vector<piece_t> writes;
+  };
+
+  // (1 << 32 | crc) per block, 0 if not known
+  std::unique_ptr<std::atomic<std::atomic<uint64_t>*>[]> chunks;
+  uint64_t nr_chunks = 0;
+  std::atomic<uint64_t> nr_allocated = {0};
+  std::atomic<uint64_t> verified = {0}, errors = {0};
+
+  // the table file, -1 if the table is in memory only
+  int table_fd = -1;
+  uint64_t header_len = 0;
+  stupid::common::mutex table_lock = stupid::common::make_mutex("ChecksumBlockDevice::table_lock");
+  // chunks written since the last flush, as in the header
+  std::vector<uint8_t> open_chunks;
+  // when each chunk was last written, against table_seq
+  std::vector<uint64_t> chunk_seq;
+  uint64_t table_seq = 0;
+  std::atomic<uint64_t> dropped = {0};
+
+  std::atomic<uint64_t> *slot(uint64_t blk, bool create);
+  void record(uint64_t off, uint64_t len, const char *buf);
+  // also marks the chunks open in the table file
+  int forget(uint64_t off, uint64_t len);
+  int verify(uint64_t off, uint64_t len, const char *buf);
+
+  int table_open(const std::string& path);
+  int table_write_header();
+  int table_flush();
+
+  req_t *req_of(IOContext *parent);
+  void finished(req_t *req, std::vector<IOContext*>& done);
+  static void child_aio_cb(void *priv, void *child_priv);
+  static void child_batch_cb(void *priv, std::vector<IOContext*>& iocs);
+
+public:
+  ChecksumBlockDevice(BlockDevice *dev, aio_callback_t cb, void *cbpriv)
+    : BlockDeviceDecorator(dev, cb, cbpriv) {
+    // the completions of the wrapped device come here first
+    this->dev->set_aio_callback(child_aio_cb, this);
+    this->dev->set_aio_batch_callback(child_batch_cb, this);
+  }
+  ~ChecksumBlockDevice();
+
+  void set_aio_callback(aio_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_callback(cb, cbpriv);
+  }
+  void set_aio_batch_callback(aio_batch_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_batch_callback(cb, cbpriv);
+  }
+
+  void aio_submit(IOContext *ioc) override;
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int flush() override;
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_CHECKSUM_DEVICE_HPP
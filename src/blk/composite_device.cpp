@@ -0,0 +1,291 @@
+#include <assert.h>
+
+#include <iostream>
+#include <sstream>
+
+#include "blk/composite_device.hpp"
+
+CompositeBlockDevice::fanout_t *CompositeBlockDevice::fanout_of(IOContext *parent)
+{
+  fanout_t *f = static_cast<fanout_t*>(parent->fanout);
+  if (!f) {
+    f = new fanout_t;
+    f->dev = this;
+    f->parent = parent;
+    f->children.resize(members.size());
+    for (unsigned m = 0; m < members.size(); ++m) {
+      f->children[m].f = f;
+      f->children[m].m = m;
+    }
+    parent->fanout = f;
+  }
+  return f;
+}
+
+IOContext *CompositeBlockDevice::child_ioc(IOContext *parent, unsigned m)
+{
+  fanout_child_t &c = fanout_of(parent)->children[m];
+  if (!c.ioc) {
+    c.ioc = new IOContext(&c, parent->allow_eio);
+    c.ioc->prio = parent->prio;
+    c.ioc->flags = parent->flags;
+  }
+  return c.ioc;
+}
+
+int CompositeBlockDevice::queued(IOContext *parent, unsigned m, int r)
+{
+  fanout_child_t &c = fanout_of(parent)->children[m];
+  int pending = c.ioc ? c.ioc->num_pending.load() : 0;
+  parent->num_pending += pending - c.counted;
+  c.counted = pending;
+  if (r < 0) {
+    parent->set_return_value(r);
+    return r;
+  }
+  return 0;
+}
+
+void CompositeBlockDevice::aio_submit(IOContext *ioc)
+{
+  std::cout << __func__ << " ioc " << ioc << " pending " << ioc->num_pending.load() << " running " << ioc->num_running.load() << std::endl;
+
+  fanout_t *f = static_cast<fanout_t*>(ioc->fanout);
+  if (!f) {
+    return;
+  }
+  // the next aios queued into ioc start a new fanout
+  ioc->fanout = nullptr;
+  ioc->num_pending = 0;
+
+  // f may be gone as soon as the last child is submitted
+  std::vector<std::pair<unsigned, IOContext*>> submit;
+  for (auto &c : f->children) {
+    // a member may have done the aios synchronously, leaving nothing pending
+    if (c.ioc && c.ioc->has_pending_aios()) {
+      submit.emplace_back(c.m, c.ioc);
+      c.submitted = true;
+    }
+  }
+  std::vector<std::function<void()>> deferred;
+  deferred.swap(f->deferred);
+
+  if (submit.empty() && deferred.empty()) {
+    finish(f);
+    return;
+  }
+
+  ++ioc->num_running;
+  f->outstanding = submit.size() + deferred.size();
+  for (auto [m, c] : submit) {
+    members[m]->aio_submit(c);
+  }
+  for (auto &d : deferred) {
+    d();
+  }
+  reap_ioc(false);
+}
+
+void CompositeBlockDevice::member_aio_cb(void *priv, void *child_priv)
+{
+  static_cast<child_t*>(child_priv)->finished();
+}
+
+void CompositeBlockDevice::fanout_child_t::finished()
+{
+  f->dev->unit_finished(f);
+}
+
+void CompositeBlockDevice::unit_finished(fanout_t *f)
+{
+  if (--f->outstanding > 0) {
+    return;
+  }
+
+  IOContext *parent = f->parent;
+  finish(f);
+
+  // see KernelDevice::_aio_thread for the waker logic
+  if (parent->priv) {
+    if (--parent->num_running == 0) {
+      std::vector<IOContext*> done = {parent};
+      aio_complete_batch(done);
+    }
+  } else {
+    parent->try_aio_wake();
+  }
+}
+
+void CompositeBlockDevice::finish(fanout_t *f)
+{
+  for (auto &c : f->children) {
+    if (!c.ioc) {
+      continue;
+    }
+    if (int r = c.ioc->get_return_value(); r < 0) {
+      f->parent->set_return_value(r);
+    }
+    if (c.submitted) {
+      // we are on the member's completion path, it frees the ioc later
+      members[c.m]->queue_reap_ioc(c.ioc);
+    } else {
+      delete c.ioc;
+    }
+  }
+  delete f;
+}
+
+void CompositeBlockDevice::start_member_io(unsigned m, bool write, uint64_t off, uint64_t len, char *buf,
+  uint8_t prio, std::function<void(int)> done)
+{
+  member_io_t *io = new member_io_t;
+  io->dev = this;
+  io->m = m;
+  io->done = std::move(done);
+  io->ioc = new IOContext(io);
+  io->ioc->prio = prio;
+
+  int r = write ?
+    members[m]->aio_write(off, len, buf, io->ioc, false) :
+    members[m]->aio_read(off, len, buf, io->ioc);
+  if (r < 0) {
+    io->ioc->set_return_value(r);
+  } else if (io->ioc->has_pending_aios()) {
+    io->submitted = true;
+    members[m]->aio_submit(io->ioc);
+    return;
+  }
+  // done (or failed) synchronously
+  member_io_finished(io);
+}
+
+void CompositeBlockDevice::member_io_t::finished()
+{
+  dev->member_io_finished(this);
+}
+
+void CompositeBlockDevice::member_io_finished(member_io_t *io)
+{
+  int r = io->ioc->get_return_value();
+  if (io->submitted) {
+    // we are on the member's completion path, it frees the ioc later
+    members[io->m]->queue_reap_ioc(io->ioc);
+  } else {
+    delete io->ioc;
+  }
+  io->done(r);
+  delete io;
+}
+
+int CompositeBlockDevice::sync_io(IOContext *ioc, const std::function<int(IOContext*)>& queue)
+{
+  IOContext sync(nullptr, ioc ? ioc->allow_eio : false);
+  if (ioc) {
+    sync.prio = ioc->prio;
+    sync.flags = ioc->flags;
+  }
+  int r = queue(&sync);
+  aio_submit(&sync);
+  sync.aio_wait();
+  if (r < 0) {
+    return r;
+  }
+  return sync.get_return_value();
+}
+
+int CompositeBlockDevice::open_members(const std::string& paths)
+{
+  std::stringstream ss(paths);
+  std::string p;
+  while (std::getline(ss, p, ',')) {
+    if (p.empty()) {
+      continue;
+    }
+    BlockDevice *dev = create_with_type(detect_device_type(p), p, member_aio_cb, this, nullptr, nullptr);
+    if (!dev) {
+      std::cerr << __func__ << " unsupported member " << p << std::endl;
+      close_members();
+      return -EINVAL;
+    }
+    members.emplace_back(dev);
+    if (int r = dev->open(p); r < 0) {
+      std::cerr << __func__ << " failed to open member " << p << ": " << r << std::endl;
+      members.pop_back();
+      close_members();
+      return r;
+    }
+  }
+  if (members.empty()) {
+    std::cerr << __func__ << " no members in " << paths << std::endl;
+    return -EINVAL;
+  }
+  return 0;
+}
+
+void CompositeBlockDevice::close_members()
+{
+  for (auto &m : members) {
+    m->close();
+  }
+  members.clear();
+}
+
+int CompositeBlockDevice::register_memory(void *addr, uint64_t len)
+{
+  int ret = -EOPNOTSUPP;
+  for (auto &m : members) {
+    int r = m->register_memory(addr, len);
+    if (r < 0 && r != -EOPNOTSUPP) {
+      return r;
+    }
+    if (r == 0) {
+      ret = 0;
+    }
+  }
+  return ret;
+}
+
+int CompositeBlockDevice::unregister_memory(void *addr, uint64_t len)
+{
+  int ret = -EOPNOTSUPP;
+  for (auto &m : members) {
+    int r = m->unregister_memory(addr, len);
+    if (r == 0) {
+      ret = 0;
+    } else if (r != -EOPNOTSUPP) {
+      ret = r;
+    }
+  }
+  return ret;
+}
+
+int CompositeBlockDevice::get_devices(std::set<std::string> *ls) const
+{
+  for (auto &m : members) {
+    m->get_devices(ls);
+  }
+  return 0;
+}
+
+int CompositeBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  (*pm)[prefix + "size"] = std::to_string(get_size());
+  (*pm)[prefix + "block_size"] = std::to_string(get_block_size());
+  (*pm)[prefix + "rotational"] = rotational ? "1" : "0";
+  (*pm)[prefix + "members"] = std::to_string(members.size());
+  for (unsigned i = 0; i < members.size(); ++i) {
+    members[i]->collect_metadata(prefix + "member" + std::to_string(i) + "_", pm);
+  }
+  return 0;
+}
+
+int CompositeBlockDevice::flush()
+{
+  int ret = 0;
+  for (auto &m : members) {
+    if (int r = m->flush(); r < 0) {
+      ret = r;
+    }
+  }
+  return ret;
+}
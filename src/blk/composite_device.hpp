@@ -0,0 +1,103 @@
+#ifndef STUPID__BLK_COMPOSITE_DEVICE_HPP
+#define STUPID__BLK_COMPOSITE_DEVICE_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "blk/block_device.hpp"
+
+// Base of the BlockDevices built from several member devices (any mix of aio
+// and spdk). The aio IOs queued into an IOContext are split over the members
+// by the subclass, each member getting a child IOContext of its own; on
+// aio_submit() the children are submitted to their members, and the parent
+// completes once all of them have.
+class CompositeBlockDevice : public BlockDevice {
+protected:
+  // The priv of every IOContext the composite device submits to a member;
+  // the members call back into finished() when it completes.
+  struct child_t {
+    IOContext *ioc = nullptr;
+    unsigned m = 0;
+    virtual ~child_t() {}
+    virtual void finished() = 0;
+  };
+
+  struct fanout_t;
+  struct fanout_child_t : public child_t {
+    fanout_t *f = nullptr;
+    bool submitted = false;
+    int counted = 0;    // pending aios of ioc already added to the parent
+    void finished() override;
+  };
+
+  // the split of a parent IOContext, from the first aio queued until the
+  // last child completes
+  struct fanout_t {
+    CompositeBlockDevice *dev;
+    IOContext *parent;
+    std::vector<fanout_child_t> children;   // per member, ioc nullptr if unused
+    // IOs the subclass starts itself on aio_submit(), each calling
+    // unit_finished() once done
+    std::vector<std::function<void()>> deferred;
+    std::atomic_int outstanding = {0};
+  };
+
+  std::vector<std::unique_ptr<BlockDevice>> members;
+  std::string name;
+
+  // the IOContext collecting the part of parent's aios going to member m
+  IOContext *child_ioc(IOContext *parent, unsigned m);
+  // a member aio_read/aio_write into child_ioc(parent, m) returned; r < 0
+  // fails the parent. Only the aios the member left pending count, it may
+  // have done the IO synchronously.
+  int queued(IOContext *parent, unsigned m, int r);
+
+  // One IO of the composite device's own on a member, with a private
+  // IOContext; done(r) is called when it completes.
+  struct member_io_t : public child_t {
+    CompositeBlockDevice *dev = nullptr;
+    bool submitted = false;
+    std::function<void(int)> done;
+    void finished() override;
+  };
+  void start_member_io(unsigned m, bool write, uint64_t off, uint64_t len, char *buf,
+    uint8_t prio, std::function<void(int)> done);
+  void member_io_finished(member_io_t *io);
+
+  // the fanout of parent, created on demand
+  fanout_t *fanout_of(IOContext *parent);
+  static void member_aio_cb(void *priv, void *child_priv);
+  // one child or deferred IO of f is done
+  void unit_finished(fanout_t *f);
+  void finish(fanout_t *f);
+
+  // create and open the members, on the paths separated by commas
+  int open_members(const std::string& paths);
+  void close_members();
+
+  // queue the sync IO into a private IOContext and wait for it
+  int sync_io(IOContext *ioc, const std::function<int(IOContext*)>& queue);
+
+public:
+  CompositeBlockDevice(aio_callback_t cb, void *cbpriv) : BlockDevice(cb, cbpriv) {}
+
+  bool supported_bdev_label() override { return false; }
+  void aio_submit(IOContext *ioc) override;
+
+  int register_memory(void *addr, uint64_t len) override;
+  int unregister_memory(void *addr, uint64_t len) override;
+
+  int get_devname(std::string *out) const override {
+    *out = name;
+    return 0;
+  }
+  int get_devices(std::set<std::string> *ls) const override;
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int flush() override;
+};
+
+#endif //STUPID__BLK_COMPOSITE_DEVICE_HPP
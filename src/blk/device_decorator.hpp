@@ -0,0 +1,89 @@
+#ifndef STUPID__BLK_DEVICE_DECORATOR_HPP
+#define STUPID__BLK_DEVICE_DECORATOR_HPP
+
+#include <memory>
+
+#include "blk/block_device.hpp"
+
+// Base of the BlockDevices which wrap another one to add a feature (cache,
+// readahead ...): everything is forwarded to the wrapped device, which it
+// owns, and subclasses override what they change. The aio completions come
+// straight from the wrapped device, which was created with the same
+// callbacks.
+class BlockDeviceDecorator : public BlockDevice {
+protected:
+  std::unique_ptr<BlockDevice> dev;
+
+  // take over the geometry of the wrapped device once it is open
+  void copy_geometry() {
+    size = dev->get_size();
+    block_size = dev->get_block_size();
+    optimal_io_size = dev->get_optimal_io_size();
+    rotational = dev->is_rotational();
+  }
+
+public:
+  BlockDeviceDecorator(BlockDevice *dev, aio_callback_t cb, void *cbpriv)
+    : BlockDevice(cb, cbpriv), dev(dev) {}
+
+  BlockDevice *get_inner() { return dev.get(); }
+
+  void set_aio_callback(aio_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_callback(cb, cbpriv);
+    dev->set_aio_callback(cb, cbpriv);
+  }
+  void set_aio_batch_callback(aio_batch_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_batch_callback(cb, cbpriv);
+    dev->set_aio_batch_callback(cb, cbpriv);
+  }
+  void queue_reap_ioc(IOContext *ioc) override { dev->queue_reap_ioc(ioc); }
+
+  bool supported_bdev_label() override { return dev->supported_bdev_label(); }
+  void aio_submit(IOContext *ioc) override { dev->aio_submit(ioc); }
+  int set_qos_client(uint32_t client, double reservation, double weight, double limit) override {
+    return dev->set_qos_client(client, reservation, weight, limit);
+  }
+  int register_memory(void *addr, uint64_t len) override { return dev->register_memory(addr, len); }
+  int unregister_memory(void *addr, uint64_t len) override { return dev->unregister_memory(addr, len); }
+  int get_devname(std::string *out) const override { return dev->get_devname(out); }
+  int get_devices(std::set<std::string> *ls) const override { return dev->get_devices(ls); }
+  int get_numa_node(int *node) const override { return dev->get_numa_node(node); }
+
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override {
+    return dev->collect_metadata(prefix, pm);
+  }
+
+  int read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered) override {
+    return dev->read(off, len, buf, ioc, buffered);
+  }
+
+  int read_random(uint64_t off, uint64_t len, char *buf, bool buffered) override {
+    return dev->read_random(off, len, buf, buffered);
+  }
+
+  int aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc) override {
+    return dev->aio_read(off, len, buf, ioc);
+  }
+
+  int write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint = WRITE_LIFE_NOT_SET) override {
+    return dev->write(off, len, buf, buffered, write_hint);
+  }
+
+  int aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint = WRITE_LIFE_NOT_SET) override {
+    return dev->aio_write(off, len, buf, ioc, buffered, write_hint);
+  }
+
+  int flush() override { return dev->flush(); }
+  int invalidate_cache(uint64_t off, uint64_t len) override { return dev->invalidate_cache(off, len); }
+
+  int open(const std::string& path) override {
+    int r = dev->open(path);
+    if (r == 0) {
+      copy_geometry();
+    }
+    return r;
+  }
+  void close() override { dev->close(); }
+};
+
+#endif //STUPID__BLK_DEVICE_DECORATOR_HPP
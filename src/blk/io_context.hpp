@@ -14,6 +14,16 @@ struct IOContext {
     FLAG_DONT_CACHE = 1
   };
 
+  // priority classes, from the most to the least latency sensitive. nvme
+  // serves every class from its own qpairs; see SharedDriverQueueData.
+  enum prio_t {
+    PRIO_URGENT = 0,
+    PRIO_HIGH,
+    PRIO_MEDIUM,
+    PRIO_LOW,
+    PRIO_MAX
+  };
+
 private:
   stupid::common::mutex lock = stupid::common::make_mutex("IOContext::lock");
   stupid::common::condition_variable cond;
@@ -41,6 +51,16 @@ public:
   //  - 若不允许，则返回真实错误码；
   bool allow_eio;
   uint32_t flags = 0;
+  uint8_t prio = PRIO_MEDIUM;
+  // state of the composite device (StripedBlockDevice ...) splitting the IOs
+  // queued here over its members, until aio_submit()
+  void *fanout = nullptr;
+  // IOs and bytes queued through ThrottledBlockDevice since the last
+  // aio_submit()
+  uint32_t qos_ios = 0;
+  uint64_t qos_bytes = 0;
+  // the tenant, for the fair-share scheduler
+  uint32_t qos_client = 0;
 
   explicit IOContext(void *p, bool allow_eio = false) : priv(p), allow_eio(allow_eio)
   {}
@@ -0,0 +1,78 @@
+#include <assert.h>
+
+#include <iostream>
+
+#include "common/util.hpp"
+
+#include "blk/kernel/elevator.hpp"
+
+void AioElevator::add(aio_t *aio)
+{
+  std::lock_guard l(lock);
+  key_t k(aio->offset, seq++);
+  sorted.emplace(k, aio);
+  fifo.emplace_back(stupid::common::mono_ns() + expire_ns, k);
+}
+
+aio_t *AioElevator::pick(uint64_t now)
+{
+  // the keys dispatched in the sweep are only dropped here
+  while (!fifo.empty() && !sorted.count(fifo.front().second)) {
+    fifo.pop_front();
+  }
+
+  auto it = sorted.end();
+  if (!fifo.empty() && fifo.front().first <= now) {
+    it = sorted.find(fifo.front().second);
+    fifo.pop_front();
+    ++expired;
+  } else {
+    it = sorted.lower_bound(key_t(head, 0));
+    if (it == sorted.end()) {
+      it = sorted.begin();
+      ++wraps;
+    }
+  }
+
+  aio_t *aio = it->second;
+  sorted.erase(it);
+  head = aio->offset + aio->length;
+  return aio;
+}
+
+int AioElevator::dispatch(const submit_func_t& submit, int nr_completed)
+{
+  std::lock_guard l(lock);
+  assert(inflight >= (uint32_t)nr_completed);
+  inflight -= nr_completed;
+
+  int n = std::min<size_t>(depth - inflight, sorted.size());
+  if (n <= 0) {
+    return 0;
+  }
+
+  aio_t *batch[n];
+  uint64_t now = stupid::common::mono_ns();
+  for (int i = 0; i < n; ++i) {
+    batch[i] = pick(now);
+  }
+
+  // under the lock, so the device sees the batches in the order picked
+  int r = submit(batch, n);
+  if (r < 0) {
+    return r;
+  }
+  inflight += n;
+  dispatched += n;
+  return n;
+}
+
+void AioElevator::dump(std::map<std::string,std::string> *pm, const std::string& prefix)
+{
+  std::lock_guard l(lock);
+  (*pm)[prefix + "elevator_depth"] = std::to_string(depth);
+  (*pm)[prefix + "elevator_queued"] = std::to_string(sorted.size());
+  (*pm)[prefix + "elevator_dispatched"] = std::to_string(dispatched);
+  (*pm)[prefix + "elevator_expired"] = std::to_string(expired);
+  (*pm)[prefix + "elevator_wraps"] = std::to_string(wraps);
+}
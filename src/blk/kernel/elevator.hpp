@@ -0,0 +1,54 @@
+#ifndef STUPID__BLK_ELEVATOR_HPP
+#define STUPID__BLK_ELEVATOR_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "common/mutex.hpp"
+
+#include "blk/aio.hpp"
+
+// Submission stage of a rotational KernelDevice. The aios submitted by all
+// the IOContexts wait here and are handed to the device in one-way sweeps of
+// ascending offset (C-SCAN): the next one is the first at or after the end
+// of the last dispatched, wrapping around to the lowest offset. Keeping only
+// a few of them in flight lets the waiting ones pile up and be sorted. An aio
+// waiting longer than the expiry goes next whatever its offset, and the sweep
+// goes on from there, so far away IOs are not starved.
+class AioElevator {
+  typedef std::pair<uint64_t, uint64_t> key_t;   // offset, arrival sequence
+
+  stupid::common::mutex lock = stupid::common::make_mutex("AioElevator::lock");
+  std::map<key_t, aio_t*> sorted;
+  std::deque<std::pair<uint64_t, key_t>> fifo;   // deadline, key; in arrival order
+  uint64_t seq = 0;
+  uint64_t head = 0;                              // end of the last dispatched
+  uint32_t inflight = 0;
+  const uint32_t depth;
+  const uint64_t expire_ns;
+
+  uint64_t dispatched = 0, expired = 0, wraps = 0;
+
+  aio_t *pick(uint64_t now);
+
+public:
+  // submit() hands a batch to the device, returning the number taken or a
+  // negative error
+  typedef std::function<int(aio_t**, int)> submit_func_t;
+
+  AioElevator(uint32_t depth, uint32_t expire_ms)
+    : depth(std::max<uint32_t>(depth, 1)), expire_ns(expire_ms * 1000000ull) {}
+
+  void add(aio_t *aio);
+  // dispatch what the depth allows; nr_completed aios have left the device
+  int dispatch(const submit_func_t& submit, int nr_completed = 0);
+
+  void dump(std::map<std::string,std::string> *pm, const std::string& prefix);
+};
+
+#endif //STUPID__BLK_ELEVATOR_HPP
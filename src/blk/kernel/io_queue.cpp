@@ -5,11 +5,6 @@
 
 int aio_queue_t::submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size, void *priv, int *retries)
 {
-  // 2^16 * 125us = ~8 seconds, so max sleep is ~16 seconds
-  int attempts = 16;
-  int delay = 125;
-  int r;
-
   aio_iter cur = begin;
   struct aio_t* piocb[aios_size];
   int left = 0;
@@ -21,6 +16,15 @@ int aio_queue_t::submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
   }
 
   assert(aios_size >= left);
+  return submit(piocb, left, retries);
+}
+
+int aio_queue_t::submit(aio_t **piocb, int left, int *retries)
+{
+  // 2^16 * 125us = ~8 seconds, so max sleep is ~16 seconds
+  int attempts = 16;
+  int delay = 125;
+  int r;
 
   int done = 0;
   while (left > 0) {
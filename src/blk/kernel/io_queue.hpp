@@ -26,6 +26,8 @@ struct io_queue_t {
   virtual int init(std::vector<int> &fds) = 0;
   virtual void shutdown() = 0;
   virtual int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size, void *priv, int *retries) = 0;
+  // submit n aios whose priv is already set
+  virtual int submit(aio_t **piocb, int n, int *retries) = 0;
   virtual int get_next_completed(int timeout_ms, aio_t **paio, int max) = 0;
 };
 
@@ -78,6 +80,7 @@ struct aio_queue_t final : public io_queue_t {
   }
 
   int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size, void *priv, int *retries) final;
+  int submit(aio_t **piocb, int n, int *retries) final;
   int get_next_completed(int timeout_ms, aio_t **paio, int max) final;
 };
 
@@ -0,0 +1,594 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "common/util.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/kernel/kernel_device.hpp"
+
+KernelDevice::KernelDevice(aio_callback_t cb, void *cbpriv, aio_callback_t d_cb, void *d_cbpriv)
+  : BlockDevice(cb, cbpriv),
+    io_queue(blk_options.bdev_aio_max_queue_depth),
+    aio_thread(this)
+{}
+
+// https://lxr.missinglinkelectronics.com/linux+v4.15/block/blk-core.c#L135
+static bool is_expected_ioerr(const int r)
+{
+  return (r == -EOPNOTSUPP || r == -ETIMEDOUT || r == -ENOSPC ||
+          r == -ENOLINK || r == -EREMOTEIO || r == -EAGAIN || r == -EIO ||
+          r == -ENODATA || r == -EILSEQ || r == -ENOMEM ||
+#if defined(__linux__)
+          r == -EREMCHG || r == -EBADE
+#else
+          false
+#endif
+         );
+}
+
+static std::string sysfs_block_dir(dev_t dev)
+{
+  return "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+}
+
+// read /sys/dev/block/<major>:<minor>/<attr>; a partition has no queue/ of
+// its own, so fall back to its parent disk.
+static bool read_sysfs_block_attr(dev_t dev, const std::string& attr, std::string *val)
+{
+  std::string base = sysfs_block_dir(dev);
+  for (auto dir : {base, base + "/.."}) {
+    std::ifstream ifs(dir + "/" + attr);
+    if (ifs && std::getline(ifs, *val)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int KernelDevice::_lock()
+{
+  // flock is released when the fd is closed
+  if (::flock(fd_direct, LOCK_EX | LOCK_NB) < 0) {
+    int r = -errno;
+    std::cerr << __func__ << " flock failed on " << path << ": " << stupid::common::cpp_strerror(r) << std::endl;
+    return r;
+  }
+  return 0;
+}
+
+int KernelDevice::open(const std::string& p)
+{
+  path = p;
+  int r = 0;
+  std::cout << __func__ << " path " << path << std::endl;
+
+  fd_direct = ::open(path.c_str(), O_RDWR | O_DIRECT | O_CLOEXEC);
+  if (fd_direct < 0) {
+    r = -errno;
+    std::cerr << __func__ << " open got: " << stupid::common::cpp_strerror(r) << std::endl;
+    return r;
+  }
+  fd_buffered = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd_buffered < 0) {
+    r = -errno;
+    std::cerr << __func__ << " open got: " << stupid::common::cpp_strerror(r) << std::endl;
+    goto out_direct;
+  }
+
+  if (lock_exclusive) {
+    r = _lock();
+    if (r < 0) {
+      goto out_fail;
+    }
+  }
+
+  struct stat st;
+  if (::fstat(fd_direct, &st) < 0) {
+    r = -errno;
+    std::cerr << __func__ << " fstat got " << stupid::common::cpp_strerror(r) << std::endl;
+    goto out_fail;
+  }
+
+  block_size = blk_options.bdev_block_size;
+  if ((uint64_t)st.st_blksize > block_size) {
+    std::cout << __func__ << " st_blksize " << st.st_blksize << " > block_size " << block_size << std::endl;
+  }
+
+  {
+    // for a file, the device the file lives on decides rotational
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    std::string val;
+    if (read_sysfs_block_attr(dev, "queue/rotational", &val)) {
+      rotational = val != "0";
+    }
+    // the block layer splits anything bigger anyway
+    max_merge = blk_options.bdev_merge_max;
+    if (read_sysfs_block_attr(dev, "queue/max_sectors_kb", &val)) {
+      max_merge = std::min<uint64_t>(max_merge, std::stoull(val) * 1024);
+    }
+    if (S_ISBLK(st.st_mode)) {
+      std::ifstream ifs(sysfs_block_dir(dev) + "/uevent");
+      while (std::getline(ifs, val)) {
+        if (val.compare(0, 8, "DEVNAME=") == 0) {
+          devname = val.substr(8);
+          break;
+        }
+      }
+    }
+  }
+
+  if (S_ISBLK(st.st_mode)) {
+#if defined(__linux__)
+    uint64_t s;
+    if (::ioctl(fd_direct, BLKGETSIZE64, &s) < 0) {
+      r = -errno;
+      std::cerr << __func__ << " BLKGETSIZE64 got " << stupid::common::cpp_strerror(r) << std::endl;
+      goto out_fail;
+    }
+    size = s;
+#else
+    r = -EOPNOTSUPP;
+    goto out_fail;
+#endif
+  } else {
+    size = st.st_size;
+  }
+
+  r = _aio_start();
+  if (r < 0) {
+    goto out_fail;
+  }
+  if (rotational && aio && blk_options.bdev_elevator) {
+    elevator.reset(new AioElevator(blk_options.bdev_elevator_depth, blk_options.bdev_elevator_expire_ms));
+  }
+
+  // round size down to an even block
+  size &= ~(block_size - 1);
+
+  std::cout << __func__ << " size " << size
+    << " block_size " << block_size
+    << " " << (rotational ? "rotational" : "non-rotational")
+    << " devname " << devname
+    << std::endl;
+  return 0;
+
+out_fail:
+  VOID_TEMP_FAILURE_RETRY(::close(fd_buffered));
+  fd_buffered = -1;
+out_direct:
+  VOID_TEMP_FAILURE_RETRY(::close(fd_direct));
+  fd_direct = -1;
+  return r;
+}
+
+void KernelDevice::close()
+{
+  std::cout << __func__ << std::endl;
+  _aio_stop();
+  elevator.reset();
+
+  assert(fd_direct >= 0);
+  VOID_TEMP_FAILURE_RETRY(::close(fd_direct));
+  fd_direct = -1;
+
+  assert(fd_buffered >= 0);
+  VOID_TEMP_FAILURE_RETRY(::close(fd_buffered));
+  fd_buffered = -1;
+
+  path.clear();
+}
+
+int KernelDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  (*pm)[prefix + "rotational"] = rotational ? "1" : "0";
+  (*pm)[prefix + "size"] = std::to_string(get_size());
+  (*pm)[prefix + "block_size"] = std::to_string(get_block_size());
+  (*pm)[prefix + "driver"] = "KernelDevice";
+  (*pm)[prefix + "type"] = rotational ? "hdd" : "ssd";
+  (*pm)[prefix + "access_mode"] = "blk";
+  (*pm)[prefix + "path"] = path;
+  if (!devname.empty()) {
+    (*pm)[prefix + "devname"] = devname;
+  }
+  if (elevator) {
+    elevator->dump(pm, prefix);
+  }
+  return 0;
+}
+
+int KernelDevice::_aio_start()
+{
+  if (!aio) {
+    return 0;
+  }
+
+  std::vector<int> fds = {fd_direct, fd_buffered};
+  int r = io_queue.init(fds);
+  if (r < 0) {
+    if (r == -EAGAIN) {
+      std::cerr << __func__ << " io_setup(2) failed with EAGAIN; "
+        << "try increasing /proc/sys/fs/aio-max-nr" << std::endl;
+    } else {
+      std::cerr << __func__ << " io_setup(2) failed: " << stupid::common::cpp_strerror(r) << std::endl;
+    }
+    return r;
+  }
+
+  aio_stop = false;
+  aio_thread.create("blk_aio");
+  return 0;
+}
+
+void KernelDevice::_aio_stop()
+{
+  if (!aio) {
+    return;
+  }
+  aio_stop = true;
+  aio_thread.join();
+  aio_stop = false;
+  io_queue.shutdown();
+}
+
+// the kernel reaper: deliver the IOContexts finished by every io_getevents()
+// as one batch.
+void KernelDevice::_aio_thread()
+{
+  std::cout << __func__ << " start" << std::endl;
+
+  int max = blk_options.bdev_aio_reap_max;
+  std::unique_ptr<aio_t*[]> aios(new aio_t*[max]);
+  std::vector<IOContext*> finished;
+  finished.reserve(max);
+
+  while (!aio_stop) {
+    int r = io_queue.get_next_completed(blk_options.bdev_aio_poll_ms, aios.get(), max);
+    if (r < 0) {
+      std::cerr << __func__ << " got " << stupid::common::cpp_strerror(r) << std::endl;
+      abort();
+    }
+    if (elevator && r > 0) {
+      // refill the disk before running the callbacks
+      if (int e = _elevator_dispatch(r); e < 0) {
+        std::cerr << __func__ << " failed to dispatch aio: " << stupid::common::cpp_strerror(e) << std::endl;
+        abort();
+      }
+    }
+
+    for (int i = 0; i < r; ++i) {
+      IOContext *ioc = static_cast<IOContext*>(aios[i]->priv);
+      long rval = aios[i]->get_return_value();
+
+      if (rval < 0) {
+        if (ioc->allow_eio && is_expected_ioerr(rval)) {
+          std::cerr << __func__ << " translating the error to EIO for upper layer: " << stupid::common::cpp_strerror(rval) << std::endl;
+          ioc->set_return_value(-EIO);
+        } else {
+          std::cerr << __func__ << " unexpected IO error " << stupid::common::cpp_strerror(rval)
+            << " on " << aios[i]->offset << "~" << aios[i]->length << std::endl;
+          abort();
+        }
+      } else if (aios[i]->length != (uint64_t)rval) {
+        std::cerr << __func__ << " unexpected aio return value " << rval
+          << " does not match length " << aios[i]->length << std::endl;
+        abort();
+      }
+
+      // NOTE: once num_running drops to zero and we either call the callback
+      // or call aio_wake we cannot touch ioc or aios[] as the caller may free it.
+      if (ioc->priv) {
+        if (--ioc->num_running == 0) {
+          finished.push_back(ioc);
+        }
+      } else {
+        ioc->try_aio_wake();
+      }
+    }
+
+    aio_complete_batch(finished);
+    // free the IOContexts the upper layer gave back, at once if there were no
+    // completions to reap, otherwise only when a batch has piled up
+    reap_ioc(r == 0);
+  }
+  reap_ioc();
+
+  std::cout << __func__ << " end" << std::endl;
+}
+
+void KernelDevice::aio_submit(IOContext *ioc)
+{
+  std::cout << __func__ << " ioc " << ioc << " pending " << ioc->num_pending.load() << " running " << ioc->num_running.load() << std::endl;
+
+  if (ioc->num_pending.load() == 0) {
+    return;
+  }
+
+  if (blk_options.bdev_merge_ios && ioc->num_pending.load() > 1) {
+    if (int merged = _merge_pending(ioc); merged > 0) {
+      std::cout << __func__ << " ioc " << ioc << " merged " << merged << " aios" << std::endl;
+      ioc->num_pending -= merged;
+    }
+  }
+
+  // move these aside, and get our end iterator position now, as the
+  // aios might complete as soon as they are submitted and queue more
+  // aios.
+  std::list<aio_t>::iterator e = ioc->running_aios.begin();
+  ioc->running_aios.splice(e, ioc->pending_aios);
+
+  int pending = ioc->num_pending.load();
+  ioc->num_running += pending;
+  ioc->num_pending -= pending;
+  assert(ioc->num_pending.load() == 0);  // we should be only thread doing this
+  assert(ioc->pending_aios.size() == 0);
+
+  int r = 0;
+  if (elevator) {
+    for (auto p = ioc->running_aios.begin(); p != e; ++p) {
+      p->priv = ioc;
+      elevator->add(&*p);
+    }
+    r = _elevator_dispatch();
+  } else {
+    int retries = 0;
+    r = io_queue.submit_batch(ioc->running_aios.begin(), e, pending, ioc, &retries);
+    if (retries) {
+      std::cerr << __func__ << " retries " << retries << std::endl;
+    }
+  }
+  if (r < 0) {
+    std::cerr << __func__ << " failed to submit aio: " << stupid::common::cpp_strerror(r) << std::endl;
+    abort();
+  }
+}
+
+int KernelDevice::_elevator_dispatch(int nr_completed)
+{
+  int retries = 0;
+  int r = elevator->dispatch([this, &retries](aio_t **batch, int n) {
+    return io_queue.submit(batch, n, &retries);
+  }, nr_completed);
+  if (retries) {
+    std::cerr << __func__ << " retries " << retries << std::endl;
+  }
+  return r;
+}
+
+// Merge every pending aio into the one before it when they go the same
+// direction on adjacent bytes of the same fd, up to max_merge bytes and
+// IOV_MAX iovecs. Returns the number of aios gone.
+int KernelDevice::_merge_pending(IOContext *ioc)
+{
+  int merged = 0;
+#if defined(HAVE_LIBAIO)
+  auto &pending = ioc->pending_aios;
+  for (auto p = pending.begin(); p != pending.end(); ) {
+    auto n = std::next(p);
+    if (n == pending.end()) {
+      break;
+    }
+    if (n->fd == p->fd && n->is_write() == p->is_write() &&
+        p->offset + p->length == n->offset &&
+        p->length + n->length <= max_merge &&
+        p->iov.size() + n->iov.size() <= IOV_MAX) {
+      p->merge(*n);
+      pending.erase(n);
+      ++merged;
+    } else {
+      p = n;
+    }
+  }
+#endif
+  return merged;
+}
+
+// pread/pwrite all of [off, off+len); O_DIRECT also wants the memory aligned,
+// so an unaligned user buffer goes through an aligned bounce buffer.
+int KernelDevice::_sync_io(bool write, int fd, uint64_t off, uint64_t len, char *buf)
+{
+  char *p = buf;
+  std::unique_ptr<char, decltype(&::free)> bounce(nullptr, ::free);
+  if (fd == fd_direct && ((uintptr_t)buf & (block_size - 1))) {
+    void *b = nullptr;
+    if (::posix_memalign(&b, block_size, len)) {
+      return -ENOMEM;
+    }
+    bounce.reset(static_cast<char*>(b));
+    p = bounce.get();
+    if (write) {
+      memcpy(p, buf, len);
+    }
+  }
+
+  uint64_t done = 0;
+  while (done < len) {
+    ssize_t r = write ?
+      ::pwrite(fd, p + done, len - done, off + done) :
+      ::pread(fd, p + done, len - done, off + done);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      r = -errno;
+      std::cerr << __func__ << (write ? " pwrite " : " pread ") << off + done << "~" << len - done
+        << " error: " << stupid::common::cpp_strerror(r) << std::endl;
+      return r;
+    }
+    if (r == 0) {
+      // short read past the end of a file
+      memset(p + done, 0, len - done);
+      break;
+    }
+    done += r;
+  }
+
+  if (!write && p != buf) {
+    memcpy(buf, p, len);
+  }
+  return 0;
+}
+
+int KernelDevice::read(
+  uint64_t off,
+  uint64_t len,
+  char* buf,
+  IOContext *ioc,
+  bool buffered)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  int r = _sync_io(false, buffered ? fd_buffered : fd_direct, off, len, buf);
+  if (r < 0 && ioc && ioc->allow_eio && is_expected_ioerr(r)) {
+    r = -EIO;
+  }
+  return r;
+}
+
+int KernelDevice::read_random(
+  uint64_t off,
+  uint64_t len,
+  char *buf,
+  bool buffered)
+{
+  std::cout << __func__ << " " << off << "~" << len << " buffered " << buffered << std::endl;
+  assert(len > 0);
+  assert(off < size);
+  assert(off + len <= size);
+
+  if (!buffered && ((off | len) & (block_size - 1))) {
+    // widen to whole blocks for O_DIRECT and copy out the middle
+    uint64_t aligned_off = off & ~(block_size - 1);
+    uint64_t aligned_len = ((off + len + block_size - 1) & ~(block_size - 1)) - aligned_off;
+    void *b = nullptr;
+    if (::posix_memalign(&b, block_size, aligned_len)) {
+      return -ENOMEM;
+    }
+    std::unique_ptr<char, decltype(&::free)> tmp(static_cast<char*>(b), ::free);
+    int r = _sync_io(false, fd_direct, aligned_off, aligned_len, tmp.get());
+    if (r == 0) {
+      memcpy(buf, tmp.get() + (off - aligned_off), len);
+    }
+    return r;
+  }
+
+  return _sync_io(false, buffered ? fd_buffered : fd_direct, off, len, buf);
+}
+
+int KernelDevice::aio_read(
+  uint64_t off,
+  uint64_t len,
+  char* buf,
+  IOContext *ioc)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << std::endl;
+  assert(is_valid_io(off, len));
+
+  if (!aio || !dio || ((uintptr_t)buf & (block_size - 1))) {
+    // done synchronously; the caller finds nothing pending in ioc
+    return read(off, len, buf, ioc, false);
+  }
+
+  ioc->pending_aios.push_back(aio_t(ioc, fd_direct));
+  ++ioc->num_pending;
+  aio_t& aio = ioc->pending_aios.back();
+  aio.iov.push_back({buf, (size_t)len});
+  aio.bl = buf;
+  aio.bl_len = len;
+  aio.preadv(off, len);
+  return 0;
+}
+
+int KernelDevice::write(
+  uint64_t off,
+  uint64_t len,
+  char* buf,
+  bool buffered,
+  int write_hint)
+{
+  std::cout << __func__ << " " << off << "~" << len << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  int r = _sync_io(true, buffered ? fd_buffered : fd_direct, off, len, buf);
+  if (r < 0) {
+    return r;
+  }
+
+#if defined(__linux__)
+  if (buffered) {
+    // initiate IO and wait till it completes
+    if (::sync_file_range(fd_buffered, off, len, SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER | SYNC_FILE_RANGE_WAIT_BEFORE) < 0) {
+      r = -errno;
+      std::cerr << __func__ << " sync_file_range error: " << stupid::common::cpp_strerror(r) << std::endl;
+      return r;
+    }
+  }
+#endif
+  return 0;
+}
+
+int KernelDevice::aio_write(
+  uint64_t off,
+  uint64_t len,
+  char* buf,
+  IOContext *ioc,
+  bool buffered,
+  int write_hint)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  if (!aio || !dio || buffered || ((uintptr_t)buf & (block_size - 1))) {
+    return write(off, len, buf, buffered, write_hint);
+  }
+
+  ioc->pending_aios.push_back(aio_t(ioc, fd_direct));
+  ++ioc->num_pending;
+  aio_t& aio = ioc->pending_aios.back();
+  aio.iov.push_back({buf, (size_t)len});
+  aio.bl = buf;
+  aio.bl_len = len;
+  aio.pwritev(off, len);
+  return 0;
+}
+
+int KernelDevice::flush()
+{
+  if (::fdatasync(fd_direct) < 0) {
+    int r = -errno;
+    std::cerr << __func__ << " fdatasync got: " << stupid::common::cpp_strerror(r) << std::endl;
+    abort();
+  }
+  return 0;
+}
+
+int KernelDevice::invalidate_cache(uint64_t off, uint64_t len)
+{
+  std::cout << __func__ << " " << off << "~" << len << std::endl;
+  assert(off % block_size == 0);
+  assert(len % block_size == 0);
+  int r = ::posix_fadvise(fd_buffered, off, len, POSIX_FADV_DONTNEED);
+  if (r) {
+    r = -r;
+    std::cerr << __func__ << " " << off << "~" << len << " error: " << stupid::common::cpp_strerror(r) << std::endl;
+  }
+  return r;
+}
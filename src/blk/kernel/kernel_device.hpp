@@ -1,16 +1,58 @@
 #ifndef STUPID__BLK_KERNEL_DEVICE_HPP
 #define STUPID__BLK_KERNEL_DEVICE_HPP
 
+#include <atomic>
+#include <memory>
+
+#include "common/thread.hpp"
+
 #include "blk/block_device.hpp"
+#include "blk/kernel/elevator.hpp"
+#include "blk/kernel/io_queue.hpp"
 
 class KernelDevice : public BlockDevice {
 private:
-    std::string devname;
+  int fd_direct = -1;
+  int fd_buffered = -1;
+  std::string path;
+  std::string devname;
+  // largest IO aio_submit() builds by merging pending ones
+  uint64_t max_merge = 0;
+  bool aio = true;
+  bool dio = true;
+
+  aio_queue_t io_queue;
+  std::atomic_bool aio_stop = {false};
+  // orders the aios of a rotational device, nullptr otherwise
+  std::unique_ptr<AioElevator> elevator;
+
+  struct AioCompletionThread : public stupid::common::Thread {
+    KernelDevice *bdev;
+    explicit AioCompletionThread(KernelDevice *b) : bdev(b) {}
+    void *entry() override {
+      bdev->_aio_thread();
+      return nullptr;
+    }
+  } aio_thread;
+
+  void _aio_thread();
+  int _aio_start();
+  int _merge_pending(IOContext *ioc);
+  int _elevator_dispatch(int nr_completed = 0);
+  void _aio_stop();
+
+  int _lock();
+  int _sync_io(bool write, int fd, uint64_t off, uint64_t len, char *buf);
+
 public:
-  KernelDevice(aio_callback_t cb, void *cbpriv, aio_callback_t d_cb, void *d_cbpriv) : BlockDevice(cb, cbpriv)
-  {}
+  KernelDevice(aio_callback_t cb, void *cbpriv, aio_callback_t d_cb, void *d_cbpriv);
+
+  void aio_submit(IOContext *ioc) override;
 
-  void aio_submit(IOContext *ioc) override {};
+  // aio on the O_DIRECT fd already DMAs from the caller's memory when it is
+  // block aligned, there is no bounce copy to skip
+  int register_memory(void *addr, uint64_t len) override { return 0; }
+  int unregister_memory(void *addr, uint64_t len) override { return 0; }
 
   int get_devname(std::string *s) const override {
     if (devname.empty()) {
@@ -30,7 +72,7 @@ public:
   //bool try_discard(interval_set<uint64_t> &to_release, bool async = true) override;
   //void discard_drain() override;
 
-  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override { return 0; }
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
 
   int read(
     uint64_t off,
@@ -38,20 +80,20 @@ public:
     //ceph::buffer::list *pbl,
     char* buf,
     IOContext *ioc,
-    bool buffered)  override { return 0; }
+    bool buffered) override;
 
   int read_random(
     uint64_t off,
     uint64_t len,
     char *buf,
-    bool buffered) override { return 0; }
+    bool buffered) override;
 
   int aio_read(
     uint64_t off,
     uint64_t len,
     //ceph::buffer::list *pbl,
     char* buf,
-    IOContext *ioc) override { return 0; }
+    IOContext *ioc) override;
 
   int write(
     uint64_t off,
@@ -59,7 +101,7 @@ public:
     uint64_t len,
     char* buf,
     bool buffered,
-    int write_hint = WRITE_LIFE_NOT_SET) override { return 0; }
+    int write_hint = WRITE_LIFE_NOT_SET) override;
 
   int aio_write(
     uint64_t off,
@@ -68,14 +110,14 @@ public:
     char* buf,
     IOContext *ioc,
     bool buffered,
-    int write_hint = WRITE_LIFE_NOT_SET) override { return 0; }
+    int write_hint = WRITE_LIFE_NOT_SET) override;
 
-  int flush() override { return 0; }
+  int flush() override;
 
   // for managing buffered readers/writers
-  int invalidate_cache(uint64_t off, uint64_t len) override { return 0; }
-  int open(const std::string& path) override { return 0; }
-  void close() override {}
+  int invalidate_cache(uint64_t off, uint64_t len) override;
+  int open(const std::string& path) override;
+  void close() override;
 };
 
 #endif //STUPID__BLK_KERNEL_DEVICE_HPP
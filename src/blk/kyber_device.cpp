@@ -0,0 +1,344 @@
+#include <assert.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "common/util.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/kyber_device.hpp"
+
+int KyberBlockDevice::open(const std::string& path)
+{
+  int r = dev->open(path);
+  if (r < 0) {
+    return r;
+  }
+  copy_geometry();
+
+  write_depth = std::max<uint32_t>(blk_options.bdev_kyber_write_depth_max, 1);
+  writes_inflight = 0;
+  window_full = false;
+  window_start = stupid::common::mono_ns();
+  lat[READ].reset();
+  lat[WRITE].reset();
+  stop = false;
+  dispatch_thread.create("blk_kyber");
+  return 0;
+}
+
+void KyberBlockDevice::close()
+{
+  {
+    std::lock_guard l(lock);
+    stop = true;
+  }
+  cond.notify_all();
+  dispatch_thread.join();
+  dev->close();
+}
+
+void KyberBlockDevice::_dispatch_thread()
+{
+  std::cout << __func__ << " start" << std::endl;
+
+  std::vector<leg_t*> go;
+  std::unique_lock l(lock);
+  while (!stop) {
+    dispatch(go);
+    if (!go.empty()) {
+      l.unlock();
+      for (leg_t *w : go) {
+        issue(w);
+      }
+      go.clear();
+      l.lock();
+      continue;
+    }
+    cond.wait(l);
+  }
+
+  // nothing may stay held, depth or not
+  while (!waiting.empty()) {
+    go.push_back(waiting.front());
+    writes_inflight += waiting.front()->ios;
+    waiting.pop_front();
+  }
+  l.unlock();
+  for (leg_t *w : go) {
+    issue(w);
+  }
+
+  std::cout << __func__ << " end" << std::endl;
+}
+
+KyberBlockDevice::split_t *KyberBlockDevice::split_of(IOContext *parent)
+{
+  split_t *s = static_cast<split_t*>(parent->fanout);
+  if (!s) {
+    s = new split_t;
+    s->parent = parent;
+    for (int d = READ; d <= WRITE; ++d) {
+      s->legs[d].s = s;
+      s->legs[d].dir = d;
+    }
+    parent->fanout = s;
+  }
+  return s;
+}
+
+IOContext *KyberBlockDevice::leg_ioc(IOContext *parent, int dir)
+{
+  leg_t &leg = split_of(parent)->legs[dir];
+  if (!leg.ioc) {
+    leg.ioc = new IOContext(&leg, parent->allow_eio);
+    leg.ioc->prio = parent->prio;
+    leg.ioc->flags = parent->flags;
+    leg.ioc->qos_client = parent->qos_client;
+  }
+  return leg.ioc;
+}
+
+void KyberBlockDevice::issue(leg_t *leg)
+{
+  leg->stamp = stupid::common::mono_ns();
+  dev->aio_submit(leg->ioc);
+}
+
+void KyberBlockDevice::dispatch(std::vector<leg_t*>& out)
+{
+  while (!waiting.empty()) {
+    leg_t *leg = waiting.front();
+    // one write at a time always goes, however big
+    if (writes_inflight > 0 && writes_inflight + leg->ios > write_depth) {
+      window_full = true;
+      break;
+    }
+    waiting.pop_front();
+    writes_inflight += leg->ios;
+    out.push_back(leg);
+  }
+}
+
+void KyberBlockDevice::aio_submit(IOContext *ioc)
+{
+  split_t *s = static_cast<split_t*>(ioc->fanout);
+  if (!s) {
+    return;
+  }
+  // the next aios queued into ioc make a new split
+  ioc->fanout = nullptr;
+  ioc->num_pending = 0;
+
+  leg_t *legs[2] = {};
+  int n = 0;
+  for (int d = READ; d <= WRITE; ++d) {
+    leg_t &leg = s->legs[d];
+    if (!leg.ioc) {
+      continue;
+    }
+    if (leg.ioc->has_pending_aios()) {
+      legs[n++] = &leg;
+    } else {
+      // the aios failed when queued, or the device did them synchronously
+      delete leg.ioc;
+      leg.ioc = nullptr;
+    }
+  }
+  if (n == 0) {
+    delete s;
+    return;
+  }
+
+  ++ioc->num_running;
+  s->outstanding = n;
+  std::vector<leg_t*> go;
+  for (int i = 0; i < n; ++i) {
+    if (legs[i]->dir == READ) {
+      go.push_back(legs[i]);
+      continue;
+    }
+    std::lock_guard l(lock);
+    waiting.push_back(legs[i]);
+    size_t before = go.size();
+    dispatch(go);
+    if (go.size() == before) {
+      ++held;
+    }
+  }
+  // s may be gone once the last leg is issued
+  for (leg_t *leg : go) {
+    issue(leg);
+  }
+}
+
+void KyberBlockDevice::adapt_depth(uint64_t now)
+{
+  if (now - window_start < blk_options.bdev_kyber_window_ms * 1000000ull) {
+    return;
+  }
+  uint64_t reads = lat[READ].count();
+  uint64_t read_p = lat[READ].percentile(blk_options.bdev_kyber_percentile);
+  uint64_t write_p = lat[WRITE].percentile(blk_options.bdev_kyber_percentile);
+  uint64_t read_target = blk_options.bdev_kyber_read_target_us * 1000ull;
+  uint64_t write_target = blk_options.bdev_kyber_write_target_us * 1000ull;
+  uint32_t max_depth = std::max<uint32_t>(blk_options.bdev_kyber_write_depth_max, 1);
+
+  if (reads > 0 && read_p > read_target) {
+    // the further over target, the harder the cut, down to a quarter
+    uint32_t d = std::max<uint64_t>(write_depth * std::max(read_target, read_p / 4) / read_p, 1);
+    if (d < write_depth) {
+      write_depth = d;
+      ++shrinks;
+    }
+  } else if (window_full && write_depth < max_depth && (reads == 0 || write_p <= write_target)) {
+    write_depth = std::min(max_depth, write_depth + std::max<uint32_t>(write_depth / 4, 1));
+    ++grows;
+  }
+
+  last_read_p = read_p;
+  last_write_p = write_p;
+  lat[READ].reset();
+  lat[WRITE].reset();
+  window_start = now;
+  window_full = false;
+}
+
+void KyberBlockDevice::finished(leg_t *leg, std::vector<IOContext*>& done)
+{
+  split_t *s = leg->s;
+  uint64_t now = stupid::common::mono_ns();
+  lat[leg->dir].add(now - leg->stamp);
+  if (int r = leg->ioc->get_return_value(); r < 0) {
+    s->parent->set_return_value(r);
+  }
+  // we are on the wrapped device's completion path, it frees the ioc later
+  dev->queue_reap_ioc(leg->ioc);
+
+  bool kick;
+  {
+    std::lock_guard l(lock);
+    if (leg->dir == WRITE) {
+      writes_inflight -= leg->ios;
+    }
+    adapt_depth(now);
+    kick = !waiting.empty();
+  }
+  // issuing from here would nest into the wrapped device's completion path
+  // (and its queue leases), the dispatch thread does it
+  if (kick) {
+    cond.notify_one();
+  }
+
+  if (--s->outstanding == 0) {
+    IOContext *parent = s->parent;
+    delete s;
+    // see KernelDevice::_aio_thread for the waker logic
+    if (parent->priv) {
+      if (--parent->num_running == 0) {
+        done.push_back(parent);
+      }
+    } else {
+      parent->try_aio_wake();
+    }
+  }
+}
+
+void KyberBlockDevice::leg_aio_cb(void *priv, void *leg_priv)
+{
+  KyberBlockDevice *self = static_cast<KyberBlockDevice*>(priv);
+  std::vector<IOContext*> done;
+  self->finished(static_cast<leg_t*>(leg_priv), done);
+  self->aio_complete_batch(done);
+}
+
+void KyberBlockDevice::leg_batch_cb(void *priv, std::vector<IOContext*>& iocs)
+{
+  KyberBlockDevice *self = static_cast<KyberBlockDevice*>(priv);
+  std::vector<IOContext*> done;
+  for (IOContext *ioc : iocs) {
+    self->finished(static_cast<leg_t*>(ioc->priv), done);
+  }
+  self->aio_complete_batch(done);
+}
+
+void KyberBlockDevice::pended(IOContext *c, IOContext *ioc, int before)
+{
+  // the wrapped device may have done the aio synchronously, leaving nothing
+  // to throttle or to wait for
+  int n = c->num_pending - before;
+  static_cast<leg_t*>(c->priv)->ios += n;
+  ioc->num_pending += n;
+}
+
+int KyberBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  IOContext *c = leg_ioc(ioc, READ);
+  int before = c->num_pending;
+  int r = dev->aio_read(off, len, buf, c);
+  pended(c, ioc, before);
+  return r;
+}
+
+int KyberBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  IOContext *c = leg_ioc(ioc, WRITE);
+  int before = c->num_pending;
+  int r = dev->aio_write(off, len, buf, c, buffered, write_hint);
+  pended(c, ioc, before);
+  return r;
+}
+
+int KyberBlockDevice::sync_io(IOContext *ioc, const std::function<int(IOContext*)>& queue)
+{
+  IOContext sync(nullptr, ioc ? ioc->allow_eio : false);
+  if (ioc) {
+    sync.prio = ioc->prio;
+    sync.flags = ioc->flags;
+    sync.qos_client = ioc->qos_client;
+  }
+  int r = queue(&sync);
+  aio_submit(&sync);
+  sync.aio_wait();
+  if (r < 0) {
+    return r;
+  }
+  return sync.get_return_value();
+}
+
+int KyberBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  // reads are never held, only timed
+  uint64_t start = stupid::common::mono_ns();
+  int r = dev->read(off, len, buf, ioc, buffered);
+  lat[READ].add(stupid::common::mono_ns() - start);
+  return r;
+}
+
+int KyberBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  uint64_t start = stupid::common::mono_ns();
+  int r = dev->read_random(off, len, buf, buffered);
+  lat[READ].add(stupid::common::mono_ns() - start);
+  return r;
+}
+
+int KyberBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  return sync_io(nullptr, [&](IOContext *sync) {
+    return aio_write(off, len, buf, sync, buffered, write_hint);
+  });
+}
+
+int KyberBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  int r = dev->collect_metadata(prefix, pm);
+  (*pm)[prefix + "kyber_write_depth"] = std::to_string(write_depth);
+  (*pm)[prefix + "kyber_writes_held"] = std::to_string(held.load());
+  (*pm)[prefix + "kyber_shrinks"] = std::to_string(shrinks.load());
+  (*pm)[prefix + "kyber_grows"] = std::to_string(grows.load());
+  (*pm)[prefix + "kyber_read_p_ns"] = std::to_string(last_read_p.load());
+  (*pm)[prefix + "kyber_write_p_ns"] = std::to_string(last_write_p.load());
+  return r;
+}
@@ -0,0 +1,142 @@
+#ifndef STUPID__BLK_KYBER_DEVICE_HPP
+#define STUPID__BLK_KYBER_DEVICE_HPP
+
+#include <atomic>
+#include <deque>
+#include <functional>
+
+#include "common/histogram.hpp"
+#include "common/mutex.hpp"
+#include "common/thread.hpp"
+
+#include "blk/device_decorator.hpp"
+
+// Decorator keeping writes from ruining the read latency, the way Kyber
+// does: reads go to the device at once, writes only as long as fewer than
+// the write depth are in flight. Every bdev_kyber_window_ms the read and
+// write latencies seen by the device are compared with their targets:
+// reads over bdev_kyber_read_target_us shrink the write depth; once they are
+// back under it, the depth opens up again, unless the writes themselves are
+// over bdev_kyber_write_target_us and a deeper queue would not help them.
+//
+// aio_read/aio_write queue the reads and the writes of an IOContext into
+// two child IOContexts, submitted to the wrapped device on their own; the
+// parent completes with the last of them. Writes released by a completion
+// are issued by the dispatch thread, not on the completion path. Created by
+// BlockDevice::create() when blk_options.bdev_kyber is set.
+class KyberBlockDevice : public BlockDeviceDecorator {
+  enum { READ = 0, WRITE = 1 };
+
+  struct split_t;
+  struct leg_t {
+    split_t *s = nullptr;
+    int dir = READ;
+    IOContext *ioc = nullptr;
+    uint64_t ios = 0;
+    uint64_t stamp = 0;
+  };
+
+  // the reads and the writes of a parent IOContext
+  struct split_t {
+    IOContext *parent = nullptr;
+    leg_t legs[2];
+    std::atomic_int outstanding = {0};
+  };
+
+  stupid::common::mutex lock = stupid::common::make_mutex("KyberBlockDevice::lock");
+  stupid::common::condition_variable cond;
+  bool stop = false;
+  std::deque<leg_t*> waiting;                 // writes held back, FIFO
+  uint32_t write_depth = 0;
+  uint32_t writes_inflight = 0;
+  bool window_full = false;                   // the depth held writes back
+  uint64_t window_start = 0;
+
+  stupid::common::LatencyHistogram lat[2];    // this window
+  std::atomic<uint64_t> held = {0}, shrinks = {0}, grows = {0};
+  std::atomic<uint64_t> last_read_p = {0}, last_write_p = {0};
+
+  struct DispatchThread : public stupid::common::Thread {
+    KyberBlockDevice *bdev;
+    explicit DispatchThread(KyberBlockDevice *b) : bdev(b) {}
+    void *entry() override {
+      bdev->_dispatch_thread();
+      return nullptr;
+    }
+  } dispatch_thread;
+
+  // issues the writes the completions make room for
+  void _dispatch_thread();
+
+  split_t *split_of(IOContext *parent);
+  IOContext *leg_ioc(IOContext *parent, int dir);
+  // an aio was queued into the leg ioc c, which had before aios pending
+  void pended(IOContext *c, IOContext *ioc, int before);
+  void issue(leg_t *leg);
+  // writes which may go now, to issue outside the lock
+  void dispatch(std::vector<leg_t*>& out);
+  void adapt_depth(uint64_t now);
+
+  void finished(leg_t *leg, std::vector<IOContext*>& done);
+  static void leg_aio_cb(void *priv, void *leg_priv);
+  static void leg_batch_cb(void *priv, std::vector<IOContext*>& iocs);
+
+  int sync_io(IOContext *ioc, const std::function<int(IOContext*)>& queue);
+
+public:
+  KyberBlockDevice(BlockDevice *dev, aio_callback_t cb, void *cbpriv)
+    : BlockDeviceDecorator(dev, cb, cbpriv), dispatch_thread(this) {
+    // the completions of the wrapped device come here first
+    this->dev->set_aio_callback(leg_aio_cb, this);
+    this->dev->set_aio_batch_callback(leg_batch_cb, this);
+  }
+
+  void set_aio_callback(aio_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_callback(cb, cbpriv);
+  }
+  void set_aio_batch_callback(aio_batch_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_batch_callback(cb, cbpriv);
+  }
+
+  void aio_submit(IOContext *ioc) override;
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_KYBER_DEVICE_HPP
@@ -0,0 +1,397 @@
+#include <assert.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include "common/util.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/mclock_device.hpp"
+
+int MClockBlockDevice::open(const std::string& path)
+{
+  int r = dev->open(path);
+  if (r < 0) {
+    return r;
+  }
+  copy_geometry();
+
+  depth = std::max<uint32_t>(blk_options.bdev_mclock_depth_min, 1);
+  inflight = 0;
+  window_start = stupid::common::mono_ns();
+  window_ios = 0;
+  window_full = false;
+  last_tput = 0;
+  going_up = true;
+  stop = false;
+  timer_thread.create("blk_mclock");
+  return 0;
+}
+
+void MClockBlockDevice::close()
+{
+  {
+    std::lock_guard l(lock);
+    stop = true;
+  }
+  cond.notify_all();
+  timer_thread.join();
+  dev->close();
+}
+
+int MClockBlockDevice::set_qos_client(uint32_t client, double reservation, double weight, double limit)
+{
+  if (reservation < 0 || weight <= 0 || limit < 0 || (limit > 0 && limit < reservation)) {
+    return -EINVAL;
+  }
+  std::lock_guard l(lock);
+  client_t &c = client_of(client);
+  c.reservation = reservation;
+  c.weight = weight;
+  c.limit = limit;
+  return 0;
+}
+
+MClockBlockDevice::client_t &MClockBlockDevice::client_of(uint32_t id)
+{
+  auto it = clients.find(id);
+  if (it == clients.end()) {
+    it = clients.emplace(id, client_t()).first;
+    it->second.reservation = blk_options.bdev_mclock_reservation;
+    it->second.weight = std::max(blk_options.bdev_mclock_weight, 0.001);
+    it->second.limit = blk_options.bdev_mclock_limit;
+  }
+  return it->second;
+}
+
+void MClockBlockDevice::tag_head(client_t &c)
+{
+  // a tenant coming back from idle starts from the arrival of its request,
+  // it does not get the time it was away as credit
+  double cost = c.queue.front()->ios * 1e9;
+  double now = c.queue.front()->arrival;
+  c.r_tag = c.reservation > 0 ? std::max(c.prev_r + cost / c.reservation, now) : HUGE_VAL;
+  c.p_tag = std::max(c.prev_p + cost / c.weight, now);
+  c.l_tag = c.limit > 0 ? std::max(c.prev_l + cost / c.limit, now) : 0;
+}
+
+MClockBlockDevice::req_t *MClockBlockDevice::pick(uint64_t now)
+{
+  client_t *best = nullptr;
+  // constraint based: the reservations which are due
+  for (auto &[id, c] : clients) {
+    if (!c.queue.empty() && c.r_tag <= now && (!best || c.r_tag < best->r_tag)) {
+      best = &c;
+    }
+  }
+  bool reserved = best != nullptr;
+  if (!best) {
+    // weight based, among the tenants under their limit
+    next_eligible = 0;
+    for (auto &[id, c] : clients) {
+      if (c.queue.empty()) {
+        continue;
+      }
+      if (c.l_tag > now) {
+        if (!next_eligible || c.l_tag < next_eligible) {
+          next_eligible = c.l_tag;
+        }
+        continue;
+      }
+      if (!best || c.p_tag < best->p_tag) {
+        best = &c;
+      }
+    }
+    if (!best) {
+      return nullptr;
+    }
+  }
+
+  req_t *req = best->queue.front();
+  best->queue.pop_front();
+  --queued;
+  best->ios += req->ios;
+  if (reserved) {
+    best->reserved_ios += req->ios;
+    best->prev_r = best->r_tag;
+  }
+  // a request served by weight does not use up the reservation: the next
+  // reservation tag follows the previous one, not this request
+  best->prev_p = best->p_tag;
+  best->prev_l = best->l_tag;
+  if (!best->queue.empty()) {
+    tag_head(*best);
+  }
+  return req;
+}
+
+void MClockBlockDevice::dispatch(std::vector<req_t*>& out)
+{
+  uint64_t now = stupid::common::mono_ns();
+  while (queued > 0) {
+    if (inflight >= depth) {
+      window_full = true;
+      break;
+    }
+    req_t *req = pick(now);
+    if (!req) {
+      // all held by their limits; the timer thread takes over
+      cond.notify_one();
+      break;
+    }
+    ++inflight;
+    out.push_back(req);
+  }
+}
+
+void MClockBlockDevice::submit(std::vector<req_t*>& reqs)
+{
+  for (req_t *req : reqs) {
+    dev->aio_submit(req->child);
+  }
+  reqs.clear();
+}
+
+void MClockBlockDevice::adapt_depth(uint64_t now)
+{
+  uint64_t elapsed = now - window_start;
+  if (elapsed < blk_options.bdev_mclock_window_ms * 1000000ull) {
+    return;
+  }
+  double tput = window_ios * 1e9 / elapsed;
+  if (window_full) {
+    // climb while deeper pays off by 5%, and go back down while shallower
+    // costs less than that
+    if (going_up) {
+      going_up = tput >= last_tput * 1.05;
+    } else {
+      going_up = tput < last_tput * 0.95;
+    }
+    uint32_t d = going_up ? depth + std::max<uint32_t>(depth / 4, 1) : depth - std::max<uint32_t>(depth / 8, 1);
+    depth = std::min(std::max(d, std::max<uint32_t>(blk_options.bdev_mclock_depth_min, 1)),
+      std::max(blk_options.bdev_mclock_depth_max, blk_options.bdev_mclock_depth_min));
+    last_tput = tput;
+  }
+  // an idle window tells nothing about the device
+  window_start = now;
+  window_ios = 0;
+  window_full = false;
+}
+
+MClockBlockDevice::req_t *MClockBlockDevice::req_of(IOContext *parent)
+{
+  req_t *req = static_cast<req_t*>(parent->fanout);
+  if (!req) {
+    req = new req_t;
+    req->dev = this;
+    req->parent = parent;
+    req->child = new IOContext(req, parent->allow_eio);
+    req->child->prio = parent->prio;
+    req->child->flags = parent->flags;
+    req->child->qos_client = parent->qos_client;
+    parent->fanout = req;
+  }
+  return req;
+}
+
+void MClockBlockDevice::aio_submit(IOContext *ioc)
+{
+  req_t *req = static_cast<req_t*>(ioc->fanout);
+  if (!req) {
+    return;
+  }
+  // the next aios queued into ioc make a new request
+  ioc->fanout = nullptr;
+  ioc->num_pending = 0;
+  if (!req->child->has_pending_aios()) {
+    // nothing went to the device: the aios failed when queued, or the
+    // device did them synchronously
+    delete req->child;
+    delete req;
+    return;
+  }
+  ++ioc->num_running;
+
+  std::vector<req_t*> go;
+  {
+    std::lock_guard l(lock);
+    client_t &c = client_of(ioc->qos_client);
+    req->client = &c;
+    req->arrival = stupid::common::mono_ns();
+    c.queue.push_back(req);
+    ++queued;
+    if (c.queue.size() == 1) {
+      tag_head(c);
+    }
+    dispatch(go);
+  }
+  submit(go);
+}
+
+void MClockBlockDevice::finished(req_t *req, std::vector<IOContext*>& done)
+{
+  IOContext *parent = req->parent;
+  if (int r = req->child->get_return_value(); r < 0) {
+    parent->set_return_value(r);
+  }
+  // we are on the wrapped device's completion path, it frees the ioc later
+  dev->queue_reap_ioc(req->child);
+
+  bool kick;
+  {
+    std::lock_guard l(lock);
+    --inflight;
+    window_ios += req->ios;
+    adapt_depth(stupid::common::mono_ns());
+    kick = queued > 0;
+  }
+  // submitting from here would nest into the wrapped device's completion
+  // path (and its queue leases), the timer thread does it
+  if (kick) {
+    cond.notify_one();
+  }
+  ++completed;
+  delete req;
+
+  // see KernelDevice::_aio_thread for the waker logic
+  if (parent->priv) {
+    if (--parent->num_running == 0) {
+      done.push_back(parent);
+    }
+  } else {
+    parent->try_aio_wake();
+  }
+}
+
+void MClockBlockDevice::child_aio_cb(void *priv, void *child_priv)
+{
+  MClockBlockDevice *self = static_cast<MClockBlockDevice*>(priv);
+  std::vector<IOContext*> done;
+  self->finished(static_cast<req_t*>(child_priv), done);
+  self->aio_complete_batch(done);
+}
+
+void MClockBlockDevice::child_batch_cb(void *priv, std::vector<IOContext*>& iocs)
+{
+  MClockBlockDevice *self = static_cast<MClockBlockDevice*>(priv);
+  std::vector<IOContext*> done;
+  for (IOContext *child : iocs) {
+    self->finished(static_cast<req_t*>(child->priv), done);
+  }
+  self->aio_complete_batch(done);
+}
+
+void MClockBlockDevice::_timer_thread()
+{
+  std::cout << __func__ << " start" << std::endl;
+
+  std::vector<req_t*> go;
+  std::unique_lock l(lock);
+  while (!stop) {
+    next_eligible = 0;
+    dispatch(go);
+    if (!go.empty()) {
+      l.unlock();
+      submit(go);
+      l.lock();
+      continue;
+    }
+    // woken by a completion making room, or when a limit lets a tenant go
+    uint64_t now = stupid::common::mono_ns();
+    if (next_eligible > now) {
+      cond.wait_for(l, std::chrono::nanoseconds(next_eligible - now));
+    } else {
+      cond.wait(l);
+    }
+  }
+
+  // nothing may stay queued, limits or not
+  while (queued > 0) {
+    for (auto &[id, c] : clients) {
+      while (!c.queue.empty()) {
+        go.push_back(c.queue.front());
+        c.queue.pop_front();
+        --queued;
+        ++inflight;
+      }
+    }
+  }
+  l.unlock();
+  submit(go);
+
+  std::cout << __func__ << " end" << std::endl;
+}
+
+void MClockBlockDevice::pended(req_t *req, IOContext *ioc, int before)
+{
+  // the wrapped device may have done the aio synchronously, leaving nothing
+  // to schedule or to wait for
+  int n = req->child->num_pending - before;
+  req->ios += n;
+  ioc->num_pending += n;
+}
+
+int MClockBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  req_t *req = req_of(ioc);
+  int before = req->child->num_pending;
+  int r = dev->aio_read(off, len, buf, req->child);
+  pended(req, ioc, before);
+  return r;
+}
+
+int MClockBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  req_t *req = req_of(ioc);
+  int before = req->child->num_pending;
+  int r = dev->aio_write(off, len, buf, req->child, buffered, write_hint);
+  pended(req, ioc, before);
+  return r;
+}
+
+int MClockBlockDevice::sync_io(IOContext *ioc, const std::function<int(IOContext*)>& queue)
+{
+  IOContext sync(nullptr, ioc ? ioc->allow_eio : false);
+  if (ioc) {
+    sync.prio = ioc->prio;
+    sync.flags = ioc->flags;
+    sync.qos_client = ioc->qos_client;
+  }
+  int r = queue(&sync);
+  aio_submit(&sync);
+  sync.aio_wait();
+  if (r < 0) {
+    return r;
+  }
+  return sync.get_return_value();
+}
+
+int MClockBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  return sync_io(ioc, [&](IOContext *sync) {
+    return aio_read(off, len, buf, sync);
+  });
+}
+
+int MClockBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  return sync_io(nullptr, [&](IOContext *sync) {
+    return aio_write(off, len, buf, sync, buffered, write_hint);
+  });
+}
+
+int MClockBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  int r = dev->collect_metadata(prefix, pm);
+  (*pm)[prefix + "mclock_depth"] = std::to_string(depth);
+  (*pm)[prefix + "mclock_completed"] = std::to_string(completed.load());
+  std::lock_guard l(lock);
+  for (auto &[id, c] : clients) {
+    std::string p = prefix + "mclock_client" + std::to_string(id) + "_";
+    (*pm)[p + "ios"] = std::to_string(c.ios);
+    (*pm)[p + "reserved_ios"] = std::to_string(c.reserved_ios);
+  }
+  return r;
+}
@@ -0,0 +1,152 @@
+#ifndef STUPID__BLK_MCLOCK_DEVICE_HPP
+#define STUPID__BLK_MCLOCK_DEVICE_HPP
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+
+#include "common/mutex.hpp"
+#include "common/thread.hpp"
+
+#include "blk/device_decorator.hpp"
+
+// Decorator sharing the device between tenants (IOContext::qos_client) the
+// mClock way. Each tenant has a reservation and a limit in IOPS and a
+// weight, set with set_qos_client() (bdev_mclock_* by default); the head
+// request of every tenant's queue is tagged with the time it is due by each
+// of them. Requests whose reservation tag has passed go first, in tag order;
+// then, among the tenants under their limit, the smallest weight tag.
+// Capacity handed out beyond the reservations therefore goes by weight.
+//
+// The unit is the aio_submit() of an IOContext, costing one per aio queued
+// into it. aio_read/aio_write queue into a child IOContext which is
+// submitted to the wrapped device once scheduled; the wrapped device calls
+// back into this one. Only that many are in flight at a time as it takes
+// to keep the device busy: the depth is adapted between
+// bdev_mclock_depth_min and bdev_mclock_depth_max by hill climbing on the
+// throughput measured every bdev_mclock_window_ms. What a completion makes
+// room for is submitted by the timer thread, not on the completion path. Created by
+// BlockDevice::create() when blk_options.bdev_mclock is set.
+class MClockBlockDevice : public BlockDeviceDecorator {
+  struct client_t;
+
+  struct req_t {
+    MClockBlockDevice *dev;
+    IOContext *parent;
+    IOContext *child;
+    client_t *client;
+    uint64_t ios = 0;
+    uint64_t arrival = 0;
+  };
+
+  struct client_t {
+    double reservation, weight, limit;
+    std::deque<req_t*> queue;
+    // tags of the head of the queue, and of the request before it (ns)
+    double r_tag = 0, p_tag = 0, l_tag = 0;
+    double prev_r = 0, prev_p = 0, prev_l = 0;
+    uint64_t ios = 0, reserved_ios = 0;
+  };
+
+  mutable stupid::common::mutex lock = stupid::common::make_mutex("MClockBlockDevice::lock");
+  stupid::common::condition_variable cond;
+  std::unordered_map<uint32_t, client_t> clients;
+  uint32_t queued = 0;
+  bool stop = false;
+
+  // depth control
+  uint32_t depth = 0;
+  uint32_t inflight = 0;
+  uint64_t window_start = 0, window_ios = 0;
+  bool window_full = false;      // the depth held requests back
+  double last_tput = 0;
+  bool going_up = true;
+  std::atomic<uint64_t> completed = {0};
+
+  // the next time a limit lets a tenant go, for the timer thread; it also
+  // submits what the completions make room for
+  uint64_t next_eligible = 0;
+
+  struct TimerThread : public stupid::common::Thread {
+    MClockBlockDevice *bdev;
+    explicit TimerThread(MClockBlockDevice *b) : bdev(b) {}
+    void *entry() override {
+      bdev->_timer_thread();
+      return nullptr;
+    }
+  } timer_thread;
+
+  void _timer_thread();
+
+  client_t &client_of(uint32_t id);
+  void tag_head(client_t &c);
+  // the next request in mClock order, nullptr if none may go now
+  req_t *pick(uint64_t now);
+  // pick as many as the depth allows, to submit outside the lock
+  void dispatch(std::vector<req_t*>& out);
+  void submit(std::vector<req_t*>& reqs);
+  void adapt_depth(uint64_t now);
+
+  req_t *req_of(IOContext *parent);
+  // an aio was queued into req->child, which had before aios pending
+  void pended(req_t *req, IOContext *ioc, int before);
+  // a child completed; the parent goes to done if it is finished too
+  void finished(req_t *req, std::vector<IOContext*>& done);
+  static void child_aio_cb(void *priv, void *child_priv);
+  static void child_batch_cb(void *priv, std::vector<IOContext*>& iocs);
+
+  int sync_io(IOContext *ioc, const std::function<int(IOContext*)>& queue);
+
+public:
+  MClockBlockDevice(BlockDevice *dev, aio_callback_t cb, void *cbpriv)
+    : BlockDeviceDecorator(dev, cb, cbpriv), timer_thread(this) {
+    // the completions of the wrapped device come here first
+    this->dev->set_aio_callback(child_aio_cb, this);
+    this->dev->set_aio_batch_callback(child_batch_cb, this);
+  }
+
+  void set_aio_callback(aio_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_callback(cb, cbpriv);
+  }
+  void set_aio_batch_callback(aio_batch_callback_t cb, void *cbpriv) override {
+    BlockDevice::set_aio_batch_callback(cb, cbpriv);
+  }
+
+  void aio_submit(IOContext *ioc) override;
+  int set_qos_client(uint32_t client, double reservation, double weight, double limit) override;
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_MCLOCK_DEVICE_HPP
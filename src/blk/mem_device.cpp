@@ -0,0 +1,284 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "common/bit_op.hpp"
+#include "common/util.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/mem_device.hpp"
+
+// "<type>" or "<type>:<size>", the size with an optional K/M/G/T suffix
+static int parse_size(const std::string& path, const std::string& type, uint64_t *size)
+{
+  *size = blk_options.bdev_mem_size;
+  if (path.size() <= type.size() + 1) {
+    return 0;
+  }
+  const char *s = path.c_str() + type.size() + 1;
+  char *end;
+  uint64_t v = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'T': case 't': v <<= 10; [[fallthrough]];
+  case 'G': case 'g': v <<= 10; [[fallthrough]];
+  case 'M': case 'm': v <<= 10; [[fallthrough]];
+  case 'K': case 'k': v <<= 10; ++end; break;
+  default: break;
+  }
+  if (end == s || *end != '\0' || v == 0) {
+    return -EINVAL;
+  }
+  *size = v;
+  return 0;
+}
+
+int NullBlockDevice::open(const std::string& path)
+{
+  std::string type = type_name();
+  uint64_t sz;
+  if (int r = parse_size(path, type, &sz); r < 0) {
+    std::cerr << __func__ << " bad size in " << path << std::endl;
+    return r;
+  }
+  block_size = blk_options.bdev_block_size;
+  size = sz & ~(block_size - 1);
+  rotational = false;
+  if (size == 0) {
+    std::cerr << __func__ << " " << path << " is smaller than a block" << std::endl;
+    return -EINVAL;
+  }
+  if (int r = setup(); r < 0) {
+    return r;
+  }
+
+  stop = false;
+  channels.assign(std::max<uint32_t>(blk_options.bdev_null_channels, 1), 0);
+  if (!blk_options.bdev_mem_inline_completion) {
+    completion_thread.create(("blk_" + type + "_aio").c_str());
+  }
+  std::cout << __func__ << " " << type << " size " << size << " block_size " << block_size << std::endl;
+  return 0;
+}
+
+void NullBlockDevice::close()
+{
+  if (completion_thread.is_started()) {
+    {
+      std::lock_guard l(lock);
+      stop = true;
+    }
+    cond.notify_all();
+    completion_thread.join();
+  }
+  reap_ioc();
+  teardown();
+}
+
+bool NullBlockDevice::complete(IOContext *ioc)
+{
+  // see KernelDevice::_aio_thread for the waker logic
+  if (ioc->priv) {
+    return --ioc->num_running == 0;
+  }
+  ioc->try_aio_wake();
+  return false;
+}
+
+void NullBlockDevice::_completion_thread()
+{
+  std::cout << __func__ << " start" << std::endl;
+
+  std::vector<IOContext*> finished;
+  std::vector<IOContext*> batch;
+  std::unique_lock l(lock);
+  while (true) {
+    if (completing.empty()) {
+      if (stop) {
+        break;
+      }
+      cond.wait(l);
+      continue;
+    }
+    uint64_t now = stupid::common::mono_ns();
+    auto due = completing.upper_bound(now);
+    if (due == completing.begin() && !stop) {
+      cond.wait_for(l, std::chrono::nanoseconds(due->first - now));
+      continue;
+    }
+    if (stop) {
+      due = completing.end();
+    }
+    for (auto it = completing.begin(); it != due; ++it) {
+      batch.push_back(it->second);
+    }
+    completing.erase(completing.begin(), due);
+    l.unlock();
+
+    for (IOContext *ioc : batch) {
+      if (complete(ioc)) {
+        finished.push_back(ioc);
+      }
+    }
+    batch.clear();
+    aio_complete_batch(finished);
+    reap_ioc(false);
+    l.lock();
+  }
+
+  std::cout << __func__ << " end" << std::endl;
+}
+
+void NullBlockDevice::aio_submit(IOContext *ioc)
+{
+  if (ioc->num_pending.load() == 0) {
+    return;
+  }
+  // the aios are done already, they complete as one
+  ioc->num_pending = 0;
+  ++ioc->num_running;
+
+  if (blk_options.bdev_mem_inline_completion) {
+    if (complete(ioc)) {
+      std::vector<IOContext*> finished = {ioc};
+      aio_complete_batch(finished);
+    }
+    reap_ioc(false);
+    return;
+  }
+
+  bool wake;
+  {
+    std::lock_guard l(lock);
+    uint64_t due = stupid::common::mono_ns();
+    if (blk_options.bdev_null_latency_us) {
+      // served by the channel free the soonest
+      auto ch = std::min_element(channels.begin(), channels.end());
+      due = std::max(due, *ch) + blk_options.bdev_null_latency_us * 1000ull;
+      *ch = due;
+    }
+    auto it = completing.emplace(due, ioc);
+    wake = it == completing.begin();
+  }
+  if (wake) {
+    cond.notify_one();
+  }
+}
+
+int NullBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  assert(is_valid_io(off, len));
+  ++nr_reads;
+  return transfer(false, off, len, buf);
+}
+
+int NullBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  assert(len > 0);
+  assert(off + len <= size);
+  ++nr_reads;
+  return transfer(false, off, len, buf);
+}
+
+int NullBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  assert(is_valid_io(off, len));
+  ++nr_reads;
+  if (int r = transfer(false, off, len, buf); r < 0) {
+    return r;
+  }
+  ++ioc->num_pending;
+  return 0;
+}
+
+int NullBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  assert(is_valid_io(off, len));
+  ++nr_writes;
+  return transfer(true, off, len, buf);
+}
+
+int NullBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  assert(is_valid_io(off, len));
+  ++nr_writes;
+  if (int r = transfer(true, off, len, buf); r < 0) {
+    return r;
+  }
+  ++ioc->num_pending;
+  return 0;
+}
+
+int NullBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  (*pm)[prefix + "driver"] = "NullBlockDevice";
+  (*pm)[prefix + "type"] = type_name();
+  (*pm)[prefix + "size"] = std::to_string(size);
+  (*pm)[prefix + "block_size"] = std::to_string(block_size);
+  (*pm)[prefix + "reads"] = std::to_string(nr_reads.load());
+  (*pm)[prefix + "writes"] = std::to_string(nr_writes.load());
+  return 0;
+}
+
+int MemBlockDevice::setup()
+{
+  const uint64_t huge = 2 * 1024 * 1024;
+  hugepage = false;
+  void *p = MAP_FAILED;
+  if (blk_options.bdev_mem_hugepage) {
+    mapped = stupid::common::p2roundup(size, huge);
+    p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      std::cout << __func__ << " no huge pages reserved for " << mapped
+        << " bytes, falling back to transparent huge pages" << std::endl;
+    } else {
+      hugepage = true;
+    }
+  }
+  if (p == MAP_FAILED) {
+    mapped = size;
+    p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+      int r = -errno;
+      std::cerr << __func__ << " failed to map " << mapped << " bytes: " << r << std::endl;
+      return r;
+    }
+    if (blk_options.bdev_mem_hugepage) {
+      madvise(p, mapped, MADV_HUGEPAGE);
+    }
+  }
+  data = static_cast<char*>(p);
+  return 0;
+}
+
+void MemBlockDevice::teardown()
+{
+  if (data) {
+    munmap(data, mapped);
+    data = nullptr;
+  }
+}
+
+int MemBlockDevice::transfer(bool write, uint64_t off, uint64_t len, char *buf)
+{
+  if (write) {
+    memcpy(data + off, buf, len);
+  } else {
+    memcpy(buf, data + off, len);
+  }
+  return 0;
+}
+
+int MemBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  NullBlockDevice::collect_metadata(prefix, pm);
+  (*pm)[prefix + "driver"] = "MemBlockDevice";
+  (*pm)[prefix + "mem_hugepage"] = hugepage ? "1" : "0";
+  return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef STUPID__BLK_MEM_DEVICE_HPP
+#define STUPID__BLK_MEM_DEVICE_HPP
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include "common/mutex.hpp"
+#include "common/thread.hpp"
+
+#include "blk/block_device.hpp"
+
+// A device completing every IO at once without moving any data: reads leave
+// the buffer as it is, writes are dropped. Opened on "null" or
+// "null:<size>" (a number with an optional K/M/G/T suffix, bdev_mem_size by
+// default). With nothing behind it, what an IO costs is the framework's own
+// work: the IOContext accounting, the completion thread and aio_callback.
+// For that reason the IOs are not logged.
+//
+// The aios are done when they are queued; aio_submit() hands the IOContext
+// to the completion thread, or completes it right there with
+// bdev_mem_inline_completion. With bdev_null_latency_us, the completion
+// thread holds each IOContext for that long, serving at most
+// bdev_null_channels of them at a time: a device of known capacity, for
+// testing the schedulers.
+class NullBlockDevice : public BlockDevice {
+  stupid::common::mutex lock = stupid::common::make_mutex("NullBlockDevice::lock");
+  stupid::common::condition_variable cond;
+  std::multimap<uint64_t, IOContext*> completing;   // by due time
+  std::vector<uint64_t> channels;                   // when each is free
+  bool stop = false;
+
+  struct CompletionThread : public stupid::common::Thread {
+    NullBlockDevice *bdev;
+    explicit CompletionThread(NullBlockDevice *b) : bdev(b) {}
+    void *entry() override {
+      bdev->_completion_thread();
+      return nullptr;
+    }
+  } completion_thread;
+
+  void _completion_thread();
+  // the last aio of ioc is done; false if it was a sync one, woken already
+  bool complete(IOContext *ioc);
+
+protected:
+  std::atomic<uint64_t> nr_reads = {0}, nr_writes = {0};
+
+  // the prefix of the path, and what collect_metadata() calls it
+  virtual const char *type_name() const { return "null"; }
+  virtual int transfer(bool write, uint64_t off, uint64_t len, char *buf) { return 0; }
+  virtual int setup() { return 0; }
+  virtual void teardown() {}
+
+public:
+  NullBlockDevice(aio_callback_t cb, void *cbpriv)
+    : BlockDevice(cb, cbpriv), completion_thread(this) {}
+
+  bool supported_bdev_label() override { return false; }
+  void aio_submit(IOContext *ioc) override;
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int flush() override { return 0; }
+  int invalidate_cache(uint64_t off, uint64_t len) override { return 0; }
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+// A RAM disk, opened on "mem" or "mem:<size>", and otherwise like
+// NullBlockDevice: the data is copied when the aio is queued. The memory is
+// an anonymous mapping, of huge pages with bdev_mem_hugepage (falling back
+// to transparent huge pages if none are reserved), and starts out zeroed.
+class MemBlockDevice : public NullBlockDevice {
+  char *data = nullptr;
+  uint64_t mapped = 0;
+  bool hugepage = false;
+
+protected:
+  const char *type_name() const override { return "mem"; }
+  int transfer(bool write, uint64_t off, uint64_t len, char *buf) override;
+  int setup() override;
+  void teardown() override;
+
+public:
+  MemBlockDevice(aio_callback_t cb, void *cbpriv) : NullBlockDevice(cb, cbpriv) {}
+
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+};
+
+#endif //STUPID__BLK_MEM_DEVICE_HPP
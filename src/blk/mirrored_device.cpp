@@ -0,0 +1,413 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "common/bit_op.hpp"
+#include "common/util.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/mirrored_device.hpp"
+
+int MirroredBlockDevice::open(const std::string& path)
+{
+  std::string paths = path;
+  if (paths.compare(0, sizeof(MIRROR_PREFIX) - 1, MIRROR_PREFIX) == 0) {
+    paths = paths.substr(sizeof(MIRROR_PREFIX) - 1);
+  }
+  if (int r = open_members(paths); r < 0) {
+    return r;
+  }
+
+  size = UINT64_MAX;
+  block_size = 0;
+  rotational = false;
+  for (auto &m : members) {
+    size = std::min(size, m->get_size());
+    block_size = std::max(block_size, m->get_block_size());
+    rotational |= m->is_rotational();
+  }
+  size &= ~(block_size - 1);
+  name = "mirror";
+
+  stats.reset(new member_stat_t[members.size()]);
+  for (unsigned m = 0; m < members.size(); ++m) {
+    stats[m].hedge_ns = blk_options.bdev_mirror_hedge_min_us * 1000ull;
+  }
+  hedge_stop = false;
+  hedge_thread.create("blk_hedge");
+
+  std::cout << __func__ << " " << members.size() << " replicas, size " << size
+    << " block_size " << block_size << std::endl;
+  return 0;
+}
+
+void MirroredBlockDevice::close()
+{
+  {
+    std::lock_guard l(hedge_lock);
+    hedge_stop = true;
+  }
+  hedge_cond.notify_all();
+  hedge_thread.join();
+  close_members();
+  stats.reset();
+}
+
+unsigned MirroredBlockDevice::pick_member()
+{
+  unsigned best = 0;
+  uint64_t best_score = UINT64_MAX;
+  for (unsigned m = 0; m < members.size(); ++m) {
+    uint64_t score = stats[m].ewma_ns.load(std::memory_order_relaxed) *
+      (stats[m].inflight.load(std::memory_order_relaxed) + 1);
+    if (score < best_score) {
+      best = m;
+      best_score = score;
+    }
+  }
+  // now and then read from another replica, otherwise its latency would
+  // never be seen again once it looked slow
+  if (++picks % 32 == 0) {
+    best = (best + 1) % members.size();
+  }
+  return best;
+}
+
+void MirroredBlockDevice::account(unsigned m, uint64_t lat)
+{
+  member_stat_t &s = stats[m];
+  uint64_t ewma = s.ewma_ns.load(std::memory_order_relaxed);
+  s.ewma_ns.store(ewma ? (ewma * 7 + lat) / 8 : lat, std::memory_order_relaxed);
+
+  s.hist.add(lat);
+  if (++s.samples % std::max<uint32_t>(blk_options.bdev_mirror_window, 1) == 0) {
+    // the hedge deadline follows the recent latencies only
+    uint64_t floor = blk_options.bdev_mirror_hedge_min_us * 1000ull;
+    s.hedge_ns = std::max(floor, s.hist.percentile(blk_options.bdev_mirror_hedge_percentile));
+    s.hist.reset();
+  }
+}
+
+MirroredBlockDevice::read_t *MirroredBlockDevice::new_read(uint64_t off, uint64_t len, char *buf, IOContext *ioc)
+{
+  read_t *rd = new read_t;
+  rd->dev = this;
+  rd->off = off;
+  rd->len = len;
+  rd->buf = buf;
+  if (ioc) {
+    rd->allow_eio = ioc->allow_eio;
+    rd->prio = ioc->prio;
+  }
+  rd->hedge = blk_options.bdev_mirror_hedge && members.size() > 1 &&
+    len <= blk_options.bdev_mirror_hedge_max;
+  return rd;
+}
+
+void MirroredBlockDevice::start_read(read_t *rd)
+{
+  unsigned m = pick_member();
+  leg_t *leg;
+  {
+    std::lock_guard l(rd->lock);
+    leg = add_leg(rd, m);
+    if (rd->hedge) {
+      ++rd->refs;
+    }
+  }
+
+  if (rd->hedge) {
+    uint64_t deadline = stupid::common::mono_ns() + stats[m].hedge_ns.load(std::memory_order_relaxed);
+    bool first;
+    {
+      std::lock_guard l(hedge_lock);
+      auto it = timers.emplace(deadline, rd);
+      first = it == timers.begin();
+    }
+    if (first) {
+      hedge_cond.notify_one();
+    }
+  }
+  issue_leg(leg);
+}
+
+MirroredBlockDevice::leg_t *MirroredBlockDevice::add_leg(read_t *rd, unsigned m)
+{
+  assert(rd->nr_legs < 2);
+  leg_t *leg = &rd->legs[rd->nr_legs++];
+  leg->rd = rd;
+  leg->m = m;
+  ++rd->refs;
+  return leg;
+}
+
+void MirroredBlockDevice::issue_leg(leg_t *leg)
+{
+  read_t *rd = leg->rd;
+  if (rd->hedge) {
+    leg->data = static_cast<char*>(aligned_alloc(4096, stupid::common::p2roundup<uint64_t>(rd->len, 4096)));
+  } else {
+    // one leg in flight at a time, it may read straight into the caller's
+    // buffer
+    leg->data = rd->buf;
+  }
+  leg->ioc = new IOContext(leg, rd->allow_eio);
+  leg->ioc->prio = rd->prio;
+
+  ++stats[leg->m].inflight;
+  leg->stamp = stupid::common::mono_ns();
+  int r = leg->data ? members[leg->m]->aio_read(rd->off, rd->len, leg->data, leg->ioc) : -ENOMEM;
+  if (r < 0) {
+    leg->ioc->set_return_value(r);
+  } else if (leg->ioc->has_pending_aios()) {
+    leg->submitted = true;
+    members[leg->m]->aio_submit(leg->ioc);
+    return;
+  }
+  // done (or failed) synchronously
+  leg_finished(leg);
+}
+
+void MirroredBlockDevice::leg_t::finished()
+{
+  rd->dev->leg_finished(this);
+}
+
+void MirroredBlockDevice::leg_finished(leg_t *leg)
+{
+  read_t *rd = leg->rd;
+  unsigned m = leg->m;
+  --stats[m].inflight;
+  int r = leg->ioc->get_return_value();
+  if (r >= 0) {
+    account(m, stupid::common::mono_ns() - leg->stamp);
+  }
+
+  leg_t *retry = nullptr;
+  bool complete = false;
+  {
+    std::lock_guard l(rd->lock);
+    leg->done = true;
+    if (!rd->done) {
+      leg_t *other = rd->nr_legs == 2 ? &rd->legs[leg == &rd->legs[0] ? 1 : 0] : nullptr;
+      if (r >= 0) {
+        if (leg->data != rd->buf) {
+          memcpy(rd->buf, leg->data, rd->len);
+        }
+        if (leg == &rd->legs[1]) {
+          ++hedge_wins;
+        }
+        rd->done = complete = true;
+      } else if (other && !other->done) {
+        // the other replica may still answer
+      } else if (!other && members.size() > 1) {
+        ++failovers;
+        retry = add_leg(rd, (m + 1) % members.size());
+      } else {
+        rd->r = r;
+        rd->done = complete = true;
+      }
+    }
+  }
+
+  if (leg->data != rd->buf) {
+    free(leg->data);
+  }
+  if (leg->submitted) {
+    // we are on the member's completion path, it frees the ioc later
+    members[m]->queue_reap_ioc(leg->ioc);
+  } else {
+    delete leg->ioc;
+  }
+
+  if (retry) {
+    issue_leg(retry);
+  }
+  if (complete) {
+    if (rd->f) {
+      if (rd->r < 0) {
+        rd->f->parent->set_return_value(rd->r);
+      }
+      unit_finished(rd->f);
+    } else {
+      std::lock_guard l(rd->lock);
+      rd->cond.notify_all();
+    }
+  }
+  put(rd);
+}
+
+void MirroredBlockDevice::put(read_t *rd)
+{
+  int refs;
+  {
+    std::lock_guard l(rd->lock);
+    refs = --rd->refs;
+  }
+  if (refs == 0) {
+    delete rd;
+  }
+}
+
+void MirroredBlockDevice::_hedge_thread()
+{
+  std::cout << __func__ << " start" << std::endl;
+
+  std::unique_lock l(hedge_lock);
+  while (!hedge_stop) {
+    if (timers.empty()) {
+      hedge_cond.wait(l);
+      continue;
+    }
+    auto it = timers.begin();
+    uint64_t now = stupid::common::mono_ns();
+    if (it->first > now) {
+      hedge_cond.wait_for(l, std::chrono::nanoseconds(it->first - now));
+      continue;
+    }
+    read_t *rd = it->second;
+    timers.erase(it);
+    l.unlock();
+
+    leg_t *leg = nullptr;
+    {
+      std::lock_guard rl(rd->lock);
+      if (!rd->done && rd->nr_legs == 1) {
+        leg = add_leg(rd, (rd->legs[0].m + 1) % members.size());
+      }
+    }
+    if (leg) {
+      ++hedged;
+      issue_leg(leg);
+    }
+    put(rd);
+    l.lock();
+  }
+
+  // the reads still waiting just lose their chance to be hedged
+  auto left = std::move(timers);
+  l.unlock();
+  for (auto &[deadline, rd] : left) {
+    put(rd);
+  }
+
+  std::cout << __func__ << " end" << std::endl;
+}
+
+int MirroredBlockDevice::sync_read(uint64_t off, uint64_t len, char *buf, IOContext *ioc)
+{
+  read_t *rd = new_read(off, len, buf, ioc);
+  start_read(rd);
+  int r;
+  {
+    std::unique_lock l(rd->lock);
+    while (!rd->done) {
+      rd->cond.wait(l);
+    }
+    r = rd->r;
+  }
+  put(rd);
+  return r;
+}
+
+int MirroredBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << std::endl;
+  assert(is_valid_io(off, len));
+  return sync_read(off, len, buf, ioc);
+}
+
+int MirroredBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  std::cout << __func__ << " " << off << "~" << len << std::endl;
+  assert(len > 0);
+  assert(off + len <= size);
+
+  uint64_t aligned_off = stupid::common::p2align(off, block_size);
+  uint64_t aligned_len = stupid::common::p2roundup(off + len, block_size) - aligned_off;
+  if (aligned_off == off && aligned_len == len) {
+    return sync_read(off, len, buf, nullptr);
+  }
+
+  // the legs are aio reads, widen to whole blocks
+  char *tmp = static_cast<char*>(aligned_alloc(4096, stupid::common::p2roundup<uint64_t>(aligned_len, 4096)));
+  if (!tmp) {
+    return -ENOMEM;
+  }
+  int r = sync_read(aligned_off, aligned_len, tmp, nullptr);
+  if (r >= 0) {
+    memcpy(buf, tmp + (off - aligned_off), len);
+  }
+  free(tmp);
+  return r;
+}
+
+int MirroredBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << std::endl;
+  assert(is_valid_io(off, len));
+
+  read_t *rd = new_read(off, len, buf, ioc);
+  rd->f = fanout_of(ioc);
+  // started on aio_submit(), the starter's reference is dropped right away
+  rd->f->deferred.push_back([this, rd] {
+    start_read(rd);
+    put(rd);
+  });
+  ++ioc->num_pending;
+  return 0;
+}
+
+int MirroredBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  for (unsigned m = 0; m < members.size(); ++m) {
+    if (int r = queued(ioc, m, members[m]->aio_write(off, len, buf, child_ioc(ioc, m), buffered, write_hint)); r < 0) {
+      return r;
+    }
+  }
+  return 0;
+}
+
+int MirroredBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  std::cout << __func__ << " " << off << "~" << len << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  // all the replicas in parallel
+  return sync_io(nullptr, [&](IOContext *sync) {
+    return aio_write(off, len, buf, sync, buffered, write_hint);
+  });
+}
+
+int MirroredBlockDevice::invalidate_cache(uint64_t off, uint64_t len)
+{
+  int ret = 0;
+  for (auto &m : members) {
+    if (int r = m->invalidate_cache(off, len); r < 0) {
+      ret = r;
+    }
+  }
+  return ret;
+}
+
+int MirroredBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  CompositeBlockDevice::collect_metadata(prefix, pm);
+  (*pm)[prefix + "driver"] = "MirroredBlockDevice";
+  (*pm)[prefix + "mirror_hedged"] = std::to_string(hedged.load());
+  (*pm)[prefix + "mirror_hedge_wins"] = std::to_string(hedge_wins.load());
+  (*pm)[prefix + "mirror_failovers"] = std::to_string(failovers.load());
+  for (unsigned m = 0; stats && m < members.size(); ++m) {
+    std::string p = prefix + "member" + std::to_string(m) + "_";
+    (*pm)[p + "read_ewma_ns"] = std::to_string(stats[m].ewma_ns.load());
+    (*pm)[p + "hedge_after_ns"] = std::to_string(stats[m].hedge_ns.load());
+  }
+  return 0;
+}
@@ -0,0 +1,145 @@
+#ifndef STUPID__BLK_MIRRORED_DEVICE_HPP
+#define STUPID__BLK_MIRRORED_DEVICE_HPP
+
+#include <atomic>
+#include <map>
+#include <memory>
+
+#include "common/histogram.hpp"
+#include "common/mutex.hpp"
+#include "common/thread.hpp"
+
+#include "blk/composite_device.hpp"
+
+// RAID-1 over the member devices (two, normally): writes go to all of them,
+// a read to the replica with the lowest recent latency times queue depth,
+// with an occasional one to another so that its figures stay fresh. Opened
+// on "mirror:<path>,<path>" (or with the type name "mirror" and the paths
+// alone); the size is the smallest member's.
+//
+// Hedged reads hide the stalls of a single replica (SSD garbage collection):
+// a read not answered within the bdev_mirror_hedge_percentile latency of its
+// replica is sent to another one as well, and the first answer wins. Both
+// read into buffers of their own, the winner's data is copied out, so the
+// loser may land whenever it likes. A read failing on one replica is retried
+// on another. Latencies are taken on the completion of the member
+// IOContexts.
+//
+// A hedge is issued by a timer thread, so it can only overtake a read whose
+// member aio_submit() returns before completion: with NVMEDevice members,
+// set spdk_shared_qpair.
+class MirroredBlockDevice : public CompositeBlockDevice {
+  struct read_t;
+
+  struct leg_t : public child_t {
+    read_t *rd = nullptr;
+    char *data = nullptr;
+    uint64_t stamp = 0;
+    bool submitted = false;
+    bool done = false;
+    void finished() override;
+  };
+
+  struct read_t {
+    MirroredBlockDevice *dev;
+    fanout_t *f = nullptr;      // of the aio parent, nullptr for a sync read
+    uint64_t off, len;
+    char *buf;
+    bool allow_eio = false;
+    uint8_t prio = IOContext::PRIO_MEDIUM;
+    bool hedge = false;         // the legs read into buffers of their own
+
+    stupid::common::mutex lock = stupid::common::make_mutex("MirroredBlockDevice::read_t::lock");
+    stupid::common::condition_variable cond;
+    int refs = 1;               // the legs, the timer, and the starter
+    bool done = false;
+    int r = 0;
+    leg_t legs[2];
+    int nr_legs = 0;
+  };
+
+  struct member_stat_t {
+    std::atomic<uint64_t> ewma_ns = {0};
+    std::atomic<int> inflight = {0};
+    std::atomic<uint64_t> samples = {0};
+    std::atomic<uint64_t> hedge_ns = {0};
+    stupid::common::LatencyHistogram hist;
+  };
+  std::unique_ptr<member_stat_t[]> stats;
+  std::atomic<uint64_t> picks = {0};
+  std::atomic<uint64_t> hedged = {0}, hedge_wins = {0}, failovers = {0};
+
+  // reads waiting for their hedge deadline
+  stupid::common::mutex hedge_lock = stupid::common::make_mutex("MirroredBlockDevice::hedge_lock");
+  stupid::common::condition_variable hedge_cond;
+  std::multimap<uint64_t, read_t*> timers;
+  bool hedge_stop = false;
+
+  struct HedgeThread : public stupid::common::Thread {
+    MirroredBlockDevice *bdev;
+    explicit HedgeThread(MirroredBlockDevice *b) : bdev(b) {}
+    void *entry() override {
+      bdev->_hedge_thread();
+      return nullptr;
+    }
+  } hedge_thread;
+
+  void _hedge_thread();
+
+  unsigned pick_member();
+  void account(unsigned m, uint64_t lat);
+  read_t *new_read(uint64_t off, uint64_t len, char *buf, IOContext *ioc);
+  void start_read(read_t *rd);
+  // take the next leg of rd for member m, under rd->lock
+  leg_t *add_leg(read_t *rd, unsigned m);
+  void issue_leg(leg_t *leg);
+  void leg_finished(leg_t *leg);
+  void put(read_t *rd);
+  int sync_read(uint64_t off, uint64_t len, char *buf, IOContext *ioc);
+
+public:
+  MirroredBlockDevice(aio_callback_t cb, void *cbpriv)
+    : CompositeBlockDevice(cb, cbpriv), hedge_thread(this) {}
+
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int invalidate_cache(uint64_t off, uint64_t len) override;
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_MIRRORED_DEVICE_HPP
@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "common/bit_op.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/readahead_device.hpp"
+
+int ReadaheadBlockDevice::open(const std::string& path)
+{
+  int r = dev->open(path);
+  if (r < 0) {
+    return r;
+  }
+
+  copy_geometry();
+
+  max_window = stupid::common::p2roundup<uint64_t>(std::max<uint64_t>(blk_options.bdev_readahead_max, block_size), 4096);
+  streams.clear();
+  for (uint32_t i = 0; i < std::max<uint32_t>(blk_options.bdev_readahead_streams, 1); ++i) {
+    streams.emplace_back(new stream_t);
+  }
+  stop = false;
+  ra_thread.create("blk_readahead");
+
+  std::cout << __func__ << " readahead up to " << max_window << " bytes on "
+    << streams.size() << " streams" << std::endl;
+  return 0;
+}
+
+void ReadaheadBlockDevice::close()
+{
+  {
+    std::lock_guard l(lock);
+    stop = true;
+    work.clear();
+  }
+  work_cond.notify_all();
+  cond.notify_all();
+  ra_thread.join();
+  streams.clear();
+  dev->close();
+}
+
+void ReadaheadBlockDevice::_readahead_thread()
+{
+  std::unique_lock l(lock);
+  while (true) {
+    while (!stop && work.empty()) {
+      work_cond.wait(l);
+    }
+    if (stop) {
+      break;
+    }
+    auto [s, idx] = work.front();
+    work.pop_front();
+    ra_buf_t &b = s->bufs[idx];
+    uint64_t off = b.off, len = b.len;
+    char *data = s->data[idx].get();
+
+    // the buffer is inflight, nobody touches it or recycles the stream
+    l.unlock();
+    int r = dev->read_random(off, len, data, false);
+    l.lock();
+
+    if (r < 0) {
+      std::cerr << __func__ << " readahead " << std::hex << off << "~" << len << std::dec
+        << " failed: " << r << std::endl;
+    }
+    b.r = r;
+    b.inflight = false;
+    ra_bytes += len;
+    cond.notify_all();
+  }
+}
+
+void ReadaheadBlockDevice::drop(ra_buf_t &b)
+{
+  if (b.len == 0) {
+    return;
+  }
+  ++ra_dropped;
+  if (b.inflight) {
+    // thrown away when it completes
+    b.stale = true;
+  } else {
+    b.len = 0;
+  }
+}
+
+ReadaheadBlockDevice::stream_t *ReadaheadBlockDevice::find_stream(uint64_t off, uint64_t len)
+{
+  for (auto &s : streams) {
+    if (s->seq && s->next == off) {
+      return s.get();
+    }
+  }
+
+  // a read landing in what a stream prefetched, but not where the stream
+  // goes on, means the stream is not sequential any more
+  for (auto &s : streams) {
+    for (auto &b : s->bufs) {
+      if (b.len && off < b.off + b.len && b.off < off + len) {
+        s->seq = 0;
+        break;
+      }
+    }
+  }
+
+  stream_t *victim = nullptr;
+  for (auto &s : streams) {
+    if (s->busy()) {
+      continue;
+    }
+    if (!victim || s->seq == 0 || (victim->seq != 0 && s->last_use < victim->last_use)) {
+      victim = s.get();
+      if (s->seq == 0) {
+        break;
+      }
+    }
+  }
+  if (victim) {
+    victim->seq = 0;
+    victim->window = 0;
+    drop(victim->bufs[0]);
+    drop(victim->bufs[1]);
+    victim->cur = 0;
+  }
+  return victim;
+}
+
+uint64_t ReadaheadBlockDevice::consume(std::unique_lock<stupid::common::mutex>& l, stream_t *s, uint64_t off, uint64_t len, char *buf)
+{
+  uint64_t done = 0;
+  while (done < len) {
+    const uint64_t pos = off + done;
+    int idx = -1;
+    for (int i : {s->cur, s->cur ^ 1}) {
+      ra_buf_t &b = s->bufs[i];
+      b.settle();
+      if (b.len && pos >= b.off && pos < b.off + b.len) {
+        idx = i;
+        break;
+      }
+    }
+    if (idx < 0) {
+      break;
+    }
+
+    ra_buf_t &b = s->bufs[idx];
+    if (b.inflight) {
+      if (stop) {
+        break;
+      }
+      // the data is on its way, which beats reading it once more. look the
+      // buffer up again afterwards, another reader may have moved on
+      cond.wait(l);
+      continue;
+    }
+    if (b.stale || b.r < 0) {
+      continue;
+    }
+
+    uint64_t n = std::min(len - done, b.off + b.len - pos);
+    memcpy(buf + done, s->data[idx].get() + (pos - b.off), n);
+    done += n;
+
+    if (idx != s->cur) {
+      // skipped the whole front buffer
+      drop(s->front());
+      s->cur ^= 1;
+    }
+    if (pos + n == b.off + b.len) {
+      b.len = 0;
+      s->cur ^= 1;
+    }
+  }
+  return done;
+}
+
+void ReadaheadBlockDevice::issue(stream_t *s, int idx, uint64_t off, uint64_t len)
+{
+  if (off >= size) {
+    return;
+  }
+  len = std::min(len, size - off);
+  if (!s->data[idx]) {
+    s->data[idx].reset(static_cast<char*>(aligned_alloc(4096, max_window)));
+    if (!s->data[idx]) {
+      return;
+    }
+  }
+
+  ra_buf_t &b = s->bufs[idx];
+  b.off = off;
+  b.len = len;
+  b.inflight = true;
+  b.stale = false;
+  b.r = 0;
+  work.emplace_back(s, idx);
+  work_cond.notify_one();
+}
+
+void ReadaheadBlockDevice::schedule(stream_t *s)
+{
+  for (auto &b : s->bufs) {
+    b.settle();
+    if (!b.inflight && b.len && b.off + b.len <= s->next) {
+      b.len = 0;
+    }
+  }
+  if (s->front().len == 0 && !s->front().inflight && s->back().len) {
+    s->cur ^= 1;
+  }
+
+  auto grow = [&]() -> uint64_t {
+    uint64_t min_window = std::min(stupid::common::p2roundup<uint64_t>(
+        std::max<uint64_t>(blk_options.bdev_readahead_min, block_size), block_size), max_window);
+    s->window = s->window ? std::min(s->window * 2, max_window) : min_window;
+    return s->window;
+  };
+
+  ra_buf_t &f = s->front(), &b = s->back();
+  if (f.len == 0) {
+    if (!f.inflight) {
+      issue(s, s->cur, stupid::common::p2align(s->next, block_size), grow());
+    }
+  } else if (b.len == 0 && !b.inflight) {
+    // fetch the next window once the reader is half way through this one
+    uint64_t f_end = f.off + f.len;
+    if (f_end - std::max(s->next, f.off) <= f.len / 2) {
+      issue(s, s->cur ^ 1, f_end, grow());
+    }
+  }
+}
+
+int ReadaheadBlockDevice::ra_read(uint64_t off, uint64_t len, char *buf, IOContext *ioc, bool buffered)
+{
+  uint64_t done = 0;
+  {
+    std::unique_lock l(lock);
+    stream_t *s = find_stream(off, len);
+    if (s) {
+      s->last_use = ++tick;
+      if (s->seq) {
+        done = consume(l, s, off, len, buf);
+      }
+      ++s->seq;
+      s->next = off + len;
+      if (s->seq >= blk_options.bdev_readahead_trigger) {
+        // before reading the rest, so the two overlap
+        schedule(s);
+      }
+    }
+  }
+  ra_hit_bytes += done;
+
+  if (done == len) {
+    return 0;
+  }
+  if (ioc) {
+    return dev->read(off + done, len - done, buf + done, ioc, buffered);
+  }
+  return dev->read_random(off + done, len - done, buf + done, buffered);
+}
+
+int ReadaheadBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  // FLAG_DONT_CACHE is not looked at: the prefetched data only lives until
+  // the stream consumes it, and the scans asking for readahead are exactly
+  // the reads which should not go into the cache
+  if (streams.empty()) {
+    return dev->read(off, len, buf, ioc, buffered);
+  }
+  return ra_read(off, len, buf, ioc, buffered);
+}
+
+int ReadaheadBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  if (streams.empty()) {
+    return dev->read_random(off, len, buf, buffered);
+  }
+  return ra_read(off, len, buf, nullptr, buffered);
+}
+
+void ReadaheadBlockDevice::invalidate(uint64_t off, uint64_t len)
+{
+  std::lock_guard l(lock);
+  for (auto &s : streams) {
+    for (auto &b : s->bufs) {
+      if (b.len && off < b.off + b.len && b.off < off + len) {
+        drop(b);
+      }
+    }
+  }
+}
+
+int ReadaheadBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  int r = dev->write(off, len, buf, buffered, write_hint);
+  // after the write, so a readahead which went by meanwhile is dropped too
+  if (!streams.empty()) {
+    invalidate(off, len);
+  }
+  return r;
+}
+
+int ReadaheadBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  if (!streams.empty()) {
+    invalidate(off, len);
+  }
+  return dev->aio_write(off, len, buf, ioc, buffered, write_hint);
+}
+
+int ReadaheadBlockDevice::invalidate_cache(uint64_t off, uint64_t len)
+{
+  if (!streams.empty()) {
+    invalidate(off, len);
+  }
+  return dev->invalidate_cache(off, len);
+}
+
+int ReadaheadBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  int r = dev->collect_metadata(prefix, pm);
+  (*pm)[prefix + "readahead_max"] = std::to_string(max_window);
+  (*pm)[prefix + "readahead_bytes"] = std::to_string(ra_bytes.load());
+  (*pm)[prefix + "readahead_hit_bytes"] = std::to_string(ra_hit_bytes.load());
+  (*pm)[prefix + "readahead_dropped"] = std::to_string(ra_dropped.load());
+  return r;
+}
@@ -0,0 +1,138 @@
+#ifndef STUPID__BLK_READAHEAD_DEVICE_HPP
+#define STUPID__BLK_READAHEAD_DEVICE_HPP
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "common/mutex.hpp"
+#include "common/thread.hpp"
+
+#include "blk/device_decorator.hpp"
+
+// Decorator detecting sequential sync reads and prefetching ahead of them, for
+// the full-scan and scrub jobs which read a device front to back with
+// read()/read_random() and would otherwise wait out a device round trip on
+// every call.
+//
+// A stream is a run of reads each starting where the previous one ended, no
+// matter which thread or IOContext issues them; a few are tracked at once and
+// the least recently used one is recycled for a read matching none of them.
+// Once a stream has seen bdev_readahead_trigger reads, a worker thread reads
+// a window past its end into a stream buffer, and the next window while the
+// first one is consumed, doubling the window from bdev_readahead_min up to
+// bdev_readahead_max. A read which does not continue the stream (a random
+// one, or a seek inside the prefetched range) resets it, which stops the
+// readahead.
+//
+// Writes and invalidate_cache() drop the prefetched data they overlap. aio
+// reads are passed through: their data is only delivered at completion. Like
+// with CachedBlockDevice, a sync read racing with an aio write of the same
+// range may see the old data. Created by BlockDevice::create() when
+// blk_options.bdev_readahead_max is set.
+class ReadaheadBlockDevice : public BlockDeviceDecorator {
+  struct ra_buf_t {
+    uint64_t off = 0;
+    uint64_t len = 0;          // 0 if the buffer holds nothing
+    bool inflight = false;
+    bool stale = false;        // overwritten while in flight
+    int r = 0;
+
+    // forget the data once the read has completed, if it is of no use
+    void settle() {
+      if (!inflight && (stale || r < 0)) {
+        len = 0;
+        stale = false;
+      }
+    }
+  };
+
+  struct stream_t {
+    uint64_t next = 0;         // where the next read of the stream starts
+    uint32_t seq = 0;          // reads seen
+    uint64_t window = 0;
+    uint64_t last_use = 0;
+    ra_buf_t bufs[2];
+    int cur = 0;               // bufs[cur ^ 1] follows bufs[cur]
+    std::unique_ptr<char, void(*)(void*)> data[2] = {{nullptr, free}, {nullptr, free}};
+
+    ra_buf_t &front() { return bufs[cur]; }
+    ra_buf_t &back() { return bufs[cur ^ 1]; }
+    bool busy() const { return bufs[0].inflight || bufs[1].inflight; }
+  };
+
+  stupid::common::mutex lock = stupid::common::make_mutex("ReadaheadBlockDevice::lock");
+  stupid::common::condition_variable cond;     // a readahead completed
+  stupid::common::condition_variable work_cond;
+  std::vector<std::unique_ptr<stream_t>> streams;
+  std::deque<std::pair<stream_t*, int>> work;
+  uint64_t tick = 0;
+  uint64_t max_window = 0;
+  bool stop = false;
+
+  std::atomic<uint64_t> ra_bytes = {0}, ra_hit_bytes = {0}, ra_dropped = {0};
+
+  struct ReadaheadThread : public stupid::common::Thread {
+    ReadaheadBlockDevice *bdev;
+    explicit ReadaheadThread(ReadaheadBlockDevice *b) : bdev(b) {}
+    void *entry() override {
+      bdev->_readahead_thread();
+      return nullptr;
+    }
+  } ra_thread;
+
+  void _readahead_thread();
+
+  stream_t *find_stream(uint64_t off, uint64_t len);
+  // copy what the stream has prefetched at the head of [off, off + len),
+  // returning the length copied
+  uint64_t consume(std::unique_lock<stupid::common::mutex>& l, stream_t *s, uint64_t off, uint64_t len, char *buf);
+  void schedule(stream_t *s);
+  void issue(stream_t *s, int idx, uint64_t off, uint64_t len);
+  void drop(ra_buf_t &b);
+  // the device is about to change [off, off + len)
+  void invalidate(uint64_t off, uint64_t len);
+
+  int ra_read(uint64_t off, uint64_t len, char *buf, IOContext *ioc, bool buffered);
+
+public:
+  ReadaheadBlockDevice(BlockDevice *dev, aio_callback_t cb, void *cbpriv)
+    : BlockDeviceDecorator(dev, cb, cbpriv), ra_thread(this) {}
+
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int invalidate_cache(uint64_t off, uint64_t len) override;
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_READAHEAD_DEVICE_HPP
@@ -1,14 +1,60 @@
 #ifndef STUPID__BLK_SPDK_DRIVER_HPP
 #define STUPID__BLK_SPDK_DRIVER_HPP
 
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <string>
 #include <vector>
+#include <set>
+#include <map>
 #include <atomic>
 
 #include <spdk/nvme.h>
 
+#include "common/mutex.hpp"
+#include "common/histogram.hpp"
+
+#include "blk/blk_options.hpp"
 #include "blk/spdk/nvme_device.hpp"
 
+class SharedDriverQueueData;
+class SharedQueuePoller;
+
+static constexpr int nr_io_commands = 3;
+
+inline const char *io_command_name(int cmd)
+{
+  static const char *names[nr_io_commands] = {"read", "write", "flush"};
+  return names[cmd];
+}
+
+// command latencies, indexed by IOCommand
+struct QueueLatency {
+  // submitted to the qpair -> completion reaped from it
+  stupid::common::LatencyHistogram device[nr_io_commands];
+  // completion reaped -> upper layer called back or waiter woken; this is
+  // what our polling and batching add on top of the device
+  stupid::common::LatencyHistogram callback[nr_io_commands];
+
+  // cpu spent by the submitting/polling threads, and the commands completed
+  uint64_t poll_cpu_ns = 0;
+  uint64_t completed_ios = 0;
+
+  void merge(const QueueLatency& other) {
+    for (int i = 0; i < nr_io_commands; ++i) {
+      device[i].merge(other.device[i]);
+      callback[i].merge(other.callback[i]);
+    }
+    poll_cpu_ns += other.poll_cpu_ns;
+    completed_ios += other.completed_ios;
+  }
+
+  uint64_t cpu_ns_per_io() const {
+    return completed_ios ? poll_cpu_ns / completed_ios : 0;
+  }
+};
+
 class SharedDriverData {
   unsigned id;
   spdk_nvme_transport_id trid;
@@ -16,6 +62,44 @@ class SharedDriverData {
   spdk_nvme_ns *ns;
   uint32_t block_size = 0;
   uint64_t size = 0;
+  // largest single command the controller takes (MDTS)
+  uint32_t max_xfer_size = 0;
+  // NUMA node the controller is attached to, -1 if unknown
+  int numa_node = -1;
+  // the controller arbitrates between qpair priorities in hardware
+  bool wrr_enabled = false;
+  // commands in flight per IOContext priority class, over all the queues
+  std::atomic_int prio_inflight[IOContext::PRIO_MAX] = {};
+
+  // queue contexts not leased to any thread, by the NUMA node of their
+  // buffers; nr_queues counts them all, idle or leased.
+  stupid::common::mutex pool_lock = stupid::common::make_mutex("SharedDriverData::pool_lock");
+  stupid::common::condition_variable pool_cond;
+  std::map<int, std::vector<SharedDriverQueueData*>> idle_queues;
+  unsigned nr_queues = 0;
+  // blk_options.spdk_max_queues, at most the io queues the controller
+  // granted; lowered if creating a queue context fails
+  unsigned max_queues = 0;
+
+  // the poller thread of the shared qpair mode, started on first use
+  SharedQueuePoller *poller = nullptr;
+
+  // all the live queues, and the latencies of those already destroyed
+  mutable stupid::common::mutex queues_lock = stupid::common::make_mutex("SharedDriverData::queues_lock");
+  std::set<SharedDriverQueueData*> queues;
+  QueueLatency retired_lat;
+
+  // the kernel exports the node of every pci device; the nvme device is unbound
+  // from the kernel driver by spdk, but the pci device itself stays visible.
+  static int pci_numa_node(const char *traddr)
+  {
+    std::ifstream ifs(std::string("/sys/bus/pci/devices/") + traddr + "/numa_node");
+    int node = -1;
+    if (!(ifs >> node)) {
+      return -1;
+    }
+    return node;
+  }
 
   public:
   std::vector<NVMEDevice*> registered_devices;
@@ -26,14 +110,21 @@ class SharedDriverData {
   SharedDriverData(
           unsigned id_,
           const spdk_nvme_transport_id& trid_,
-          spdk_nvme_ctrlr *c, spdk_nvme_ns *ns_)
-      : id(id_), trid(trid_), ctrlr(c), ns(ns_)
+          spdk_nvme_ctrlr *c, spdk_nvme_ns *ns_, bool wrr)
+      : id(id_), trid(trid_), ctrlr(c), ns(ns_), wrr_enabled(wrr)
   {
     block_size = spdk_nvme_ns_get_extended_sector_size(ns);
     size = spdk_nvme_ns_get_size(ns);
-    std::cout << "nvme: " << trid.traddr << " size=" << size << " block_size=" << block_size << std::endl;
+    max_xfer_size = spdk_nvme_ns_get_max_io_xfer_size(ns);
     if (trid.trtype == SPDK_NVME_TRANSPORT_PCIE) {
-      return;
+      numa_node = pci_numa_node(trid.traddr);
+    }
+    // every queue context takes at least one io queue
+    max_queues = std::min<unsigned>(blk_options.spdk_max_queues, spdk_nvme_ctrlr_get_opts(ctrlr)->num_io_queues);
+    std::cout << "nvme: " << trid.traddr << " size=" << size << " block_size=" << block_size << " numa_node=" << numa_node
+      << " wrr=" << wrr_enabled << " max_queues=" << max_queues << std::endl;
+    if (wrr_enabled) {
+      configure_arbitration();
     }
   }
 
@@ -42,7 +133,85 @@ class SharedDriverData {
     return spdk_nvme_transport_id_compare(&trid, &trid2) == 0;
   }
 
-  ~SharedDriverData() {}
+  ~SharedDriverData();
+
+  // NUMA node the calling thread should take its queue from; applies
+  // blk_options.spdk_numa_policy the first time a thread comes here, *remote
+  // tells whether the thread stays on another node than the controller.
+  int place_thread(bool *remote);
+  // lease a queue context, preferably with buffers on the given node; it is
+  // created on demand up to max_queues, beyond that (or once the controller
+  // refuses more io queues) the caller waits for one to be returned with
+  // put_queue(). nullptr if not a single one could be created.
+  SharedDriverQueueData *get_queue(int node);
+  void put_queue(SharedDriverQueueData *q);
+  // have nr idle queue contexts ready, with their qpairs allocated
+  void warm_up(unsigned nr);
+  // the poller of the shared qpair mode, started if not yet; nullptr if no
+  // queue context could be leased for it
+  SharedQueuePoller *get_poller();
+
+  void add_queue(SharedDriverQueueData *q);
+  void remove_queue(SharedDriverQueueData *q);
+  // latencies over all the queues, live or gone
+  void collect_latency(QueueLatency *total) const;
+  void dump_latency(std::ostream& out) const;
+
+  static uint32_t prio_weight(int prio)
+  {
+    switch (prio) {
+    case IOContext::PRIO_HIGH:
+      return blk_options.spdk_wrr_high_weight;
+    case IOContext::PRIO_MEDIUM:
+      return blk_options.spdk_wrr_medium_weight;
+    default:
+      return blk_options.spdk_wrr_low_weight;
+    }
+  }
+
+  // program the class weights with Set Features (Arbitration) and wait for it
+  void configure_arbitration()
+  {
+    auto w = [](int prio) { return (std::min<uint32_t>(std::max<uint32_t>(prio_weight(prio), 1), 256) - 1) & 0xff; };
+    // arbitration burst 7 means no limit; the weights are 0's based
+    uint32_t cdw11 = 0x7 |
+      (w(IOContext::PRIO_LOW) << 8) |
+      (w(IOContext::PRIO_MEDIUM) << 16) |
+      (w(IOContext::PRIO_HIGH) << 24);
+
+    bool done = false;
+    int r = spdk_nvme_ctrlr_cmd_set_feature(ctrlr, SPDK_NVME_FEAT_ARBITRATION, cdw11, 0, NULL, 0,
+      [](void *arg, const struct spdk_nvme_cpl *cpl) {
+        if (spdk_nvme_cpl_is_error(cpl)) {
+          std::cerr << "nvme: failed to set arbitration weights" << std::endl;
+        }
+        *static_cast<bool*>(arg) = true;
+      }, &done);
+    if (r < 0) {
+      std::cerr << "nvme: failed to submit set arbitration feature: " << r << std::endl;
+      return;
+    }
+    while (!done) {
+      spdk_nvme_ctrlr_process_admin_completions(ctrlr);
+    }
+  }
+
+  // software weighting of the priority classes, for controllers which only
+  // do round robin: while a more urgent class has IO in flight, a class is
+  // kept to a depth proportional to its weight.
+  bool may_issue(int prio) const
+  {
+    if (wrr_enabled || prio == IOContext::PRIO_URGENT) {
+      return true;
+    }
+    for (int p = 0; p < prio; ++p) {
+      if (prio_inflight[p].load(std::memory_order_relaxed)) {
+        return (uint32_t)prio_inflight[prio].load(std::memory_order_relaxed) <
+          prio_weight(prio) * blk_options.spdk_sw_prio_depth_per_weight;
+      }
+    }
+    return true;
+  }
 
   void register_device(NVMEDevice *device)
   {
@@ -68,6 +237,16 @@ class SharedDriverData {
   {
     return size;
   }
+
+  uint32_t get_max_xfer_size() const
+  {
+    return max_xfer_size;
+  }
+
+  int get_numa_node() const
+  {
+    return numa_node;
+  }
 };
 
 #endif //STUPID__BLK_SPDK_DRIVER_HPP
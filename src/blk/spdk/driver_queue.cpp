@@ -1,12 +1,20 @@
 #include <assert.h>
 #include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <numa.h>
 
 #include <iostream>
+#include <map>
 
 #include "common/util.hpp"
 
+#include "blk/blk_options.hpp"
+
 #include "blk/spdk/driver_queue.hpp"
 #include "blk/spdk/task.hpp"
+#include "blk/spdk/mem_registry.hpp"
 
 void io_complete(void *t, const struct spdk_nvme_cpl *completion)
 {
@@ -17,37 +25,59 @@ void io_complete(void *t, const struct spdk_nvme_cpl *completion)
   assert(queue != NULL);
   assert(ctx != NULL);
 
-  --queue->current_queue_depth;
+  QueuePair *qp = task->qpair;
+  int cmd = static_cast<int>(task->command);
+  task->complete_stamp = stupid::common::mono_ns();
+  qp->lat.device[cmd].add(task->complete_stamp - task->submit_stamp);
+  queue->completed(task->command, task->len, task->complete_stamp - task->submit_stamp);
+  ++queue->completed_op_seq;
+  // the upper layer is about to learn about it (or the waiter to be woken)
+  auto notified = [qp, cmd, stamp = task->complete_stamp] {
+    qp->lat.callback[cmd].add(stupid::common::mono_ns() - stamp);
+  };
+
+  queue->complete_command(qp);
+  // over fabrics a command also fails when its connection drops; report it
+  // through the ioc rather than bringing the process down
+  if (spdk_nvme_cpl_is_error(completion)) {
+    std::cerr << __func__ << " " << io_command_name(cmd) << " " << task->offset << "~" << task->len
+      << " failed, sct " << completion->status.sct << " sc " << completion->status.sc << std::endl;
+    ctx->set_return_value(-EIO);
+  }
   if (task->command == IOCommand::WRITE_COMMAND) {
-    assert(!spdk_nvme_cpl_is_error(completion));
     std::cout << __func__ << " write/zero op successfully, left " << queue->queue_op_seq - queue->completed_op_seq << std::endl;
+    // release_segs() touches ctx, which the waiter may destroy as soon as
+    // it is woken
+    task->release_segs(queue);
     // check waiting count before doing callback (which may
     // destroy this ioc).
     if (ctx->priv) {
       if (!--ctx->num_running) {
-        task->device->aio_callback(task->device->aio_callback_priv, ctx->priv);
+        queue->ioc_finished(task->device, ctx, &qp->lat.callback[cmd], task->complete_stamp);
       }
     } else {
       //Yuanguo: try_aio_wake()也会递减num_running;
       //  SharedDriverQueueData::_aio_handle()循环到num_running==0
+      notified();
       ctx->try_aio_wake();
     }
-    task->release_segs(queue);
     delete task;
   } else if (task->command == IOCommand::READ_COMMAND) {
-    assert(!spdk_nvme_cpl_is_error(completion));
     std::cout << __func__ << " read op successfully" << std::endl;
-    task->fill_cb();
+    if (!task->io_request.direct) {
+      task->fill_cb();
+    }
     task->release_segs(queue);
     // read submitted by AIO
     if (!task->return_code) {
       if (ctx->priv) {
         if (!--ctx->num_running) {
-          task->device->aio_callback(task->device->aio_callback_priv, ctx->priv);
+          queue->ioc_finished(task->device, ctx, &qp->lat.callback[cmd], task->complete_stamp);
         }
       } else {
         //Yuanguo: try_aio_wake()也会递减num_running;
         //  SharedDriverQueueData::_aio_handle()循环到num_running==0
+        notified();
         ctx->try_aio_wake();
       }
       delete task;
@@ -73,19 +103,440 @@ void io_complete(void *t, const struct spdk_nvme_cpl *completion)
       } else {
         task->return_code = 0;
       }
-      --ctx->num_running;
+      notified();
+      // a sync read normally spins in _aio_handle until num_running drops to
+      // 0, but in shared qpair mode it sleeps in aio_wait
+      ctx->try_aio_wake();
     }
   } else {
     assert(task->command == IOCommand::FLUSH_COMMAND);
-    assert(!spdk_nvme_cpl_is_error(completion));
     std::cout << __func__ << " flush op successfully" << std::endl;
+    notified();
     task->return_code = 0;
   }
 }
 
+static int current_numa_node()
+{
+  if (numa_available() < 0) {
+    return -1;
+  }
+  int cpu = sched_getcpu();
+  if (cpu < 0) {
+    return -1;
+  }
+  return numa_node_of_cpu(cpu);
+}
+
+SharedDriverQueueData::SharedDriverQueueData(SharedDriverData *driver, int socket_id)
+  : driver(driver), socket_id(socket_id)
+{
+  ctrlr = driver->ctrlr;
+  ns = driver->ns;
+  block_size = driver->block_size;
+}
+
+int SharedDriverQueueData::init()
+{
+  // the default class is allocated upfront, it is also the fallback when the
+  // controller runs out of io queues
+  if (alloc_qpair(&qpairs[IOContext::PRIO_MEDIUM][0], IOContext::PRIO_MEDIUM) < 0) {
+    std::cerr << __func__ << " failed to create queue pair, queues_allocated: " << driver->queues_allocated.load() << std::endl;
+    return -ENOMEM;
+  }
+
+  // allocate spdk dma memory
+  int socket = socket_id < 0 ? SPDK_ENV_SOCKET_ID_ANY : socket_id;
+  for (uint16_t i = 0; i < data_buffer_default_num; i++) {
+    void *b = spdk_dma_zmalloc_socket(data_buffer_size, stupid::global::constant_page_size, NULL, socket);
+    if (!b) {
+      std::cerr << __func__ << " failed to create memory pool for nvme data buffer" << std::endl;
+      return -ENOMEM;
+    }
+    data_buf_list.push_front(*reinterpret_cast<data_cache_buf *>(b));
+  }
+
+  driver->add_queue(this);
+  std::cout << "allocated queue data on numa node " << socket_id << " queues_allocated: " << driver->queues_allocated.load() << std::endl;
+  return 0;
+}
+
+SharedDriverQueueData *SharedDriverQueueData::create(SharedDriverData *driver, int socket_id)
+{
+  SharedDriverQueueData *q = new SharedDriverQueueData(driver, socket_id);
+  if (q->init() < 0) {
+    delete q;
+    return nullptr;
+  }
+  return q;
+}
+
+SharedDriverQueueData::~SharedDriverQueueData()
+{
+  driver->remove_queue(this);
+
+  for_each_qpair([this](int, int, unsigned, QueuePair &qp) {
+    if (qp.qpair) {
+      spdk_nvme_ctrlr_free_io_qpair(qp.qpair);
+      --driver->queues_allocated;
+    }
+  });
+
+  data_buf_list.clear_and_dispose(spdk_dma_free);
+}
+
+int SharedDriverQueueData::alloc_qpair(QueuePair *qp, int prio)
+{
+  struct spdk_nvme_io_qpair_opts opts = {};
+  spdk_nvme_ctrlr_get_default_io_qpair_opts(ctrlr, &opts, sizeof(opts));
+  // IOContext::prio_t follows spdk_nvme_qprio; with round robin arbitration
+  // only the urgent priority is accepted by the controller.
+  opts.qprio = driver->wrr_enabled ? static_cast<spdk_nvme_qprio>(prio) : SPDK_NVME_QPRIO_URGENT;
+
+  // spdk allocates the sq/cq rings itself with SPDK_ENV_SOCKET_ID_ANY, there is
+  // no way to pass a socket id in spdk_nvme_io_qpair_opts (20.07), so only the
+  // data buffers are placed explicitly.
+  qp->qpair = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, &opts, sizeof(opts));
+  if (qp->qpair == NULL) {
+    return -ENOMEM;
+  }
+
+  qp->prio = prio;
+  // usable queue depth should minus 1 to avoid overflow.
+  qp->max_queue_depth = opts.io_queue_size - 1;
+  ++driver->queues_allocated;
+  std::cout << "allocated queue " << qp->qpair << " prio " << prio << " queues_allocated: " << driver->queues_allocated.load() << std::endl;
+  return 0;
+}
+
+QueuePair *SharedDriverQueueData::get_qpair(int prio, IOCommand command, unsigned lane)
+{
+  int dir = (blk_options.spdk_separate_rw_qpairs && command != IOCommand::READ_COMMAND) ? 1 : 0;
+  if (lane && (!nr_stripes || lane <= nr_stripes)) {
+    if (!stripes[prio][dir]) {
+      if (!nr_stripes) {
+        nr_stripes = blk_options.spdk_stripe_lanes - 1;
+      }
+      stripes[prio][dir].reset(new QueuePair[nr_stripes]);
+    }
+    QueuePair *qp = &stripes[prio][dir][lane - 1];
+    if (qp->qpair || alloc_qpair(qp, prio) == 0) {
+      return qp;
+    }
+    // out of io queues, the lane collapses into the class's own qpair
+  }
+
+  QueuePair *qp = &qpairs[prio][dir];
+  if (!qp->qpair && alloc_qpair(qp, prio) < 0) {
+    std::cerr << __func__ << " out of io queues for prio " << prio << ", sharing the default one" << std::endl;
+    qp = &qpairs[IOContext::PRIO_MEDIUM][0];
+  }
+  return qp;
+}
+
+void SharedDriverQueueData::collect_latency(QueueLatency *total) const
+{
+  for_each_qpair([total](int, int, unsigned, const QueuePair &qp) {
+    total->merge(qp.lat);
+  });
+  total->poll_cpu_ns += poll_cpu_ns.load();
+  total->completed_ios += completed_op_seq.load();
+}
+
+void SharedDriverQueueData::dump_latency(std::ostream& out) const
+{
+  uint64_t ios = completed_op_seq.load();
+  out << "  completed " << ios << " poll cpu " << poll_cpu_ns.load() << "ns"
+      << " (" << (ios ? poll_cpu_ns.load() / ios : 0) << "ns/io)\n";
+  for (int cmd = 0; cmd < nr_io_commands; ++cmd) {
+    out << "  expected " << io_command_name(cmd) << " latency by size class:";
+    for (int c = 0; c < nr_size_classes; ++c) {
+      out << " " << (4 << c) << "K=" << expected_lat[cmd][c] << "ns";
+    }
+    out << "\n";
+  }
+  for_each_qpair([&out](int prio, int dir, unsigned lane, const QueuePair &qp) {
+    if (!qp.qpair) {
+      return;
+    }
+    out << "  qpair " << qp.qpair << " prio " << prio << (dir ? " write" : " read");
+    if (lane) {
+      out << " lane " << lane;
+    }
+    out << " depth " << qp.current_queue_depth << "/" << qp.max_queue_depth << "\n";
+    for (int cmd = 0; cmd < nr_io_commands; ++cmd) {
+      if (qp.lat.device[cmd].count() == 0) {
+        continue;
+      }
+      out << "    " << io_command_name(cmd) << " submit->complete: ";
+      qp.lat.device[cmd].summary(out);
+      out << "\n";
+      qp.lat.device[cmd].dump(out, "      ");
+      out << "    " << io_command_name(cmd) << " complete->callback: ";
+      qp.lat.callback[cmd].summary(out);
+      out << "\n";
+      qp.lat.callback[cmd].dump(out, "      ");
+    }
+  });
+}
+
+void SharedDriverData::add_queue(SharedDriverQueueData *q)
+{
+  std::lock_guard l(queues_lock);
+  queues.insert(q);
+}
+
+void SharedDriverData::remove_queue(SharedDriverQueueData *q)
+{
+  std::lock_guard l(queues_lock);
+  queues.erase(q);
+  q->collect_latency(&retired_lat);
+}
+
+void SharedDriverData::collect_latency(QueueLatency *total) const
+{
+  std::lock_guard l(queues_lock);
+  total->merge(retired_lat);
+  for (auto q : queues) {
+    q->collect_latency(total);
+  }
+}
+
+void SharedDriverData::dump_latency(std::ostream& out) const
+{
+  std::lock_guard l(queues_lock);
+  out << "nvme " << trid.traddr << " queues " << queues.size() << "\n";
+  for (auto q : queues) {
+    out << " queue " << q << "\n";
+    q->dump_latency(out);
+  }
+}
+
+void SharedDriverQueueData::flush_finished_iocs()
+{
+  // almost always a single device; group the rest by device if not
+  uint64_t now = finished_iocs.empty() ? 0 : stupid::common::mono_ns();
+  while (!finished_iocs.empty()) {
+    NVMEDevice *dev = finished_iocs.front().dev;
+    auto it = finished_iocs.begin();
+    for (auto &f : finished_iocs) {
+      if (f.dev == dev) {
+        f.lat->add(now - f.complete_stamp);
+        finished_batch.push_back(f.ioc);
+      } else {
+        *it++ = f;
+      }
+    }
+    finished_iocs.erase(it, finished_iocs.end());
+    dev->aio_complete_batch(finished_batch);
+  }
+}
+
+int SharedDriverQueueData::poll_completions(uint32_t max_io_completion)
+{
+  int total = 0;
+  for_each_qpair([&total, max_io_completion](int, int, unsigned, QueuePair &qp) {
+    if (!qp.current_queue_depth) {
+      return;
+    }
+    int r = spdk_nvme_qpair_process_completions(qp.qpair, max_io_completion);
+    if (r == -ENXIO) {
+      // the qpair got disconnected (a fabrics connection dropped); spdk has
+      // failed its outstanding commands, try to bring it back for the next
+      std::cerr << __func__ << " qpair " << qp.qpair << " disconnected, reconnecting" << std::endl;
+      if (int rr = spdk_nvme_ctrlr_reconnect_io_qpair(qp.qpair); rr < 0) {
+        std::cerr << __func__ << " failed to reconnect qpair " << qp.qpair << ": "
+          << stupid::common::cpp_strerror(rr) << std::endl;
+      }
+      return;
+    }
+    if (r < 0) {
+      abort();
+    }
+    total += r;
+  });
+  flush_finished_iocs();
+  return total;
+}
+
+void SharedDriverQueueData::warm_up()
+{
+  get_qpair(IOContext::PRIO_MEDIUM, IOCommand::READ_COMMAND);
+  get_qpair(IOContext::PRIO_MEDIUM, IOCommand::WRITE_COMMAND);
+}
+
+int SharedDriverData::place_thread(bool *remote)
+{
+  // decided once per thread and controller
+  thread_local std::map<const SharedDriverData*, std::pair<int, bool>> placed;
+  if (auto it = placed.find(this); it != placed.end()) {
+    *remote = it->second.second;
+    return it->second.first;
+  }
+
+  int node = current_numa_node();
+  *remote = false;
+
+  if (numa_node >= 0 && node >= 0 && node != numa_node) {
+    *remote = true;
+    switch (blk_options.spdk_numa_policy) {
+    case numa_policy_t::ignore:
+      break;
+    case numa_policy_t::warn:
+    case numa_policy_t::refuse:
+      std::cerr << __func__ << " thread on numa node " << node
+        << " submits to nvme device " << trid.traddr << " on numa node " << numa_node
+        << ", every IO crosses the socket interconnect" << std::endl;
+      break;
+    case numa_policy_t::bind:
+      if (numa_run_on_node(numa_node) == 0) {
+        std::cout << __func__ << " moved thread from numa node " << node << " to " << numa_node << std::endl;
+        node = numa_node;
+        *remote = false;
+      } else {
+        std::cerr << __func__ << " failed to move thread to numa node " << numa_node << ": "
+          << stupid::common::cpp_strerror(errno) << std::endl;
+      }
+      break;
+    }
+  }
+
+  placed[this] = {node, *remote};
+  return node;
+}
+
+SharedDriverQueueData *SharedDriverData::get_queue(int node)
+{
+  std::unique_lock l(pool_lock);
+  while (true) {
+    auto &local = idle_queues[node];
+    if (!local.empty()) {
+      SharedDriverQueueData *q = local.back();
+      local.pop_back();
+      return q;
+    }
+
+    if (nr_queues < max_queues) {
+      ++nr_queues;
+      // allocating the qpair and the dma buffers takes a while, not under the lock
+      l.unlock();
+      if (SharedDriverQueueData *q = SharedDriverQueueData::create(this, node); q) {
+        return q;
+      }
+      l.lock();
+      --nr_queues;
+      if (nr_queues == 0) {
+        std::cerr << __func__ << " " << trid.traddr << " no queue context could be created" << std::endl;
+        return nullptr;
+      }
+      // the classes and lanes of the other queue contexts use io queues
+      // too; make do with the queue contexts there are
+      std::cerr << __func__ << " " << trid.traddr << " out of io queues, capping at "
+        << nr_queues << " queue contexts" << std::endl;
+      max_queues = nr_queues;
+      continue;
+    }
+
+    // all created: a remote idle queue is better than waiting
+    for (auto &[n, idle] : idle_queues) {
+      if (!idle.empty()) {
+        SharedDriverQueueData *q = idle.back();
+        idle.pop_back();
+        return q;
+      }
+    }
+
+    pool_cond.wait(l);
+  }
+}
+
+void SharedDriverData::put_queue(SharedDriverQueueData *q)
+{
+  std::lock_guard l(pool_lock);
+  idle_queues[q->get_socket_id()].push_back(q);
+  pool_cond.notify_one();
+}
+
+void SharedDriverData::warm_up(unsigned nr)
+{
+  std::vector<SharedDriverQueueData*> created;
+  {
+    std::lock_guard l(pool_lock);
+    unsigned idle = 0;
+    for (auto &[n, v] : idle_queues) {
+      idle += v.size();
+    }
+    while (idle + created.size() < nr && nr_queues < max_queues) {
+      ++nr_queues;
+      created.push_back(nullptr);
+    }
+  }
+
+  // local to the controller, where well placed threads will want them
+  for (size_t i = 0; i < created.size(); ++i) {
+    SharedDriverQueueData *q = SharedDriverQueueData::create(this, numa_node);
+    if (!q) {
+      std::lock_guard l(pool_lock);
+      nr_queues -= created.size() - i;
+      // the same cap get_queue() would settle on; keep one so that it can
+      // still try (and report) when none could be created
+      max_queues = std::max(nr_queues, 1u);
+      created.resize(i);
+      break;
+    }
+    q->warm_up();
+    created[i] = q;
+  }
+
+  for (auto q : created) {
+    put_queue(q);
+  }
+  std::cout << __func__ << " " << trid.traddr << " created " << created.size() << " queues" << std::endl;
+}
+
+SharedQueuePoller *SharedDriverData::get_poller()
+{
+  std::unique_lock l(pool_lock);
+  if (!poller) {
+    l.unlock();
+    // the poller keeps a queue context for good; leased here so that not
+    // getting one is reported to the submitter
+    SharedDriverQueueData *queue = get_queue(numa_node);
+    if (!queue) {
+      return nullptr;
+    }
+    l.lock();
+    if (poller) {
+      l.unlock();
+      put_queue(queue);
+      l.lock();
+    } else {
+      poller = new SharedQueuePoller(this, queue);
+      poller->start();
+    }
+  }
+  return poller;
+}
+
+SharedDriverData::~SharedDriverData()
+{
+  // it gives its queue back to the pool on the way out
+  delete poller;
+
+  for (auto &[n, idle] : idle_queues) {
+    for (auto q : idle) {
+      delete q;
+    }
+  }
+}
+
 static void data_buf_reset_sgl(void *cb_arg, uint32_t sgl_offset)
 {
   Task *t = static_cast<Task*>(cb_arg);
+  if (t->io_request.direct) {
+    t->io_request.direct_off = sgl_offset;
+    return;
+  }
   uint32_t i = sgl_offset / data_buffer_size;
   uint32_t offset = i * data_buffer_size;
   assert(i <= t->io_request.nseg);
@@ -110,6 +561,14 @@ static int data_buf_next_sge(void *cb_arg, void **address, uint32_t *length)
   uint32_t size;
   void *addr;
   Task *t = static_cast<Task*>(cb_arg);
+  if (t->io_request.direct) {
+    // one virtually contiguous element; spdk splits it by page when it
+    // translates the addresses
+    *address = t->buf + t->io_request.direct_off;
+    *length = t->len - t->io_request.direct_off;
+    t->io_request.direct_off = t->len;
+    return 0;
+  }
   if (t->io_request.cur_seg_idx >= t->io_request.nseg) {
     *length = 0;
     *address = 0;
@@ -142,6 +601,15 @@ static int data_buf_next_sge(void *cb_arg, void **address, uint32_t *length)
 //Yuanguo: 从data_buf_list分配内存给t->io_request;
 int SharedDriverQueueData::alloc_buf_from_pool(Task *t, bool write)
 {
+  // zero copy from/to registered memory; spdk wants dword aligned data
+  if (t->buf && t->pieces.size() <= 1 &&
+      (reinterpret_cast<uintptr_t>(t->buf) & 3) == 0 &&
+      mem_registry.contains(t->buf, t->len)) {
+    t->io_request.direct = true;
+    t->io_request.direct_off = 0;
+    return 0;
+  }
+
   uint64_t count = t->len / data_buffer_size;
   if (t->len % data_buffer_size) {
     ++count;
@@ -169,7 +637,19 @@ int SharedDriverQueueData::alloc_buf_from_pool(Task *t, bool write)
   t->io_request.nseg = count;
   t->ctx->total_nseg += count;
 
-  if (write) {
+  if (write && t->pieces.size() > 1) {
+    // merged from separate user buffers, gather them
+    uint64_t done = 0;
+    for (auto &p : t->pieces) {
+      for (uint64_t o = 0; o < p.iov_len; ) {
+        uint64_t n = std::min<uint64_t>(p.iov_len - o, data_buffer_size - done % data_buffer_size);
+        memcpy(static_cast<char*>(segs[done / data_buffer_size]) + done % data_buffer_size,
+               static_cast<char*>(p.iov_base) + o, n);
+        o += n;
+        done += n;
+      }
+    }
+  } else if (write) {
     char* blp = t->buf;
     //auto blp = t->bl.begin();
     uint32_t len = 0;
@@ -187,100 +667,384 @@ int SharedDriverQueueData::alloc_buf_from_pool(Task *t, bool write)
   return 0;
 }
 
+Task *SharedDriverQueueData::submit_tasks(Task *t, IOContext *ioc)
+{
+  int r = 0;
+  uint64_t lba_off, lba_count;
+
+  // stripe the tasks of a large IO round robin over several qpairs, so that
+  // a single stream keeps more than one submission queue busy
+  bool stripe = false;
+  if (blk_options.spdk_stripe_lanes > 1) {
+    unsigned n = 0;
+    for (Task *i = t; i && n < blk_options.spdk_stripe_min_tasks; i = i->next) {
+      ++n;
+    }
+    stripe = n >= blk_options.spdk_stripe_min_tasks;
+  }
+
+  for (; t; t = t->next) {
+    unsigned lane = 0;
+    if (stripe) {
+      lane = next_lane % blk_options.spdk_stripe_lanes;
+    }
+    QueuePair *qp = get_qpair(ioc->prio, t->command, lane);
+    if (qp->current_queue_depth == qp->max_queue_depth) {
+      // no slots
+      return t;
+    }
+    if (!driver->may_issue(qp->prio)) {
+      // a more urgent class is busy and this one has used up its share
+      return t;
+    }
+
+    t->queue = this;
+    t->qpair = qp;
+    t->submit_stamp = stupid::common::mono_ns();
+    lba_off = t->offset / block_size;
+    lba_count = t->len / block_size;
+
+    switch (t->command) {
+      case IOCommand::WRITE_COMMAND:
+      {
+        std::cout << __func__ << " write command issued " << lba_off << "~" << lba_count << std::endl;
+        r = alloc_buf_from_pool(t, true);
+        if (r < 0) {
+          return t;
+        }
+
+        r = spdk_nvme_ns_cmd_writev(
+            ns, qp->qpair, lba_off, lba_count, io_complete, t, 0,
+            data_buf_reset_sgl, data_buf_next_sge);
+
+        if (r < 0) {
+          std::cerr << __func__ << " failed to do write command: " << stupid::common::cpp_strerror(r) << std::endl;
+          t->ctx->nvme_task_first = t->ctx->nvme_task_last = nullptr;
+          t->release_segs(this);
+          delete t;
+          abort();
+        }
+
+        break;
+      }
+      case IOCommand::READ_COMMAND:
+      {
+        std::cout << __func__ << " read command issued " << lba_off << "~" << lba_count << std::endl;
+        r = alloc_buf_from_pool(t, false);
+        if (r < 0) {
+          return t;
+        }
+
+        r = spdk_nvme_ns_cmd_readv(
+            ns, qp->qpair, lba_off, lba_count, io_complete, t, 0,
+            data_buf_reset_sgl, data_buf_next_sge);
+
+        if (r < 0) {
+          std::cerr << __func__ << " failed to read: " << stupid::common::cpp_strerror(r) << std::endl;
+          t->release_segs(this);
+          delete t;
+          abort();
+        }
+        break;
+      }
+      case IOCommand::FLUSH_COMMAND:
+      {
+        std::cout << __func__ << " flush command issueed " << std::endl;
+        r = spdk_nvme_ns_cmd_flush(ns, qp->qpair, io_complete, t);
+        if (r < 0) {
+          std::cerr << __func__ << " failed to flush: " << stupid::common::cpp_strerror(r) << std::endl;
+          t->release_segs(this);
+          delete t;
+          abort();
+        }
+        break;
+      }
+    }
+    issued(t->command, t->len, t->submit_stamp, !current_queue_depth);
+    if (stripe) {
+      ++next_lane;
+    }
+    current_queue_depth++;
+    ++queue_op_seq;
+    qp->current_queue_depth++;
+    ++driver->prio_inflight[qp->prio];
+  }
+  return nullptr;
+}
+
+void SharedDriverQueueData::issued(IOCommand cmd, uint64_t len, uint64_t submit_stamp, bool idle)
+{
+  uint64_t expected = expected_lat[static_cast<int>(cmd)][size_class(len)];
+  if (!expected) {
+    return;
+  }
+  // sleep only when the queue was idle: with IO already in flight,
+  // completions are due any time
+  if (idle) {
+    sleep_until = submit_stamp + expected / 2;
+  }
+  spin_until = std::max(spin_until, submit_stamp + expected * 2);
+}
+
+void SharedDriverQueueData::completed(IOCommand cmd, uint64_t len, uint64_t lat)
+{
+  uint64_t &e = expected_lat[static_cast<int>(cmd)][size_class(len)];
+  e = e ? e - e / 8 + lat / 8 : lat;
+}
+
+static void fast_io_complete(void *arg, const struct spdk_nvme_cpl *completion)
+{
+  auto fc = static_cast<SharedDriverQueueData::FastCmd*>(arg);
+  SharedDriverQueueData *queue = fc->queue;
+  int cmd = static_cast<int>(fc->command);
+  fc->complete_stamp = stupid::common::mono_ns();
+  uint64_t lat = fc->complete_stamp - fc->submit_stamp;
+
+  fc->qp->lat.device[cmd].add(lat);
+  queue->completed(fc->command, fc->len, lat);
+  ++queue->completed_op_seq;
+  queue->complete_command(fc->qp);
+
+  if (spdk_nvme_cpl_is_error(completion)) {
+    std::cerr << __func__ << " " << io_command_name(cmd) << " failed, sct " << completion->status.sct
+      << " sc " << completion->status.sc << std::endl;
+    fc->status = -EIO;
+  } else {
+    fc->status = 0;
+  }
+  fc->done = true;
+}
+
+int SharedDriverQueueData::fast_io(IOCommand cmd, uint64_t off, uint64_t len, char *buf, uint64_t skip, uint64_t copy_len,
+  uint8_t prio)
+{
+  assert(len <= data_buffer_size);
+  assert(cmd != IOCommand::FLUSH_COMMAND);
+
+  uint32_t max_io_completion = 0;  //0 means let spdk library determine it;
+  bool sampled = sample_cpu();
+  uint64_t cpu_start = sampled ? stupid::common::thread_cpu_ns() : 0;
+
+  QueuePair *qp = get_qpair(prio, cmd);
+  while (qp->current_queue_depth == qp->max_queue_depth || !driver->may_issue(qp->prio)) {
+    if (current_queue_depth) {
+      poll_completions(max_io_completion);
+    } else {
+      usleep(blk_options.spdk_poll_sleep_us);
+    }
+  }
+
+  // registered memory is used as is, unless only a part of the range is
+  // wanted (read_random)
+  bool direct = skip == 0 && copy_len == len && (reinterpret_cast<uintptr_t>(buf) & 3) == 0 &&
+    mem_registry.contains(buf, len);
+  char *dma = buf;
+  data_cache_buf *b = nullptr;
+  if (!direct) {
+    // a leased queue has nothing in flight, so its buffers are all there
+    assert(!data_buf_list.empty());
+    b = &data_buf_list.front();
+    data_buf_list.pop_front();
+    dma = reinterpret_cast<char*>(b);
+    if (cmd == IOCommand::WRITE_COMMAND) {
+      memcpy(dma, buf, len);
+    }
+  }
+
+  FastCmd &fc = fast_cmd;
+  fc = {this, qp, cmd, len, stupid::common::mono_ns(), 0, 0, false};
+  uint64_t lba_off = off / block_size;
+  uint32_t lba_count = len / block_size;
+  int r;
+  if (cmd == IOCommand::READ_COMMAND) {
+    r = spdk_nvme_ns_cmd_read(ns, qp->qpair, dma, lba_off, lba_count, fast_io_complete, &fc, 0);
+  } else {
+    r = spdk_nvme_ns_cmd_write(ns, qp->qpair, dma, lba_off, lba_count, fast_io_complete, &fc, 0);
+  }
+  if (r < 0) {
+    std::cerr << __func__ << " failed to submit " << io_command_name(static_cast<int>(cmd)) << ": "
+      << stupid::common::cpp_strerror(r) << std::endl;
+    if (b) {
+      data_buf_list.push_front(*b);
+    }
+    return r;
+  }
+
+  issued(cmd, len, fc.submit_stamp, !current_queue_depth);
+  current_queue_depth++;
+  ++queue_op_seq;
+  qp->current_queue_depth++;
+  ++driver->prio_inflight[qp->prio];
+
+  while (!fc.done) {
+    if (poll_completions(max_io_completion) == 0) {
+      poll_backoff();
+    }
+  }
+
+  if (b) {
+    if (fc.status == 0 && cmd == IOCommand::READ_COMMAND) {
+      memcpy(buf, dma + skip, copy_len);
+    }
+    data_buf_list.push_front(*b);
+  }
+  qp->lat.callback[static_cast<int>(cmd)].add(stupid::common::mono_ns() - fc.complete_stamp);
+
+  if (sampled) {
+    poll_cpu_ns += (stupid::common::thread_cpu_ns() - cpu_start) * CPU_SAMPLE_EVERY;
+  }
+  return fc.status;
+}
+
+void SharedDriverQueueData::poll_backoff()
+{
+  if (blk_options.spdk_hybrid_poll) {
+    uint64_t now = stupid::common::mono_ns();
+    if (sleep_until) {
+      if (now < sleep_until) {
+        struct timespec ts = {0, (long)(sleep_until - now)};
+        nanosleep(&ts, nullptr);
+      }
+      sleep_until = 0;
+      return;
+    }
+    if (now < spin_until) {
+      return;
+    }
+  }
+  usleep(blk_options.spdk_poll_sleep_us);
+}
+
 void SharedDriverQueueData::_aio_handle(Task *t, IOContext *ioc)
 {
   std::cout << __func__ << " start" << std::endl;
 
-  int r = 0;
-  uint64_t lba_off, lba_count;
   uint32_t max_io_completion = 0;  //0 means let spdk library determine it;
-  uint64_t io_sleep_in_us = 5;
+  bool sampled = sample_cpu();
+  uint64_t cpu_start = sampled ? stupid::common::thread_cpu_ns() : 0;
 
   while (ioc->num_running) {
-again:
-    std::cout << __func__ << " polling" << std::endl;
     //Yuanguo: 第一轮while循环应该 current_queue_depth = 0；
     //  从第二轮开始，试图poll上一轮提交的请求；
     if (current_queue_depth) {
-      r = spdk_nvme_qpair_process_completions(qpair, max_io_completion);
-      if (r < 0) {
-        abort();
-      } else if (r == 0) {
-        usleep(io_sleep_in_us);
+      int r = poll_completions(max_io_completion);
+      if (r == 0) {
+        poll_backoff();
       }
     }
 
-    for (; t; t = t->next) {
-      if (current_queue_depth == max_queue_depth) {
-        // no slots
-        // Yuanguo: 前面一个也没poll到？queue还是满的，回去继续poll；
-        goto again;
+    if (t) {
+      t = submit_tasks(t, ioc);
+      if (t && !current_queue_depth) {
+        // held back by the class weighting, nothing of ours to poll
+        usleep(blk_options.spdk_poll_sleep_us);
       }
-
-      t->queue = this;
-      lba_off = t->offset / block_size;
-      lba_count = t->len / block_size;
-
-      switch (t->command) {
-        case IOCommand::WRITE_COMMAND:
-        {
-          std::cout << __func__ << " write command issued " << lba_off << "~" << lba_count << std::endl;
-          r = alloc_buf_from_pool(t, true);
-          if (r < 0) {
-            goto again;
-          }
-
-          r = spdk_nvme_ns_cmd_writev(
-              ns, qpair, lba_off, lba_count, io_complete, t, 0,
-              data_buf_reset_sgl, data_buf_next_sge);
-
-          if (r < 0) {
-            std::cerr << __func__ << " failed to do write command: " << stupid::common::cpp_strerror(r) << std::endl;
-            t->ctx->nvme_task_first = t->ctx->nvme_task_last = nullptr;
-            t->release_segs(this);
-            delete t;
-            abort();
-          }
-
-          break;
-        }
-        case IOCommand::READ_COMMAND:
-        {
-          std::cout << __func__ << " read command issued " << lba_off << "~" << lba_count << std::endl;
-          r = alloc_buf_from_pool(t, false);
-          if (r < 0) {
-            goto again;
-          }
-
-          r = spdk_nvme_ns_cmd_readv(
-              ns, qpair, lba_off, lba_count, io_complete, t, 0,
-              data_buf_reset_sgl, data_buf_next_sge);
-
-          if (r < 0) {
-            std::cerr << __func__ << " failed to read: " << stupid::common::cpp_strerror(r) << std::endl;
-            t->release_segs(this);
-            delete t;
-            abort();
-          }
-          break;
-        }
-        case IOCommand::FLUSH_COMMAND:
-        {
-          std::cout << __func__ << " flush command issueed " << std::endl;
-          r = spdk_nvme_ns_cmd_flush(ns, qpair, io_complete, t);
-          if (r < 0) {
-            std::cerr << __func__ << " failed to flush: " << stupid::common::cpp_strerror(r) << std::endl;
-            t->release_segs(this);
-            delete t;
-            abort();
-          }
-          break;
-        }
-      }
-      current_queue_depth++;
     }
   }
 
+  if (sampled) {
+    poll_cpu_ns += (stupid::common::thread_cpu_ns() - cpu_start) * CPU_SAMPLE_EVERY;
+  }
   std::cout << __func__ << " end" << std::endl;
 }
 
+SharedQueuePoller::SharedQueuePoller(SharedDriverData *driver, SharedDriverQueueData *queue)
+  : driver(driver), queue(queue), ring(blk_options.spdk_shared_ring_size)
+{
+}
+
+SharedQueuePoller::~SharedQueuePoller()
+{
+  stop();
+}
+
+void SharedQueuePoller::start()
+{
+  poll_thread.create("nvme_poller");
+}
+
+void SharedQueuePoller::stop()
+{
+  if (!poll_thread.is_started()) {
+    return;
+  }
+  stopping = true;
+  {
+    std::lock_guard l(idle_lock);
+    idle_cond.notify_one();
+  }
+  poll_thread.join();
+}
+
+void SharedQueuePoller::submit(IOContext *ioc, Task *t)
+{
+  while (!ring.push({ioc, t})) {
+    // the poller is behind by a whole ring; let it catch up
+    sched_yield();
+  }
+  if (idle.load()) {
+    std::lock_guard l(idle_lock);
+    idle_cond.notify_one();
+  }
+}
+
+void SharedQueuePoller::_poll()
+{
+  bool remote = false;
+  driver->place_thread(&remote);
+
+  uint32_t max_io_completion = 0;  //0 means let spdk library determine it;
+  submission_t sub;
+  uint64_t cpu_last = stupid::common::thread_cpu_ns();
+  auto account_cpu = [&] {
+    uint64_t now = stupid::common::thread_cpu_ns();
+    queue->poll_cpu_ns += now - cpu_last;
+    cpu_last = now;
+  };
+  uint64_t rounds = 0;
+  while (!stopping || !backlog.empty() || queue->current_queue_depth) {
+    // reading the thread cpu clock is a syscall, not on every round
+    if ((++rounds & 1023) == 0) {
+      account_cpu();
+    }
+
+    while (ring.pop(&sub)) {
+      backlog.push_back(sub);
+    }
+
+    // in arrival order; the first one which does not fit blocks the rest
+    while (!backlog.empty()) {
+      submission_t &front = backlog.front();
+      front.t = queue->submit_tasks(front.t, front.ioc);
+      if (front.t) {
+        break;
+      }
+      backlog.pop_front();
+    }
+
+    if (queue->current_queue_depth) {
+      if (queue->poll_completions(max_io_completion) == 0) {
+        queue->poll_backoff();
+      }
+      continue;
+    }
+
+    if (backlog.empty() && !stopping) {
+      account_cpu();
+      // nothing in flight and nothing to submit: sleep until a producer
+      // pushes; the timeout covers a push racing with going to sleep
+      std::unique_lock l(idle_lock);
+      idle = true;
+      if (ring.empty() && !stopping) {
+        idle_cond.wait_for(l, std::chrono::milliseconds(1));
+      }
+      idle = false;
+    } else if (!backlog.empty()) {
+      // held back by the class weighting with nothing of ours in flight
+      usleep(blk_options.spdk_poll_sleep_us);
+    }
+  }
+  account_cpu();
+
+  driver->put_queue(queue);
+}
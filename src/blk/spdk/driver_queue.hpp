@@ -5,75 +5,230 @@
 
 #include <iostream>
 #include <atomic>
+#include <utility>
+#include <vector>
+#include <memory>
+#include <deque>
 
 #include <boost/intrusive/slist.hpp>
 
 #include <spdk/nvme.h>
 
 #include "common/global.hpp"
+#include "common/mutex.hpp"
+#include "common/thread.hpp"
+#include "common/mpsc_ring.hpp"
 #include "blk/spdk/driver.hpp"
 
 class Task;
 
+// one spdk io qpair of a SharedDriverQueueData
+struct QueuePair {
+  struct spdk_nvme_qpair *qpair = nullptr;
+  // IOContext priority class the qpair was allocated for
+  int prio = IOContext::PRIO_MEDIUM;
+  uint32_t max_queue_depth = 0;
+  uint32_t current_queue_depth = 0;
+  QueueLatency lat;
+};
+
+// A queue context: IO qpairs plus a pool of DMA data buffers. Queue contexts
+// are owned by SharedDriverData, which leases them to submitting threads for
+// the duration of one aio_submit, see SharedDriverData::get_queue().
 class SharedDriverQueueData {
-  NVMEDevice *bdev;
   SharedDriverData *driver;
   spdk_nvme_ctrlr *ctrlr;
   spdk_nvme_ns *ns;
   std::string sn;
   uint32_t block_size;
-  uint32_t max_queue_depth;
-  struct spdk_nvme_qpair *qpair;
+  // qpairs[prio][0] serves reads, or everything if spdk_separate_rw_qpairs
+  // is off; qpairs[prio][1] serves writes and flushes. they are allocated on
+  // first use, so a thread only takes the controller queues it really uses.
+  QueuePair qpairs[IOContext::PRIO_MAX][2];
+  // the other lanes large IOs are striped over, next to qpairs[prio][dir];
+  // blk_options.spdk_stripe_lanes - 1 of them, set up on first use
+  std::unique_ptr<QueuePair[]> stripes[IOContext::PRIO_MAX][2];
+  unsigned nr_stripes = 0;
+  // lane of the next task of a striped chain
+  unsigned next_lane = 0;
+
+  template <typename F>
+  void for_each_qpair(F &&f) const {
+    for (int prio = 0; prio < IOContext::PRIO_MAX; ++prio) {
+      for (int dir = 0; dir < 2; ++dir) {
+        f(prio, dir, 0u, const_cast<QueuePair&>(qpairs[prio][dir]));
+        if (stripes[prio][dir]) {
+          for (unsigned i = 0; i < nr_stripes; ++i) {
+            f(prio, dir, i + 1, const_cast<QueuePair&>(stripes[prio][dir][i]));
+          }
+        }
+      }
+    }
+  }
+  // NUMA node the data buffers are allocated on, -1 means any
+  int socket_id = -1;
 
+  int alloc_qpair(QueuePair *qp, int prio);
+  QueuePair *get_qpair(int prio, IOCommand command, unsigned lane = 0);
   int alloc_buf_from_pool(Task *t, bool write);
 
+  // aio IOContexts finished during the current poll cycle, delivered to
+  // their devices in one batch per device by flush_finished_iocs()
+  struct finished_ioc_t {
+    NVMEDevice *dev;
+    IOContext *ioc;
+    // callback latency histogram and completion time of the last task
+    stupid::common::LatencyHistogram *lat;
+    uint64_t complete_stamp;
+  };
+  std::vector<finished_ioc_t> finished_iocs;
+  std::vector<IOContext*> finished_batch;
+  void flush_finished_iocs();
+
+  // moving average of the submit->complete latency by command and size
+  // class (4K, 8K, ... 128K and above), driving the hybrid polling
+  static constexpr int nr_size_classes = 6;
+  uint64_t expected_lat[nr_io_commands][nr_size_classes] = {};
+  // hybrid polling: sleep until sleep_until before spinning; beyond
+  // spin_until the estimate has been overrun, back to short sleeps
+  uint64_t sleep_until = 0;
+  uint64_t spin_until = 0;
+
+  static int size_class(uint64_t len) {
+    uint64_t pages = (len + 4095) / 4096;
+    int c = pages <= 1 ? 0 : 64 - __builtin_clzll(pages - 1);
+    return std::min(c, nr_size_classes - 1);
+  }
+  void issued(IOCommand cmd, uint64_t len, uint64_t submit_stamp, bool idle);
+
+public:
+  // the command descriptor of the small IO fast path; a queue is leased to
+  // one thread at a time, so one descriptor per queue is enough
+  struct FastCmd {
+    SharedDriverQueueData *queue;
+    QueuePair *qp;
+    IOCommand command;
+    uint64_t len;
+    uint64_t submit_stamp;
+    uint64_t complete_stamp;
+    int status;
+    bool done;
+  };
+
+private:
+  FastCmd fast_cmd;
+
 public:
+  // commands in flight over all the qpairs
   uint32_t current_queue_depth = 0;
-  std::atomic_ulong completed_op_seq, queue_op_seq;
+  std::atomic_ulong completed_op_seq = {0}, queue_op_seq = {0};
+  // cpu time spent in _aio_handle or by the shared poller on this queue
+  std::atomic<uint64_t> poll_cpu_ns = {0};
+  // reading the thread cpu clock is a syscall: the per IO paths only time
+  // one call in CPU_SAMPLE_EVERY, and count it that many times
+  static const uint64_t CPU_SAMPLE_EVERY = 64;
+  uint64_t cpu_sample_seq = 0;
+  bool sample_cpu() {
+    return (++cpu_sample_seq % CPU_SAMPLE_EVERY) == 0;
+  }
   boost::intrusive::slist<data_cache_buf, boost::intrusive::constant_time_size<true>> data_buf_list;
 
+  // issue the task chain starting at t as far as the qpairs, the class
+  // weighting and the data buffers allow; returns the first task not issued,
+  // nullptr if all were.
+  Task *submit_tasks(Task *t, IOContext *ioc);
+  // reap the completions of all the qpairs and deliver the finished aio iocs
+  int poll_completions(uint32_t max_io_completion);
+  // wait a little after a poll which found nothing
+  void poll_backoff();
+  // a command issued on this queue completed after lat nanoseconds
+  void completed(IOCommand cmd, uint64_t len, uint64_t lat);
+
+  // Small IO fast path: a single block aligned range [off, off + len) of at
+  // most one data buffer, issued with a plain (not sgl) command and polled to
+  // completion right here, without Tasks or an IOContext. A read copies
+  // copy_len bytes from skip into buf; a write takes len bytes from buf.
+  // prio picks the qpair class, as for the IOContext of a Task.
+  int fast_io(IOCommand cmd, uint64_t off, uint64_t len, char *buf, uint64_t skip, uint64_t copy_len,
+    uint8_t prio);
+  // submit the chain and poll until ioc has no IO running
   void _aio_handle(Task *t, IOContext *ioc);
 
-  SharedDriverQueueData(NVMEDevice *bdev, SharedDriverData *driver) : bdev(bdev), driver(driver)
-  {
-    ctrlr = driver->ctrlr;
-    ns = driver->ns;
-    block_size = driver->block_size;
-
-    struct spdk_nvme_io_qpair_opts opts = {};
-    spdk_nvme_ctrlr_get_default_io_qpair_opts(ctrlr, &opts, sizeof(opts));
-    opts.qprio = SPDK_NVME_QPRIO_URGENT;
-    // usable queue depth should minus 1 to avoid overflow.
-    max_queue_depth = opts.io_queue_size - 1;
-
-    qpair = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, &opts, sizeof(opts));
-    if (qpair == NULL) {
-      std::cerr << __func__ << " failed to create queue pair" << std::endl;
-      assert(qpair != NULL);
-    }
+  SharedDriverQueueData(SharedDriverData *driver, int socket_id);
+  ~SharedDriverQueueData();
+  // allocate the qpair of the default class and the data buffers
+  int init();
+  // a queue context ready for IO, nullptr if the controller is out of io
+  // queues or there is no dma memory left
+  static SharedDriverQueueData *create(SharedDriverData *driver, int socket_id);
 
-    // allocate spdk dma memory
-    for (uint16_t i = 0; i < data_buffer_default_num; i++) {
-      void *b = spdk_dma_zmalloc(data_buffer_size, stupid::global::constant_page_size, NULL);
-      if (!b) {
-        std::cerr << __func__ << " failed to create memory pool for nvme data buffer" << std::endl;
-        assert(b);
-      }
-      data_buf_list.push_front(*reinterpret_cast<data_cache_buf *>(b));
-    }
+  int get_socket_id() const { return socket_id; }
+
+  // allocate the qpairs of the default class now rather than on first IO
+  void warm_up();
 
-    ++driver->queues_allocated;
-    std::cout << "allocated queue " << qpair << " queues_allocated: " << driver->queues_allocated.load() << std::endl;
+  // an aio IOContext (priv set) has got all its tasks completed
+  void ioc_finished(NVMEDevice *dev, IOContext *ioc, stupid::common::LatencyHistogram *lat, uint64_t complete_stamp) {
+    finished_iocs.push_back({dev, ioc, lat, complete_stamp});
   }
 
-  ~SharedDriverQueueData() {
-    if (qpair) {
-      spdk_nvme_ctrlr_free_io_qpair(qpair);
-    }
+  // latencies of all the qpairs added into total
+  void collect_latency(QueueLatency *total) const;
+  void dump_latency(std::ostream& out) const;
 
-    data_buf_list.clear_and_dispose(spdk_dma_free);
-    --driver->queues_allocated;
+  // bookkeeping for a command issued on qp which has completed
+  void complete_command(QueuePair *qp) {
+    --current_queue_depth;
+    --qp->current_queue_depth;
+    --driver->prio_inflight[qp->prio];
   }
 };
 
+// Shared qpair mode (blk_options.spdk_shared_qpair): submitting threads push
+// their task chains into a lock-free ring, and a single poller thread per
+// controller issues them on its own queue context and reaps the completions.
+// The number of submitters is then not bounded by the controller's io queues.
+class SharedQueuePoller {
+  struct submission_t {
+    IOContext *ioc;
+    Task *t;
+  };
+
+  SharedDriverData *driver;
+  // leased by get_poller(), given back when the poller stops
+  SharedDriverQueueData *queue;
+  stupid::common::MpscRing<submission_t> ring;
+  // taken off the ring but not (completely) issued yet, owned by the poller
+  std::deque<submission_t> backlog;
+  std::atomic_bool stopping = {false};
+
+  // the poller sleeps on idle_cond when it has nothing to do
+  std::atomic_bool idle = {false};
+  stupid::common::mutex idle_lock = stupid::common::make_mutex("SharedQueuePoller::idle_lock");
+  stupid::common::condition_variable idle_cond;
+
+  struct PollThread : public stupid::common::Thread {
+    SharedQueuePoller *poller;
+    explicit PollThread(SharedQueuePoller *p) : poller(p) {}
+    void *entry() override {
+      poller->_poll();
+      return nullptr;
+    }
+  } poll_thread{this};
+
+  void _poll();
+
+public:
+  SharedQueuePoller(SharedDriverData *driver, SharedDriverQueueData *queue);
+  ~SharedQueuePoller();
+
+  void start();
+  // drains what has been submitted before returning
+  void stop();
+
+  // hand the task chain of ioc over to the poller, waiting only if the ring
+  // is full; completions are reported as in the per-thread mode
+  void submit(IOContext *ioc, Task *t);
+};
+
 #endif //STUPID__BLK_SPDK_DRIVER_QUEUE_HPP
@@ -0,0 +1,104 @@
+#include <errno.h>
+
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#include <spdk/env.h>
+
+#include "common/bit_op.hpp"
+#include "common/util.hpp"
+
+#include "blk/spdk/mem_registry.hpp"
+
+MemRegistry mem_registry;
+
+int MemRegistry::add(void *addr, uint64_t len)
+{
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+  if (len == 0) {
+    return -EINVAL;
+  }
+
+  std::unique_lock l(lock);
+  auto next = regions.lower_bound(start);
+  if (next != regions.end() && next->first < start + len) {
+    return -EEXIST;
+  }
+  if (next != regions.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second > start) {
+      return -EEXIST;
+    }
+  }
+
+  uintptr_t first = stupid::common::p2align<uintptr_t>(start, PAGE);
+  uintptr_t last = stupid::common::p2roundup<uintptr_t>(start + len, PAGE);
+  std::vector<uintptr_t> fresh;
+  for (uintptr_t p = first; p < last; p += PAGE) {
+    if (pages.count(p)) {
+      continue;
+    }
+    // page by page, so that each can be unregistered on its own
+    if (int r = spdk_mem_register(reinterpret_cast<void*>(p), PAGE); r < 0) {
+      std::cerr << __func__ << " failed to register " << addr << "~" << len << " (2MB page at "
+        << reinterpret_cast<void*>(p) << "): " << stupid::common::cpp_strerror(r) << std::endl;
+      for (uintptr_t f : fresh) {
+        spdk_mem_unregister(reinterpret_cast<void*>(f), PAGE);
+      }
+      return r;
+    }
+    fresh.push_back(p);
+  }
+  for (uintptr_t p = first; p < last; p += PAGE) {
+    ++pages[p];
+  }
+  regions[start] = len;
+  ++nr_regions;
+  std::cout << __func__ << " registered " << addr << "~" << len << std::endl;
+  return 0;
+}
+
+int MemRegistry::remove(void *addr)
+{
+  std::unique_lock l(lock);
+  auto it = regions.find(reinterpret_cast<uintptr_t>(addr));
+  if (it == regions.end()) {
+    return -ENOENT;
+  }
+  // the caller must have no IO left on the region
+  uintptr_t first = stupid::common::p2align<uintptr_t>(it->first, PAGE);
+  uintptr_t last = stupid::common::p2roundup<uintptr_t>(it->first + it->second, PAGE);
+  int ret = 0;
+  for (uintptr_t p = first; p < last; p += PAGE) {
+    auto pg = pages.find(p);
+    if (--pg->second > 0) {
+      continue;
+    }
+    pages.erase(pg);
+    if (int r = spdk_mem_unregister(reinterpret_cast<void*>(p), PAGE); r < 0) {
+      std::cerr << __func__ << " failed to unregister the 2MB page at " << reinterpret_cast<void*>(p)
+        << " of " << addr << ": " << stupid::common::cpp_strerror(r) << std::endl;
+      ret = r;
+    }
+  }
+  regions.erase(it);
+  --nr_regions;
+  return ret;
+}
+
+bool MemRegistry::contains(const void *addr, uint64_t len) const
+{
+  if (!nr_regions.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+  std::shared_lock l(lock);
+  auto it = regions.upper_bound(start);
+  if (it == regions.begin()) {
+    return false;
+  }
+  --it;
+  return start + len <= it->first + it->second;
+}
@@ -0,0 +1,37 @@
+#ifndef STUPID__BLK_SPDK_MEM_REGISTRY_HPP
+#define STUPID__BLK_SPDK_MEM_REGISTRY_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+
+#include "common/mutex.hpp"
+
+// Application memory registered with spdk_mem_register(), so that the
+// controllers can DMA to and from it directly. The spdk memory map is process
+// wide, so is this registry.
+class MemRegistry {
+  mutable stupid::common::shared_mutex lock = stupid::common::make_shared_mutex("MemRegistry::lock");
+  // spdk translates addresses in 2MB pages and only registers whole ones
+  static const uint64_t PAGE = 2ull << 20;
+
+  // start -> length
+  std::map<uintptr_t, uint64_t> regions;
+  // the 2MB pages registered with spdk -> regions on them
+  std::map<uintptr_t, uint32_t> pages;
+  // lets contains() skip the lock while nothing is registered
+  std::atomic<size_t> nr_regions = {0};
+
+public:
+  // Regions may not overlap, but need not be aligned: the 2MB pages they
+  // touch are registered with spdk, each once for all the regions sharing
+  // it. Those pages must be mapped as a whole.
+  int add(void *addr, uint64_t len);
+  int remove(void *addr);
+  // true if [addr, addr + len) lies within one registered region
+  bool contains(const void *addr, uint64_t len) const;
+};
+
+extern MemRegistry mem_registry;
+
+#endif //STUPID__BLK_SPDK_MEM_REGISTRY_HPP
@@ -1,13 +1,18 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <memory>
+#include <atomic>
 
 #include <spdk/nvme.h>
 
 #include "common/util.hpp"
 #include "common/bit_op.hpp"
 
+#include "blk/blk_options.hpp"
 #include "blk/spdk/nvme_manager.hpp"
+#include "blk/spdk/mem_registry.hpp"
 #include "blk/spdk/nvme_device.hpp"
 #include "blk/spdk/task.hpp"
 
@@ -31,10 +36,9 @@ bool NVMEDevice::support(const std::string& path)
   return false;
 }
 
-int NVMEDevice::open(const std::string& p)
+// p is a file containing the transport id, like 'trtype:pcie traddr:0000:65:00.0'
+static int read_trid(const std::string& p, spdk_nvme_transport_id *trid)
 {
-  std::cout << __func__ << " path " << p << std::endl;
-
   std::ifstream ifs(p);
   if (!ifs) {
     std::cerr << __func__ << " unable to open " << p << std::endl;
@@ -43,12 +47,35 @@ int NVMEDevice::open(const std::string& p)
 
   std::string val;
   std::getline(ifs, val);
-  spdk_nvme_transport_id trid;
 
-  if (int r = spdk_nvme_transport_id_parse(&trid, val.c_str()); r) {
+  if (int r = spdk_nvme_transport_id_parse(trid, val.c_str()); r) {
     std::cerr << __func__ << " unable to read " << p << ": " << stupid::common::cpp_strerror(r) << std::endl;
     return r;
   }
+  return 0;
+}
+
+int NVMEDevice::attach_all(const std::vector<std::string>& paths)
+{
+  std::vector<spdk_nvme_transport_id> trids(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (int r = read_trid(paths[i], &trids[i]); r) {
+      return r;
+    }
+  }
+
+  std::vector<SharedDriverData*> drivers;
+  return manager.try_get_many(trids, &drivers);
+}
+
+int NVMEDevice::open(const std::string& p)
+{
+  std::cout << __func__ << " path " << p << std::endl;
+
+  spdk_nvme_transport_id trid;
+  if (int r = read_trid(p, &trid); r) {
+    return r;
+  }
 
   if (int r = manager.try_get(trid, &driver); r < 0) {
     std::cerr << __func__ << " failed to get nvme device with transport address " << trid.traddr << " type " << trid.trtype << std::endl;
@@ -66,6 +93,8 @@ int NVMEDevice::open(const std::string& p)
   // round size down to an even block
   size &= ~(block_size - 1);
 
+  driver->warm_up(blk_options.spdk_queue_warmup);
+
   std::cout << __func__ << " size " << size << " (" << size << ")"
     << " block_size " << block_size << " (" << block_size << ")"
     << std::endl;
@@ -73,16 +102,32 @@ int NVMEDevice::open(const std::string& p)
   return 0;
 }
 
+void NVMEDevice::warm_up(unsigned nr_queues)
+{
+  driver->warm_up(nr_queues);
+}
+
 void NVMEDevice::close()
 {
   std::cout << __func__ << std::endl;
 
   name.clear();
   driver->remove_device(this);
+  reap_ioc();
 
   std::cout << __func__ << " end" << std::endl;
 }
 
+int NVMEDevice::get_numa_node(int *node) const
+{
+  int n = driver ? driver->get_numa_node() : -1;
+  if (n < 0) {
+    return -ENOENT;
+  }
+  *node = n;
+  return 0;
+}
+
 int NVMEDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
 {
   (*pm)[prefix + "rotational"] = "0";
@@ -93,13 +138,144 @@ int NVMEDevice::collect_metadata(const std::string& prefix, std::map<std::string
   (*pm)[prefix + "access_mode"] = "spdk";
   (*pm)[prefix + "nvme_serial_number"] = name;
 
+  if (int node; get_numa_node(&node) == 0) {
+    (*pm)[prefix + "numa_node"] = std::to_string(node);
+  }
+
+  if (driver) {
+    QueueLatency lat;
+    driver->collect_latency(&lat);
+    for (int cmd = 0; cmd < nr_io_commands; ++cmd) {
+      std::ostringstream dev, cb;
+      lat.device[cmd].summary(dev);
+      lat.callback[cmd].summary(cb);
+      (*pm)[prefix + "nvme_" + io_command_name(cmd) + "_device_lat"] = dev.str();
+      (*pm)[prefix + "nvme_" + io_command_name(cmd) + "_callback_lat"] = cb.str();
+    }
+    (*pm)[prefix + "nvme_poll_cpu_ns_per_io"] = std::to_string(lat.cpu_ns_per_io());
+  }
+
   return 0;
 }
 
+// drop the tasks of an ioc which is not going to be submitted, reporting r to
+// the waiter (sync read/write) or to the aio callback.
+static void ioc_fail_tasks(NVMEDevice *dev, IOContext *ioc, Task *t, int r)
+{
+  for (Task *next; t; t = next) {
+    next = t->next;
+    if (Task* primary = t->primary; primary != nullptr) {
+      primary->return_code = r;
+      delete t;
+    } else if (t->return_code) {
+      // the primary task of a sync read lives on the caller's stack
+      t->return_code = r;
+    } else {
+      delete t;
+    }
+  }
+
+  ioc->set_return_value(r);
+  if (ioc->priv) {
+    std::vector<IOContext*> iocs = {ioc};
+    dev->aio_complete_batch(iocs);
+  }
+}
+
+int NVMEDevice::register_memory(void *addr, uint64_t len)
+{
+  // the spdk environment is up once a device is open
+  if (!driver) {
+    return -ENODEV;
+  }
+  return mem_registry.add(addr, len);
+}
+
+int NVMEDevice::unregister_memory(void *addr, uint64_t len)
+{
+  if (!driver) {
+    return -ENODEV;
+  }
+  return mem_registry.remove(addr);
+}
+
+void NVMEDevice::dump_latency(std::ostream& out) const
+{
+  if (driver) {
+    driver->dump_latency(out);
+  }
+}
+
+// tags the tasks of one read/write call, see Task::call
+static std::atomic<uint64_t> next_call = {1};
+
+// Fold every task into the one before it when they are the same command on
+// adjacent LBAs, up to max_len bytes; the user memory of the merged range is
+// kept in Task::pieces. Pieces of the same call are not merged back, the
+// split is what spreads a large IO over the qpair. The tasks of a sync read()
+// (return_code set) are left alone, one of them lives on the stack. Returns
+// the number of tasks gone.
+static int merge_tasks(IOContext *ioc, uint64_t max_len)
+{
+  int merged = 0;
+  Task *t = static_cast<Task*>(ioc->nvme_task_first);
+  while (t && t->next) {
+    Task *n = t->next;
+    if (t->call == n->call ||
+        t->command != n->command || t->command == IOCommand::FLUSH_COMMAND ||
+        t->return_code || n->return_code || !t->buf || !n->buf ||
+        t->offset + t->len != n->offset || t->len + n->len > max_len) {
+      t = n;
+      continue;
+    }
+
+    if (t->pieces.empty()) {
+      t->pieces.push_back({t->buf, (size_t)t->len});
+    }
+    iovec &last = t->pieces.back();
+    if (static_cast<char*>(last.iov_base) + last.iov_len == n->buf) {
+      last.iov_len += n->len;
+    } else {
+      t->pieces.push_back({n->buf, (size_t)n->len});
+    }
+    t->len += n->len;
+    // t now ends with the call of n
+    t->call = n->call;
+    if (t->command == IOCommand::READ_COMMAND) {
+      t->fill_cb = [t] {
+        uint64_t off = 0;
+        for (auto &p : t->pieces) {
+          t->copy_to_buf(static_cast<char*>(p.iov_base), off, p.iov_len);
+          off += p.iov_len;
+        }
+      };
+    }
+
+    t->next = n->next;
+    if (ioc->nvme_task_last == n) {
+      ioc->nvme_task_last = t;
+    }
+    delete n;
+    ++merged;
+  }
+  return merged;
+}
+
 void NVMEDevice::aio_submit(IOContext *ioc)
 {
   std::cout << __func__ << " ioc " << ioc << " pending " << ioc->num_pending.load() << " running " << ioc->num_running.load() << std::endl;
 
+  if (blk_options.bdev_merge_ios && ioc->num_pending.load() > 1) {
+    uint64_t max_len = blk_options.bdev_merge_max;
+    if (driver->get_max_xfer_size()) {
+      max_len = std::min<uint64_t>(max_len, driver->get_max_xfer_size());
+    }
+    if (int merged = merge_tasks(ioc, max_len); merged > 0) {
+      std::cout << __func__ << " ioc " << ioc << " merged " << merged << " tasks" << std::endl;
+      ioc->num_pending -= merged;
+    }
+  }
+
   int pending = ioc->num_pending.load();
   Task *t = static_cast<Task*>(ioc->nvme_task_first);
   if (pending && t) {
@@ -117,37 +293,52 @@ void NVMEDevice::aio_submit(IOContext *ioc)
     // Only need to push the first entry
     ioc->nvme_task_first = ioc->nvme_task_last = nullptr;
 
-    //Yuanguo:
-    // thread_local变量：
-    //      - 线程首次访问时初始化（类似static变量的延迟初始化）
-    //      - 线程退出时析构(按声明顺序的逆序析构)
-    // 和函数内部的static变量有点像：
-    //
-    //     存储说明符       |   作用域    |  声明周期      |  线程共享性
-    //  --------------------+-------------+----------------+-------------------
-    //     函数内static变量 |   块作用域  |  程序生命周期  |  所有线程共享
-    //     thread_local变量 |   块作用域  |  线程生命周期  |  每个线程独立
-
-    //Yuanguo: 注意！！！！
-    //  一个线程创建了2个NVMEDevice对象：d1, d2。它调用d1->aio_submit(), d2->aio_submit()
-    //  这里还是只会创建1个SharedDriverQueueData对象，在第一次运行到这里的时候!
-    //  这就比较诡异了：
-    //    假如d1和d2的driver不同，分别是/dev/nvme0n1和/dev/nvme1n1，
-    //    那么，这里的行为就不符合预期：数据只会写到1个nvme设备！
-    //  所以NVMEManager::register_ctrlr()函数中assert(shared_driver_datas.empty())，它保证
-    //  d1和d2底层的nvme设备是同一个！
-    //
-    //Yuanguo:
-    //  我注释掉NVMEManager::register_ctrlr()中的assert，使用2个nvme设备验证上面的逻辑，结果
-    //  符合上面的分析！
+    if (blk_options.spdk_shared_qpair) {
+      // the poller thread issues and reaps; a sync IO waits to be woken by
+      // io_complete, an aio one returns right away
+      SharedQueuePoller *poller = driver->get_poller();
+      if (!poller) {
+        ioc->num_running -= pending;
+        ioc_fail_tasks(this, ioc, t, -ENOMEM);
+        return;
+      }
+      poller->submit(ioc, t);
+      if (!ioc->priv) {
+        ioc->aio_wait();
+      }
+      // callbacks run on the poller, the IOContexts they give back are
+      // freed here by the submitters
+      reap_ioc(false);
+      return;
+    }
 
-    thread_local SharedDriverQueueData queue_t = SharedDriverQueueData(this, driver);
+    // Queue contexts are leased per submit rather than kept per thread, so
+    // that short-lived submitter threads reuse qpairs instead of each
+    // allocating (and on exit tearing down) its own.
+    bool remote = false;
+    int node = driver->place_thread(&remote);
+    if (remote && blk_options.spdk_numa_policy == numa_policy_t::refuse) {
+      std::cerr << __func__ << " refuse cross numa node IO, ioc " << ioc << std::endl;
+      ioc->num_running -= pending;
+      ioc_fail_tasks(this, ioc, t, -EXDEV);
+      return;
+    }
 
+    SharedDriverQueueData *queue = driver->get_queue(node);
+    if (!queue) {
+      ioc->num_running -= pending;
+      ioc_fail_tasks(this, ioc, t, -ENOMEM);
+      return;
+    }
     //Yuanguo:
     //  _aio_handle()里循环poll (spdk_nvme_qpair_process_completions)，直到ioc->num_running==0成立
     //  所以，这里就等价于阻塞！
-    queue_t._aio_handle(t, ioc);
+    queue->_aio_handle(t, ioc);
+    driver->put_queue(queue);
   }
+
+  // the IO is done (or handed over); free what the callbacks queued
+  reap_ioc(false);
 }
 
 static void ioc_append_task(IOContext *ioc, Task *t)
@@ -167,6 +358,31 @@ static void ioc_append_task(IOContext *ioc, Task *t)
   ++ioc->num_pending;
 }
 
+bool NVMEDevice::use_fast_path(uint64_t aligned_len) const
+{
+  return blk_options.spdk_fast_path && !blk_options.spdk_shared_qpair &&
+    aligned_len <= data_buffer_size;
+}
+
+int NVMEDevice::fast_io(IOCommand cmd, uint64_t off, uint64_t len, char *buf, uint64_t skip, uint64_t copy_len,
+  uint8_t prio)
+{
+  bool remote = false;
+  int node = driver->place_thread(&remote);
+  if (remote && blk_options.spdk_numa_policy == numa_policy_t::refuse) {
+    std::cerr << __func__ << " refuse cross numa node IO" << std::endl;
+    return -EXDEV;
+  }
+
+  SharedDriverQueueData *queue = driver->get_queue(node);
+  if (!queue) {
+    return -ENOMEM;
+  }
+  int r = queue->fast_io(cmd, off, len, buf, skip, copy_len, prio);
+  driver->put_queue(queue);
+  return r;
+}
+
 static void write_split(
     NVMEDevice *dev,
     uint64_t off,
@@ -178,10 +394,12 @@ static void write_split(
   Task *t;
   // This value may need to be got from configuration later.
   uint64_t split_size = 131072; // 128KB.
+  uint64_t call = next_call++;
 
   while (remain_len > 0) {
     write_size = std::min(remain_len, split_size);
     t = new Task(dev, IOCommand::WRITE_COMMAND, off + begin, write_size);
+    t->call = call;
 
     // TODO: if upper layer alloc memory with known physical address,
     // we can reduce this copy
@@ -223,6 +441,7 @@ static void make_read_tasks(
   //       |----------------------------------------- aligned_len --------------------------------|
   //    aligned_off                                                                             aligned_end
 
+  uint64_t call = next_call++;
   uint64_t tmp_off = orig_off - aligned_off, remain_orig_len = orig_len;
   auto begin = aligned_off;
   const auto aligned_end = begin + aligned_len;
@@ -250,6 +469,7 @@ static void make_read_tasks(
     }
 
     t->ctx = ioc;
+    t->call = call;
 
     // TODO: if upper layer alloc memory with known physical address,
     // we can reduce this copy
@@ -258,6 +478,9 @@ static void make_read_tasks(
     t->fill_cb = [buf, t, tmp_off, tmp_len]  {
       t->copy_to_buf(buf, tmp_off, tmp_len);
     };
+    // the device may read straight into buf if it covers the whole task,
+    // see SharedDriverQueueData::alloc_buf_from_pool()
+    t->buf = (tmp_off == 0 && tmp_len == read_size) ? buf : nullptr;
 
     ioc_append_task(ioc, t);
     remain_orig_len -= tmp_len;
@@ -278,6 +501,11 @@ int NVMEDevice::read(
   //Yuanguo: off和len必须是block_size对齐的;
   assert(is_valid_io(off, len));
 
+  if (use_fast_path(len)) {
+    return fast_io(IOCommand::READ_COMMAND, off, len, buf, 0, len,
+      ioc ? ioc->prio : IOContext::PRIO_MEDIUM);
+  }
+
   Task t(this, IOCommand::READ_COMMAND, off, len, 1);
 
   // Yuanguo: 直接使用user的buf；buf需要page对齐吗? 从make_read_tasks看不需要，因为t->copy_to_buf(buf, ...)不需要buf是page对齐的；
@@ -286,6 +514,9 @@ int NVMEDevice::read(
 
   // for sync read, need to control IOContext in itself
   IOContext read_ioc(nullptr);
+  if (ioc) {
+    read_ioc.prio = ioc->prio;
+  }
   make_read_tasks(this, off, &read_ioc, buf, len, &t, off, len);
 
   std::cout << __func__ << " " << off << "~" << len << std::endl;
@@ -294,6 +525,9 @@ int NVMEDevice::read(
   // Yuanguo: 直接使用user的buf；
   // pbl->push_back(std::move(p));
 
+  if (int r = read_ioc.get_return_value(); r < 0) {
+    return r;
+  }
   return t.return_code;
 }
 
@@ -312,12 +546,19 @@ int NVMEDevice::read_random(
 
   std::cout << __func__ << " " << off << "~" << len << " aligned " << aligned_off << "~" << aligned_len << std::endl;
 
+  if (use_fast_path(aligned_len)) {
+    return fast_io(IOCommand::READ_COMMAND, aligned_off, aligned_len, buf, off - aligned_off, len);
+  }
+
   IOContext ioc(nullptr);
   Task t(this, IOCommand::READ_COMMAND, aligned_off, aligned_len, 1);
 
   make_read_tasks(this, aligned_off, &ioc, buf, aligned_len, &t, off, len);
   aio_submit(&ioc);
 
+  if (int r = ioc.get_return_value(); r < 0) {
+    return r;
+  }
   return t.return_code;
 }
 
@@ -357,6 +598,10 @@ int NVMEDevice::write(
   //Yuanguo: off和len必须是block_size对齐的;
   assert(is_valid_io(off, len));
 
+  if (use_fast_path(len)) {
+    return fast_io(IOCommand::WRITE_COMMAND, off, len, buf, 0, len);
+  }
+
   IOContext ioc(NULL);
   write_split(this, off, len, buf, &ioc);
 
@@ -369,7 +614,7 @@ int NVMEDevice::write(
   //  do we need ioc.aio_wait?
   //ioc.aio_wait();
 
-  return 0;
+  return ioc.get_return_value();
 }
 
 int NVMEDevice::aio_write(
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <map>
+#include <ostream>
+#include <vector>
 
 #include <boost/intrusive/slist.hpp>
 
@@ -30,6 +32,10 @@ struct IORequest {
   uint16_t cur_seg_idx = 0;
   uint16_t nseg;
   uint32_t cur_seg_left = 0;
+  // the command transfers to/from Task::buf itself, which lies in
+  // registered memory; no data buffers are taken from the pool
+  bool direct = false;
+  uint32_t direct_off = 0;
   void *inline_segs[inline_segment_num];
   void **extra_segs = nullptr;
 };
@@ -55,10 +61,35 @@ class NVMEDevice : public BlockDevice {
 
   static bool support(const std::string& path);
 
+  // attach the controllers behind all the given paths at once, so that the
+  // following open() calls find them ready; a node with many drives should
+  // call this before opening them one by one.
+  static int attach_all(const std::vector<std::string>& paths);
+
+  // have nr_queues qpair/buffer sets ready for submitters, so that a burst
+  // of new threads does not pay for their allocation
+  void warm_up(unsigned nr_queues);
+
   void aio_submit(IOContext *ioc) override;
 
+  // spdk_mem_register() of the 2MB pages the range touches, see MemRegistry
+  int register_memory(void *addr, uint64_t len) override;
+  int unregister_memory(void *addr, uint64_t len) override;
+
+  // sync IO of at most one data buffer goes through
+  // SharedDriverQueueData::fast_io() instead of the Task chain
+  bool use_fast_path(uint64_t aligned_len) const;
+  int fast_io(IOCommand cmd, uint64_t off, uint64_t len, char *buf, uint64_t skip, uint64_t copy_len,
+    uint8_t prio = IOContext::PRIO_MEDIUM);
+
+  int get_numa_node(int *node) const override;
+
   int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
 
+  // per qpair latency histograms (submit->complete, complete->callback) of
+  // every thread's queue, split by read/write/flush
+  void dump_latency(std::ostream& out) const;
+
   int read(
     uint64_t off,
     uint64_t len,
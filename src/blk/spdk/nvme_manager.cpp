@@ -1,8 +1,10 @@
 #include <iostream>
 #include <string>
+#include <chrono>
 
 #include <string.h>
 
+#include "blk/blk_options.hpp"
 #include "blk/spdk/task.hpp"
 #include "blk/spdk/nvme_manager.hpp"
 
@@ -31,13 +33,27 @@ static bool probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid, st
       << "traddr=" << trid->traddr
       << std::endl;
 
-    //Yuanguo: can we change this?
-    std::cout << __func__ << " num_io_queues=" << opts->num_io_queues << std::endl;
-    opts->num_io_queues = 96;
-
-    opts->io_queue_size = UINT16_MAX;
-    opts->io_queue_requests = UINT16_MAX;
     opts->keep_alive_timeout_ms = nvme_ctrlr_keep_alive_timeout_in_ms;
+    opts->arb_mechanism = ctx->wrr ? SPDK_NVME_CC_AMS_WRR : SPDK_NVME_CC_AMS_RR;
+
+    if (trid->trtype == SPDK_NVME_TRANSPORT_TCP) {
+      std::cout << __func__ << " num_io_queues=" << opts->num_io_queues << " want " << blk_options.spdk_tcp_num_io_queues << std::endl;
+      opts->num_io_queues = blk_options.spdk_tcp_num_io_queues;
+      opts->io_queue_size = blk_options.spdk_tcp_io_queue_size;
+      // room for the requests spdk splits a large IO into
+      opts->io_queue_requests = blk_options.spdk_tcp_io_queue_size * 2;
+      opts->header_digest = blk_options.spdk_tcp_header_digest;
+      opts->data_digest = blk_options.spdk_tcp_data_digest;
+    } else {
+      std::cout << __func__ << " num_io_queues=" << opts->num_io_queues << " want " << blk_options.spdk_num_io_queues << std::endl;
+      opts->num_io_queues = blk_options.spdk_num_io_queues;
+      opts->io_queue_size = UINT16_MAX;
+      opts->io_queue_requests = UINT16_MAX;
+    }
+
+    if (!blk_options.spdk_hostnqn.empty()) {
+      snprintf(opts->hostnqn, sizeof(opts->hostnqn), "%s", blk_options.spdk_hostnqn.c_str());
+    }
   }
 
   return do_attach;
@@ -47,7 +63,7 @@ static void attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid, s
 {
   std::cout << __func__ << "attach " << trid->traddr << std::endl;
   auto ctx = static_cast<NVMEManager::ProbeContext*>(cb_ctx);
-  ctx->manager->register_ctrlr(ctx->trid, ctrlr, &ctx->driver);
+  ctx->manager->register_ctrlr(ctx->trid, ctrlr, opts->arb_mechanism == SPDK_NVME_CC_AMS_WRR, &ctx->driver);
 }
 
 static int hex2dec(unsigned char c)
@@ -79,108 +95,217 @@ static int find_first_bitset(const std::string& s)
   return 0;
 }
 
-int NVMEManager::try_get(const spdk_nvme_transport_id& trid, SharedDriverData **driver)
+// start the attach of all the controllers at once and drive their init state
+// machines together, so that the controller resets overlap rather than add up.
+static void probe_async(std::list<NVMEManager::ProbeContext*>& ctxs)
 {
-  std::cout << __func__
-      << " traddr=" << trid.traddr
-      << " trtype=" << trid.trtype
-      << std::endl;
+  std::list<std::pair<NVMEManager::ProbeContext*, spdk_nvme_probe_ctx*>> probing;
 
-  std::lock_guard l(lock);
-  for (auto &&it : shared_driver_datas) {
-    if (it->is_equal(trid)) {
-      *driver = it;
-      return 0;
+  for (auto ctx : ctxs) {
+    spdk_nvme_probe_ctx *probe_ctx = spdk_nvme_probe_async(&ctx->trid, ctx, probe_cb, attach_cb, NULL);
+    if (!probe_ctx) {
+      std::cerr << __func__ << " failed to start probing " << ctx->trid.traddr << std::endl;
+      continue;
     }
+    probing.emplace_back(ctx, probe_ctx);
   }
 
-  std::string coremask_arg = "0x1";
+  while (!probing.empty()) {
+    for (auto it = probing.begin(); it != probing.end(); ) {
+      // probe_ctx is freed by spdk once this returns something else than -EAGAIN
+      if (spdk_nvme_probe_poll_async(it->second) == -EAGAIN) {
+        ++it;
+        continue;
+      }
+      if (!it->first->driver) {
+        std::cerr << __func__ << " device probe nvme " << it->first->trid.traddr << " failed" << std::endl;
+      }
+      it = probing.erase(it);
+    }
+  }
+}
+
+int NVMEManager::start_dpdk_thread()
+{
+  std::string coremask_arg = blk_options.spdk_coremask;
   int m_core_arg = find_first_bitset(coremask_arg);
   // at least one core is needed for using spdk
   if (m_core_arg <= 0) {
-    std::cerr << __func__ << " invalid bluestore_spdk_coremask, at least one core is needed" << std::endl;
+    std::cerr << __func__ << " invalid spdk_coremask " << coremask_arg << ", at least one core is needed" << std::endl;
     return -ENOENT;
   }
 
   m_core_arg -= 1;
 
-  uint32_t mem_size_arg = 512;
+  uint32_t mem_size_arg = blk_options.spdk_mem;
 
-  if (!dpdk_thread.joinable()) {
-    dpdk_thread = std::thread(
-      [this, coremask_arg, m_core_arg, mem_size_arg, trid]() {
-        struct spdk_env_opts opts;
-        struct spdk_pci_addr addr;
-        int r;
-
-        bool local_pci_device = false;
-        int rc = spdk_pci_addr_parse(&addr, trid.traddr);
-        if (!rc) {
-          local_pci_device = true;
-          opts.pci_whitelist = &addr;
-          opts.num_pci_addr = 1;
-        }
+  dpdk_thread = std::thread(
+    [this, coremask_arg, m_core_arg, mem_size_arg]() {
+      struct spdk_env_opts opts;
 
-        spdk_env_opts_init(&opts);
-        opts.name = "nvme-device-manager";
-        opts.core_mask = coremask_arg.c_str();
-        opts.master_core = m_core_arg;
-        opts.mem_size = mem_size_arg;
-        spdk_env_init(&opts);
+      spdk_env_opts_init(&opts);
+      opts.name = "nvme-device-manager";
+      opts.core_mask = coremask_arg.c_str();
+      opts.master_core = m_core_arg;
+      opts.mem_size = mem_size_arg;
+      int r = spdk_env_init(&opts);
+      if (r == 0) {
         spdk_unaffinitize_thread();
+      }
+
+      std::unique_lock l(probe_queue_lock);
+      env_init_r = r;
+      env_ready = true;
+      probe_queue_cond.notify_all();
+
+      while (!stopping && env_init_r == 0) {
+        if (!probe_queue.empty()) {
+          // take everything queued so far and attach it in one batch
+          std::list<ProbeContext*> batch;
+          batch.swap(probe_queue);
+          l.unlock();
+          probe_async(batch);
 
-        std::unique_lock l(probe_queue_lock);
-        while (!stopping) {
-          if (!probe_queue.empty()) {
-            ProbeContext* ctxt = probe_queue.front();
-            probe_queue.pop_front();
-            r = spdk_nvme_probe(local_pci_device ? NULL : &trid, ctxt, probe_cb, attach_cb, NULL);
-            if (r < 0) {
-              assert(!ctxt->driver);
-              std::cerr << __func__ << " device probe nvme failed" << std::endl;
+          // the controller refuses to be enabled with an arbitration mechanism
+          // it does not support; attach those again with plain round robin.
+          std::list<ProbeContext*> retry;
+          for (auto p : batch) {
+            if (!p->driver && p->wrr) {
+              std::cout << __func__ << " " << p->trid.traddr << " does not support wrr, fall back to rr" << std::endl;
+              p->wrr = false;
+              retry.push_back(p);
             }
-            ctxt->done = true;
-            probe_queue_cond.notify_all();
-          } else {
-            std::cout << __func__ << " nvme-device-manager thread is going to wait ..." << std::endl;
-            probe_queue_cond.wait(l);
           }
+          if (!retry.empty()) {
+            probe_async(retry);
+          }
+          l.lock();
+          for (auto p : batch) {
+            p->done = true;
+          }
+          probe_queue_cond.notify_all();
+        } else if (fabrics_ctrlrs.empty()) {
+          std::cout << __func__ << " nvme-device-manager thread is going to wait ..." << std::endl;
+          probe_queue_cond.wait(l);
+        } else {
+          // fabrics targets drop a host which stays silent for the keep
+          // alive timeout; spdk sends the keep alives from the admin
+          // completion processing, so it must run well within the timeout.
+          l.unlock();
+          keep_alive();
+          l.lock();
+          probe_queue_cond.wait_for(l, std::chrono::milliseconds(nvme_ctrlr_keep_alive_timeout_in_ms / 4));
         }
+      }
 
-        for (auto p : probe_queue) {
-          p->done = true;
-        }
+      for (auto p : probe_queue) {
+        p->done = true;
+      }
+
+      probe_queue_cond.notify_all();
+    }
+  );
+
+  // wait for the environment instead of guessing how long it takes to come up
+  std::unique_lock l(probe_queue_lock);
+  probe_queue_cond.wait(l, [this] { return env_ready; });
+  if (env_init_r < 0) {
+    std::cerr << __func__ << " failed to initialize spdk environment: " << env_init_r << std::endl;
+  }
+  return env_init_r;
+}
+
+void NVMEManager::keep_alive()
+{
+  for (auto c : fabrics_ctrlrs) {
+    if (spdk_nvme_ctrlr_process_admin_completions(c) < 0) {
+      std::cerr << __func__ << " admin queue of controller " << c << " failed" << std::endl;
+    }
+  }
+}
+
+int NVMEManager::try_get(const spdk_nvme_transport_id& trid, SharedDriverData **driver)
+{
+  std::vector<SharedDriverData*> drivers;
+  int r = try_get_many({trid}, &drivers);
+  if (r < 0) {
+    return r;
+  }
+  *driver = drivers.front();
+  return 0;
+}
+
+int NVMEManager::try_get_many(const std::vector<spdk_nvme_transport_id>& trids, std::vector<SharedDriverData*> *drivers)
+{
+  std::lock_guard l(lock);
+
+  drivers->assign(trids.size(), nullptr);
 
-        probe_queue_cond.notify_all();
+  std::vector<ProbeContext> ctxs;
+  ctxs.reserve(trids.size());
+  for (size_t i = 0; i < trids.size(); ++i) {
+    std::cout << __func__
+      << " traddr=" << trids[i].traddr
+      << " trtype=" << trids[i].trtype
+      << std::endl;
+    for (auto &&it : shared_driver_datas) {
+      if (it->is_equal(trids[i])) {
+        (*drivers)[i] = it;
+        break;
       }
-    );
+    }
+    if (!(*drivers)[i]) {
+      ctxs.push_back(ProbeContext{trids[i], this, nullptr, false, blk_options.spdk_wrr});
+    }
   }
 
-  {
-      struct timespec ts;
-      ts.tv_sec  = 1;
-      ts.tv_nsec = 0;
-      ::nanosleep(&ts, nullptr);
+  if (ctxs.empty()) {
+    return 0;
+  }
+
+  if (!dpdk_thread.joinable()) {
+    if (int r = start_dpdk_thread(); r < 0) {
+      return r;
+    }
   }
 
-  ProbeContext ctx{trid, this, nullptr, false};
   {
     std::unique_lock l(probe_queue_lock);
-    probe_queue.push_back(&ctx);
+    if (env_init_r < 0) {
+      return env_init_r;
+    }
+
+    for (auto &ctx : ctxs) {
+      probe_queue.push_back(&ctx);
+    }
 
     //Yuanguo: bugfix, we need to notify nvme-device-manager thread
     probe_queue_cond.notify_all();
 
-    while (!ctx.done) {
-      std::cout << __func__ << " get-driver thread is going to wait ..." << std::endl;
-      probe_queue_cond.wait(l);
-    }
+    std::cout << __func__ << " get-driver thread is going to wait ..." << std::endl;
+    probe_queue_cond.wait(l, [&ctxs] {
+      for (auto &ctx : ctxs) {
+        if (!ctx.done) {
+          return false;
+        }
+      }
+      return true;
+    });
   }
 
-  if (!ctx.driver) {
-    return -1;
+  int r = 0;
+  auto ctx = ctxs.begin();
+  for (auto &d : *drivers) {
+    if (d) {
+      continue;
+    }
+    if (!ctx->driver) {
+      std::cerr << __func__ << " failed to attach " << ctx->trid.traddr << std::endl;
+      r = -1;
+    }
+    d = ctx->driver;
+    ++ctx;
   }
 
-  *driver = ctx.driver;
-  return 0;
+  return r;
 }
@@ -20,6 +20,8 @@ public:
     NVMEManager *manager;
     SharedDriverData *driver;
     bool done;
+    // attach with weighted round robin arbitration
+    bool wrr;
   };
 
 private:
@@ -30,6 +32,16 @@ private:
   stupid::common::mutex probe_queue_lock = stupid::common::make_mutex("NVMEManager::probe_queue_lock");
   stupid::common::condition_variable probe_queue_cond;
   std::list<ProbeContext*> probe_queue;
+  // set by dpdk_thread once spdk_env_init() returned, protected by probe_queue_lock
+  bool env_ready = false;
+  int env_init_r = 0;
+
+  // controllers attached over fabrics, whose admin queue the dpdk thread
+  // polls for keep alive; only touched by the dpdk thread
+  std::vector<spdk_nvme_ctrlr*> fabrics_ctrlrs;
+
+  int start_dpdk_thread();
+  void keep_alive();
 
 public:
   NVMEManager() {}
@@ -47,7 +59,11 @@ public:
 
   int try_get(const spdk_nvme_transport_id& trid, SharedDriverData **driver);
 
-  void register_ctrlr(const spdk_nvme_transport_id& trid, spdk_nvme_ctrlr *c, SharedDriverData **driver) {
+  // attach all the controllers in one go; their initialization (controller
+  // reset, enable, identify) runs in parallel instead of one after another.
+  int try_get_many(const std::vector<spdk_nvme_transport_id>& trids, std::vector<SharedDriverData*> *drivers);
+
+  void register_ctrlr(const spdk_nvme_transport_id& trid, spdk_nvme_ctrlr *c, bool wrr, SharedDriverData **driver) {
     assert(mutex_is_locked(lock));
     spdk_nvme_ns *ns;
     int num_ns = spdk_nvme_ctrlr_get_num_ns(c);
@@ -63,13 +79,12 @@ public:
 
     std::cout << __func__ << " successfully attach nvme device at" << trid.traddr << std::endl;
 
-    // only support one device per osd now!
-    // Yuanguo: 为什么只支持一个device呢？
-    // 看NVMEDevice::aio_submit()中关于thread_local的注释，非常重要！！！
-    assert(shared_driver_datas.empty());
+    if (trid.trtype != SPDK_NVME_TRANSPORT_PCIE) {
+      fabrics_ctrlrs.push_back(c);
+    }
 
     // index 0 is occurred by master thread
-    shared_driver_datas.push_back(new SharedDriverData(shared_driver_datas.size()+1, trid, c, ns));
+    shared_driver_datas.push_back(new SharedDriverData(shared_driver_datas.size()+1, trid, c, ns, wrr));
     *driver = shared_driver_datas.back();
   }
 };
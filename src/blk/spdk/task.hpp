@@ -2,8 +2,10 @@
 #define STUPID__BLK_SPDK_TASK_HPP
 
 #include <assert.h>
+#include <sys/uio.h>
 
 #include <functional>
+#include <vector>
 
 #include "blk/spdk/nvme_device.hpp"
 #include "blk/spdk/driver_queue.hpp"
@@ -23,7 +25,17 @@ struct Task {
   //    通过data_buf_reset_sgl()/data_buf_next_sge()从io_request获取数据；
   //  读操作：貌似没有用；
   //bufferlist bl;
-  char* buf;
+  // For reads it is the destination when the task maps onto it one to one,
+  // nullptr otherwise. If it lies in registered memory the command uses it
+  // directly instead of the data buffers (IORequest::direct).
+  char* buf = nullptr;
+  // Set when aio_submit() merged LBA-contiguous tasks into this one: the
+  // user memory of the merged range, in LBA order. A single piece means the
+  // memory is contiguous too, and buf still covers the whole task.
+  std::vector<iovec> pieces;
+  // the read/write call which created the task; a call is split into
+  // tasks on purpose, only tasks of different calls are merged
+  uint64_t call = 0;
 
   std::function<void()> fill_cb;
   Task *next = nullptr;
@@ -31,8 +43,12 @@ struct Task {
   Task *primary = nullptr;
   IORequest io_request = {};
   SharedDriverQueueData *queue = nullptr;
+  QueuePair *qpair = nullptr;
   // reference count by subtasks.
   int ref = 0;
+  // mono_ns() when issued to the qpair and when its completion was reaped
+  uint64_t submit_stamp = 0;
+  uint64_t complete_stamp = 0;
 
   Task(NVMEDevice *dev, IOCommand c, uint64_t off, uint64_t l, int64_t rc = 0, Task *p = nullptr)
     : device(dev), command(c), offset(off), len(l),
@@ -68,11 +84,13 @@ struct Task {
     io_request.nseg = 0;
   }
 
+  // copy [off, off + len) of the data read into buf
   void copy_to_buf(char *buf, uint64_t off, uint64_t len) {
     uint64_t copied = 0;
     uint64_t left = len;
     void **segs = io_request.extra_segs ? io_request.extra_segs : io_request.inline_segs;
-    uint16_t i = 0;
+    uint16_t i = off / data_buffer_size;
+    off %= data_buffer_size;
     while (left > 0) {
       char *src = static_cast<char*>(segs[i++]);
       uint64_t need_copy = std::min(left, data_buffer_size-off);
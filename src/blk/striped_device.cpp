@@ -0,0 +1,147 @@
+#include <assert.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "common/bit_op.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/striped_device.hpp"
+
+int StripedBlockDevice::open(const std::string& path)
+{
+  std::string paths = path;
+  if (paths.compare(0, sizeof(STRIPE_PREFIX) - 1, STRIPE_PREFIX) == 0) {
+    paths = paths.substr(sizeof(STRIPE_PREFIX) - 1);
+  }
+  if (int r = open_members(paths); r < 0) {
+    return r;
+  }
+
+  uint64_t member_size = UINT64_MAX;
+  block_size = 0;
+  rotational = false;
+  for (auto &m : members) {
+    member_size = std::min(member_size, m->get_size());
+    block_size = std::max(block_size, m->get_block_size());
+    rotational |= m->is_rotational();
+  }
+
+  unit = stupid::common::p2roundup<uint64_t>(std::max<uint64_t>(blk_options.bdev_stripe_unit, block_size), block_size);
+  size = member_size / unit * unit * members.size();
+  optimal_io_size = unit * members.size();
+  name = "stripe";
+
+  std::cout << __func__ << " " << members.size() << " members, stripe unit " << unit
+    << " size " << size << " block_size " << block_size << std::endl;
+  return 0;
+}
+
+void StripedBlockDevice::close()
+{
+  close_members();
+}
+
+int StripedBlockDevice::for_each_piece(uint64_t off, uint64_t len,
+  const std::function<int(unsigned, uint64_t, uint64_t, uint64_t)>& f) const
+{
+  const uint64_t n = members.size();
+  uint64_t done = 0;
+  while (done < len) {
+    uint64_t pos = off + done;
+    uint64_t stripe = pos / unit;
+    uint64_t in_unit = pos % unit;
+    uint64_t l = std::min(len - done, unit - in_unit);
+    if (int r = f(stripe % n, (stripe / n) * unit + in_unit, done, l); r < 0) {
+      return r;
+    }
+    done += l;
+  }
+  return 0;
+}
+
+int StripedBlockDevice::single_member(uint64_t off, uint64_t len, uint64_t *moff) const
+{
+  if (off / unit != (off + len - 1) / unit) {
+    return -1;
+  }
+  uint64_t stripe = off / unit;
+  *moff = (stripe / members.size()) * unit + off % unit;
+  return stripe % members.size();
+}
+
+int StripedBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << std::endl;
+  assert(is_valid_io(off, len));
+
+  return for_each_piece(off, len, [&](unsigned m, uint64_t moff, uint64_t boff, uint64_t l) {
+    return queued(ioc, m, members[m]->aio_read(moff, l, buf + boff, child_ioc(ioc, m)));
+  });
+}
+
+int StripedBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  return for_each_piece(off, len, [&](unsigned m, uint64_t moff, uint64_t boff, uint64_t l) {
+    return queued(ioc, m, members[m]->aio_write(moff, l, buf + boff, child_ioc(ioc, m), buffered, write_hint));
+  });
+}
+
+int StripedBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << std::endl;
+  assert(is_valid_io(off, len));
+
+  uint64_t moff;
+  if (int m = single_member(off, len, &moff); m >= 0) {
+    return members[m]->read(moff, len, buf, ioc, buffered);
+  }
+  // fan out, the members read their pieces in parallel
+  return sync_io(ioc, [&](IOContext *sync) {
+    return aio_read(off, len, buf, sync);
+  });
+}
+
+int StripedBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  std::cout << __func__ << " " << off << "~" << len << std::endl;
+  assert(len > 0);
+  assert(off + len <= size);
+
+  // unaligned, piece by piece
+  return for_each_piece(off, len, [&](unsigned m, uint64_t moff, uint64_t boff, uint64_t l) {
+    return members[m]->read_random(moff, l, buf + boff, buffered);
+  });
+}
+
+int StripedBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  std::cout << __func__ << " " << off << "~" << len << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  uint64_t moff;
+  if (int m = single_member(off, len, &moff); m >= 0) {
+    return members[m]->write(moff, len, buf, buffered, write_hint);
+  }
+  return sync_io(nullptr, [&](IOContext *sync) {
+    return aio_write(off, len, buf, sync, buffered, write_hint);
+  });
+}
+
+int StripedBlockDevice::invalidate_cache(uint64_t off, uint64_t len)
+{
+  return for_each_piece(off, len, [&](unsigned m, uint64_t moff, uint64_t boff, uint64_t l) {
+    return members[m]->invalidate_cache(moff, l);
+  });
+}
+
+int StripedBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  CompositeBlockDevice::collect_metadata(prefix, pm);
+  (*pm)[prefix + "driver"] = "StripedBlockDevice";
+  (*pm)[prefix + "stripe_unit"] = std::to_string(unit);
+  return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef STUPID__BLK_STRIPED_DEVICE_HPP
+#define STUPID__BLK_STRIPED_DEVICE_HPP
+
+#include <functional>
+
+#include "blk/composite_device.hpp"
+
+// RAID-0 over the member devices: the address space is cut into stripe units
+// of blk_options.bdev_stripe_unit bytes, dealt round robin to the members.
+// Opened on "stripe:<path>,<path>,..." (or with the type name "stripe" and
+// the paths alone), each member path being detected like a device of its
+// own. The size is the smallest member's times the number of members.
+class StripedBlockDevice : public CompositeBlockDevice {
+  uint64_t unit = 0;
+
+  // call f(member, member offset, offset into the IO, length) for each
+  // stripe unit piece of [off, off + len)
+  int for_each_piece(uint64_t off, uint64_t len,
+    const std::function<int(unsigned, uint64_t, uint64_t, uint64_t)>& f) const;
+  // the member holding all of [off, off + len), or -1
+  int single_member(uint64_t off, uint64_t len, uint64_t *moff) const;
+
+public:
+  StripedBlockDevice(aio_callback_t cb, void *cbpriv) : CompositeBlockDevice(cb, cbpriv) {}
+
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int invalidate_cache(uint64_t off, uint64_t len) override;
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_STRIPED_DEVICE_HPP
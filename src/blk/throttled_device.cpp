@@ -0,0 +1,224 @@
+#include <assert.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "common/util.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/throttled_device.hpp"
+
+static const char *class_names[IOContext::PRIO_MAX] = {"urgent", "high", "medium", "low"};
+
+int ThrottledBlockDevice::open(const std::string& path)
+{
+  int r = dev->open(path);
+  if (r < 0) {
+    return r;
+  }
+  copy_geometry();
+
+  io_cost = rotational ? blk_options.bdev_qos_io_cost_hdd : blk_options.bdev_qos_io_cost_ssd;
+  uint64_t burst_ns = blk_options.bdev_qos_burst_ms * 1000000ull;
+  uint64_t now = stupid::common::mono_ns();
+  for (int p = 0; p < IOContext::PRIO_MAX; ++p) {
+    classes[p].iops.configure(blk_options.bdev_qos_iops[p], burst_ns, now);
+    classes[p].bw.configure(blk_options.bdev_qos_bps[p], burst_ns, now);
+    std::cout << __func__ << " class " << class_names[p]
+      << " iops " << blk_options.bdev_qos_iops[p]
+      << " bps " << blk_options.bdev_qos_bps[p] << std::endl;
+  }
+
+  stop = false;
+  throttle_thread.create("blk_throttle");
+  return 0;
+}
+
+void ThrottledBlockDevice::close()
+{
+  {
+    std::lock_guard l(lock);
+    stop = true;
+  }
+  cond.notify_all();
+  throttle_thread.join();
+  dev->close();
+}
+
+void ThrottledBlockDevice::release(IOContext *ioc)
+{
+  dev->aio_submit(ioc);
+  // see KernelDevice::_aio_thread for the waker logic
+  if (ioc->priv) {
+    if (--ioc->num_running == 0) {
+      // the IOs completed already, the inner device left the callback to us
+      std::vector<IOContext*> done = {ioc};
+      aio_complete_batch(done);
+    }
+  } else {
+    ioc->try_aio_wake();
+  }
+}
+
+void ThrottledBlockDevice::aio_submit(IOContext *ioc)
+{
+  uint64_t ios = ioc->qos_ios, bytes = ioc->qos_bytes;
+  ioc->qos_ios = 0;
+  ioc->qos_bytes = 0;
+  if (ios == 0) {
+    dev->aio_submit(ioc);
+    return;
+  }
+
+  class_t &c = class_of(ioc->prio);
+  uint64_t cost = bytes + ios * io_cost;
+  c.ios += ios;
+  c.bytes += bytes;
+  {
+    std::lock_guard l(lock);
+    if (c.queue.empty() && wait_ns(c, stupid::common::mono_ns()) == 0) {
+      admit(c, ios, cost);
+    } else {
+      // held running until it is submitted
+      ++ioc->num_running;
+      ++c.throttled;
+      c.queue.push_back(pending_t{ioc, nullptr, ios, cost, stupid::common::mono_ns()});
+      if (c.queue.size() == 1) {
+        cond.notify_one();
+      }
+      return;
+    }
+  }
+  dev->aio_submit(ioc);
+}
+
+void ThrottledBlockDevice::throttle_sync(int prio, uint64_t len)
+{
+  class_t &c = class_of(prio);
+  uint64_t cost = len + io_cost;
+  ++c.ios;
+  c.bytes += len;
+
+  std::unique_lock l(lock);
+  if (c.queue.empty() && wait_ns(c, stupid::common::mono_ns()) == 0) {
+    admit(c, 1, cost);
+    return;
+  }
+  bool granted = false;
+  ++c.throttled;
+  c.queue.push_back(pending_t{nullptr, &granted, 1, cost, stupid::common::mono_ns()});
+  if (c.queue.size() == 1) {
+    cond.notify_one();
+  }
+  while (!granted) {
+    sync_cond.wait(l);
+  }
+}
+
+void ThrottledBlockDevice::_throttle_thread()
+{
+  std::cout << __func__ << " start" << std::endl;
+
+  std::vector<IOContext*> ready;
+  std::unique_lock l(lock);
+  while (true) {
+    uint64_t now = stupid::common::mono_ns();
+    uint64_t next = UINT64_MAX;
+    bool wake_sync = false;
+    for (auto &c : classes) {
+      while (!c.queue.empty()) {
+        uint64_t w = stop ? 0 : wait_ns(c, now);
+        if (w > 0) {
+          next = std::min(next, w);
+          break;
+        }
+        pending_t &p = c.queue.front();
+        admit(c, p.ios, p.cost);
+        c.delay_ns += now - p.stamp;
+        if (p.ioc) {
+          ready.push_back(p.ioc);
+        } else {
+          *p.granted = true;
+          wake_sync = true;
+        }
+        c.queue.pop_front();
+      }
+    }
+    if (wake_sync) {
+      sync_cond.notify_all();
+    }
+
+    if (!ready.empty()) {
+      l.unlock();
+      for (IOContext *ioc : ready) {
+        release(ioc);
+      }
+      ready.clear();
+      l.lock();
+      continue;
+    }
+    if (stop) {
+      break;
+    }
+    if (next == UINT64_MAX) {
+      cond.wait(l);
+    } else {
+      cond.wait_for(l, std::chrono::nanoseconds(next));
+    }
+  }
+
+  std::cout << __func__ << " end" << std::endl;
+}
+
+int ThrottledBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  throttle_sync(ioc ? ioc->prio : IOContext::PRIO_MEDIUM, len);
+  return dev->read(off, len, buf, ioc, buffered);
+}
+
+int ThrottledBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  throttle_sync(IOContext::PRIO_MEDIUM, len);
+  return dev->read_random(off, len, buf, buffered);
+}
+
+int ThrottledBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  int r = dev->aio_read(off, len, buf, ioc);
+  if (r >= 0) {
+    ++ioc->qos_ios;
+    ioc->qos_bytes += len;
+  }
+  return r;
+}
+
+int ThrottledBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  throttle_sync(IOContext::PRIO_MEDIUM, len);
+  return dev->write(off, len, buf, buffered, write_hint);
+}
+
+int ThrottledBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  int r = dev->aio_write(off, len, buf, ioc, buffered, write_hint);
+  if (r >= 0) {
+    ++ioc->qos_ios;
+    ioc->qos_bytes += len;
+  }
+  return r;
+}
+
+int ThrottledBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  int r = dev->collect_metadata(prefix, pm);
+  (*pm)[prefix + "qos_io_cost"] = std::to_string(io_cost);
+  for (int p = 0; p < IOContext::PRIO_MAX; ++p) {
+    const class_t &c = classes[p];
+    std::string q = prefix + "qos_" + class_names[p] + "_";
+    (*pm)[q + "ios"] = std::to_string(c.ios.load());
+    (*pm)[q + "bytes"] = std::to_string(c.bytes.load());
+    (*pm)[q + "throttled"] = std::to_string(c.throttled.load());
+    (*pm)[q + "delay_us"] = std::to_string(c.delay_ns.load() / 1000);
+  }
+  return r;
+}
@@ -0,0 +1,118 @@
+#ifndef STUPID__BLK_THROTTLED_DEVICE_HPP
+#define STUPID__BLK_THROTTLED_DEVICE_HPP
+
+#include <atomic>
+#include <deque>
+
+#include "common/mutex.hpp"
+#include "common/thread.hpp"
+#include "common/token_bucket.hpp"
+
+#include "blk/device_decorator.hpp"
+
+// Decorator limiting the IO rate of every IOContext priority class (client
+// IO in the higher classes, recovery and backfill in PRIO_LOW) with two
+// token buckets each: IOPS, and bandwidth where an IO costs its bytes plus a
+// fixed bdev_qos_io_cost_{hdd,ssd}, the cost model of IOContext::get_num_ios.
+//
+// An aio_submit() which the buckets of its class do not admit is queued and
+// submitted by the throttle thread once they do, in FIFO order within the
+// class; the IOContext is kept running meanwhile, so that aio_wait() and the
+// completion callback wait for it. Sync IOs wait in the same queue. Created
+// by BlockDevice::create() when blk_options.bdev_qos is set.
+class ThrottledBlockDevice : public BlockDeviceDecorator {
+  struct pending_t {
+    IOContext *ioc;          // nullptr for a sync IO
+    bool *granted;           // for a sync IO
+    uint64_t ios;
+    uint64_t cost;
+    uint64_t stamp;
+  };
+
+  struct class_t {
+    stupid::common::TokenBucket iops, bw;
+    std::deque<pending_t> queue;
+    std::atomic<uint64_t> ios = {0}, bytes = {0};
+    std::atomic<uint64_t> throttled = {0}, delay_ns = {0};
+  };
+
+  stupid::common::mutex lock = stupid::common::make_mutex("ThrottledBlockDevice::lock");
+  stupid::common::condition_variable cond;       // for the throttle thread
+  stupid::common::condition_variable sync_cond;  // for the sync IOs queued
+  class_t classes[IOContext::PRIO_MAX];
+  uint64_t io_cost = 0;
+  bool stop = false;
+
+  struct ThrottleThread : public stupid::common::Thread {
+    ThrottledBlockDevice *bdev;
+    explicit ThrottleThread(ThrottledBlockDevice *b) : bdev(b) {}
+    void *entry() override {
+      bdev->_throttle_thread();
+      return nullptr;
+    }
+  } throttle_thread;
+
+  void _throttle_thread();
+
+  class_t &class_of(int prio) {
+    return classes[std::min<int>(prio, IOContext::PRIO_MAX - 1)];
+  }
+  // how long until the head of c's queue may go; 0 if it may now
+  uint64_t wait_ns(class_t &c, uint64_t now) {
+    return std::max(c.iops.wait_ns(now), c.bw.wait_ns(now));
+  }
+  void admit(class_t &c, uint64_t ios, uint64_t cost) {
+    c.iops.take(ios);
+    c.bw.take(cost);
+  }
+  // submit an IOContext which was queued, and drop the hold on it
+  void release(IOContext *ioc);
+  // wait until the buckets of the class admit a sync IO
+  void throttle_sync(int prio, uint64_t len);
+
+public:
+  ThrottledBlockDevice(BlockDevice *dev, aio_callback_t cb, void *cbpriv)
+    : BlockDeviceDecorator(dev, cb, cbpriv), throttle_thread(this) {}
+
+  void aio_submit(IOContext *ioc) override;
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_THROTTLED_DEVICE_HPP
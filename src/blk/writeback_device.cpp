@@ -0,0 +1,928 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "common/bit_op.hpp"
+#include "common/crc32c.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/writeback_device.hpp"
+
+#define WB_SUPER_MAGIC  0x3152505553425755ull    // "UWBSUPR1"
+#define WB_RECORD_MAGIC 0x3143455242575557ull    // "WUWBREC1"
+
+struct wb_super_t {
+  uint64_t magic;
+  uint64_t block_size;
+  uint64_t log_size;
+  uint64_t tail;
+  uint64_t tail_seq;
+};
+
+struct wb_record_t {
+  uint64_t magic;
+  uint64_t seq;
+  uint64_t lsn;         // of this header
+  uint64_t off;
+  uint64_t len;
+  // a tombstone, without data: the log data of [off, off + trim_len) older
+  // than trim_before is stale, a bypassing write went to the slow device
+  uint64_t trim_len;
+  uint64_t trim_before;
+  uint32_t crc;         // of the header with crc 0, and the data
+};
+
+static uint32_t record_crc(char *rec, uint64_t rec_len)
+{
+  wb_record_t *h = reinterpret_cast<wb_record_t*>(rec);
+  uint32_t saved = h->crc;
+  h->crc = 0;
+  uint32_t crc = stupid::common::crc32c(0, rec, rec_len);
+  h->crc = saved;
+  return crc;
+}
+
+static char *alloc_block_buf(uint64_t len)
+{
+  char *buf = static_cast<char*>(aligned_alloc(4096, stupid::common::p2roundup<uint64_t>(len, 4096)));
+  if (buf) {
+    memset(buf, 0, len);
+  }
+  return buf;
+}
+
+int WriteBackBlockDevice::open(const std::string& path)
+{
+  std::string paths = path;
+  if (paths.compare(0, sizeof(WRITEBACK_PREFIX) - 1, WRITEBACK_PREFIX) == 0) {
+    paths = paths.substr(sizeof(WRITEBACK_PREFIX) - 1);
+  }
+  if (int r = open_members(paths); r < 0) {
+    return r;
+  }
+  if (members.size() != 2) {
+    std::cerr << __func__ << " expect <fast path>,<slow path>, got " << paths << std::endl;
+    close_members();
+    return -EINVAL;
+  }
+
+  block_size = std::max(members[FAST]->get_block_size(), members[SLOW]->get_block_size());
+  size = members[SLOW]->get_size() & ~(block_size - 1);
+  rotational = members[SLOW]->is_rotational();
+  name = "writeback";
+
+  log_start = block_size;
+  uint64_t fast_size = members[FAST]->get_size() & ~(block_size - 1);
+  log_size = fast_size > log_start ? fast_size - log_start : 0;
+  if (log_size < 2 * (blk_options.bdev_wb_max_write + block_size)) {
+    std::cerr << __func__ << " fast device too small for a log: " << fast_size << std::endl;
+    close_members();
+    return -EINVAL;
+  }
+
+  int r = load_superblock();
+  if (r < 0) {
+    close_members();
+    return r;
+  }
+
+  stop = false;
+  destage_thread.create("blk_destage");
+
+  std::cout << __func__ << " size " << size << " block_size " << block_size
+    << " log_size " << log_size << " dirty " << dirty() << " extents " << index.size() << std::endl;
+  return 0;
+}
+
+void WriteBackBlockDevice::close()
+{
+  // the tombstones of the bypassing writes, or the next open replays what
+  // they went over
+  flush();
+  {
+    std::lock_guard l(lock);
+    stop = true;
+  }
+  destage_cond.notify_all();
+  space_cond.notify_all();
+  destage_thread.join();
+
+  // the records held behind a failed one are lost on the next open
+  std::vector<std::function<void(int)>> acks;
+  for (auto &[lsn, ack] : held) {
+    acks.push_back(std::move(ack));
+  }
+  held.clear();
+  failed.clear();
+  replaced.clear();
+  trims.clear();
+  for (auto &ack : acks) {
+    ack(-EIO);
+  }
+
+  // what is left in the log is replayed on the next open
+  close_members();
+  index.clear();
+  records.clear();
+  writing.clear();
+  pins.clear();
+}
+
+int WriteBackBlockDevice::load_superblock()
+{
+  char *buf = alloc_block_buf(block_size);
+  if (!buf) {
+    return -ENOMEM;
+  }
+  int r = members[FAST]->read_random(0, block_size, buf, false);
+  if (r < 0) {
+    std::cerr << __func__ << " failed to read the superblock: " << r << std::endl;
+    free(buf);
+    return r;
+  }
+  wb_super_t sb;
+  memcpy(&sb, buf, sizeof(sb));
+  free(buf);
+
+  head = tail = 0;
+  next_seq = tail_seq = 0;
+  index.clear();
+  records.clear();
+
+  if (sb.magic != WB_SUPER_MAGIC || sb.block_size != block_size || sb.log_size != log_size) {
+    // a new log, or the geometry changed and the old one is meaningless
+    std::cout << __func__ << " formatting the log" << std::endl;
+    return write_superblock(0, 0);
+  }
+  head = tail = sb.tail;
+  next_seq = tail_seq = sb.tail_seq;
+  return replay();
+}
+
+int WriteBackBlockDevice::write_superblock(uint64_t tail, uint64_t tail_seq)
+{
+  char *buf = alloc_block_buf(block_size);
+  if (!buf) {
+    return -ENOMEM;
+  }
+  wb_super_t sb = {WB_SUPER_MAGIC, block_size, log_size, tail, tail_seq};
+  memcpy(buf, &sb, sizeof(sb));
+  int r = members[FAST]->write(0, block_size, buf, false);
+  free(buf);
+  if (r >= 0) {
+    r = members[FAST]->flush();
+  }
+  if (r < 0) {
+    std::cerr << __func__ << " failed: " << r << std::endl;
+  }
+  return r;
+}
+
+int WriteBackBlockDevice::replay()
+{
+  char *buf = alloc_block_buf(block_size);
+  if (!buf) {
+    return -ENOMEM;
+  }
+
+  uint64_t lsn = tail, seq = tail_seq;
+  while (lsn - tail < log_size) {
+    int r = members[FAST]->read_random(phys(lsn), block_size, buf, false);
+    if (r < 0) {
+      std::cerr << __func__ << " failed to read at lsn " << lsn << ": " << r << std::endl;
+      free(buf);
+      return r;
+    }
+    wb_record_t h;
+    memcpy(&h, buf, sizeof(h));
+    bool valid = h.magic == WB_RECORD_MAGIC && h.seq == seq && h.lsn == lsn &&
+      lsn % log_size + block_size + h.len <= log_size;
+    if (valid) {
+      // the record is written as one IO, the end may not have made it
+      char *rec = alloc_block_buf(block_size + h.len);
+      if (!rec) {
+        free(buf);
+        return -ENOMEM;
+      }
+      r = members[FAST]->read_random(phys(lsn), block_size + h.len, rec, false);
+      if (r < 0) {
+        std::cerr << __func__ << " failed to read the record at lsn " << lsn << ": " << r << std::endl;
+        free(rec);
+        free(buf);
+        return r;
+      }
+      valid = record_crc(rec, block_size + h.len) == h.crc;
+      free(rec);
+      if (!valid) {
+        std::cout << __func__ << " torn record at lsn " << lsn << std::endl;
+        break;
+      }
+    }
+    if (!valid) {
+      uint64_t lap = (lsn / log_size + 1) * log_size;
+      if (lsn % log_size != 0 && lap - tail < log_size) {
+        // the record may have started the next lap
+        lsn = lap;
+        continue;
+      }
+      break;
+    }
+    uint64_t end = lsn + block_size + h.len;
+    if (h.trim_len) {
+      index_trim(h.off, h.trim_len, h.trim_before);
+    } else {
+      index_insert(h.off, h.len, lsn + block_size);
+    }
+    records.emplace_back(lsn, end);
+    lsn = end;
+    ++seq;
+  }
+  free(buf);
+
+  head = records.empty() ? tail : records.back().second;
+  next_seq = seq;
+  std::cout << __func__ << " " << records.size() << " records, " << dirty() << " bytes" << std::endl;
+  return 0;
+}
+
+void WriteBackBlockDevice::index_remove(uint64_t off, uint64_t len)
+{
+  const uint64_t end = off + len;
+  auto it = index.upper_bound(off);
+  if (it != index.begin()) {
+    auto p = std::prev(it);
+    if (p->first + p->second.len > off) {
+      it = p;
+    }
+  }
+  while (it != index.end() && it->first < end) {
+    uint64_t s = it->first, e = s + it->second.len, lsn = it->second.lsn;
+    it = index.erase(it);
+    // keep the parts outside [off, end)
+    if (s < off) {
+      index[s] = extent_t{off - s, lsn};
+    }
+    if (e > end) {
+      index[end] = extent_t{e - end, lsn + (end - s)};
+      break;
+    }
+  }
+}
+
+void WriteBackBlockDevice::index_insert(uint64_t off, uint64_t len, uint64_t lsn)
+{
+  index_remove(off, len);
+  index[off] = extent_t{len, lsn};
+}
+
+void WriteBackBlockDevice::index_trim(uint64_t off, uint64_t len, uint64_t before)
+{
+  std::vector<piece_t> stale;
+  index_map(off, len, [&](uint64_t o, uint64_t n, uint64_t lsn) {
+    if (lsn && lsn < before) {
+      stale.push_back(piece_t{o, n, lsn});
+    }
+  });
+  for (auto &p : stale) {
+    index_remove(p.off, p.len);
+  }
+}
+
+void WriteBackBlockDevice::intersect(const piece_t &p, uint64_t off, uint64_t len, std::vector<piece_t>& out)
+{
+  uint64_t s = std::max(p.off, off), e = std::min(p.off + p.len, off + len);
+  if (s < e) {
+    out.push_back(piece_t{s, e - s, p.lsn + (s - p.off)});
+  }
+}
+
+void WriteBackBlockDevice::index_map(uint64_t off, uint64_t len,
+  const std::function<void(uint64_t, uint64_t, uint64_t)>& f) const
+{
+  const uint64_t end = off + len;
+  auto it = index.upper_bound(off);
+  if (it != index.begin()) {
+    auto p = std::prev(it);
+    if (p->first + p->second.len > off) {
+      it = p;
+    }
+  }
+  uint64_t pos = off;
+  while (pos < end) {
+    if (it != index.end() && it->first <= pos) {
+      uint64_t l = std::min(end, it->first + it->second.len) - pos;
+      f(pos, l, it->second.lsn + (pos - it->first));
+      pos += l;
+      ++it;
+    } else {
+      uint64_t next = it == index.end() ? end : std::min(end, it->first);
+      f(pos, next - pos, 0);
+      pos = next;
+    }
+  }
+}
+
+void WriteBackBlockDevice::unpin(uint64_t lsn)
+{
+  std::lock_guard l(lock);
+  pins.erase(pins.find(lsn));
+  if (pins.empty() || *pins.begin() > lsn) {
+    space_cond.notify_all();
+  }
+}
+
+int WriteBackBlockDevice::log_reserve(std::unique_lock<stupid::common::mutex>& l, uint64_t off, uint64_t len,
+  const char *buf, const trim_t *trim, uint64_t *rec_lsn, char **rec)
+{
+  if (!buf) {
+    // a tombstone has no data
+    off = trim->off;
+    len = 0;
+  }
+  const uint64_t rec_len = block_size + len;
+  uint64_t skip;
+  while (true) {
+    if (stop) {
+      return -ESHUTDOWN;
+    }
+    uint64_t pos = head % log_size;
+    skip = pos + rec_len > log_size ? log_size - pos : 0;
+    // the log space is only reused once the reads of it are done
+    uint64_t reusable = pins.empty() ? tail : std::min(tail, *pins.begin());
+    if (head + skip + rec_len - reusable <= log_size) {
+      break;
+    }
+    destage_cond.notify_all();
+    space_cond.wait(l);
+  }
+
+  char *r = alloc_block_buf(rec_len);
+  if (!r) {
+    return -ENOMEM;
+  }
+  uint64_t lsn = head + skip;
+  wb_record_t h = {WB_RECORD_MAGIC, next_seq++, lsn, off, len,
+    buf ? 0 : trim->len, buf ? 0 : trim->before, 0};
+  memcpy(r, &h, sizeof(h));
+  if (buf) {
+    memcpy(r + block_size, buf, len);
+  }
+  h.crc = record_crc(r, rec_len);
+  memcpy(r, &h, sizeof(h));
+
+  head = lsn + rec_len;
+  records.emplace_back(lsn, head);
+  writing.insert(lsn);
+  if (buf) {
+    // what the record takes over from older ones, in case it fails
+    std::vector<piece_t> older;
+    index_map(off, len, [&](uint64_t o, uint64_t n, uint64_t old) {
+      if (old) {
+        older.push_back(piece_t{o, n, old});
+      }
+    });
+    if (!older.empty()) {
+      replaced[lsn] = std::move(older);
+    }
+    // reads from now on get the new data, from the log; the caller has not
+    // been told the write is done, so it cannot expect it on the slow device
+    index_insert(off, len, lsn + block_size);
+  }
+
+  *rec_lsn = lsn;
+  *rec = r;
+  return 0;
+}
+
+void WriteBackBlockDevice::ack_ready(std::vector<std::function<void(int)>>& acks)
+{
+  uint64_t barrier = UINT64_MAX;
+  if (!writing.empty()) {
+    barrier = *writing.begin();
+  }
+  if (!failed.empty()) {
+    barrier = std::min(barrier, *failed.begin());
+  }
+  auto end = held.lower_bound(barrier);
+  for (auto it = held.begin(); it != end; ++it) {
+    acks.push_back(std::move(it->second));
+  }
+  held.erase(held.begin(), end);
+}
+
+void WriteBackBlockDevice::log_written(uint64_t rec_lsn, uint64_t off, uint64_t len, int r,
+  std::function<void(int)> ack)
+{
+  std::vector<std::function<void(int)>> acks;
+  {
+    std::lock_guard l(lock);
+    writing.erase(rec_lsn);
+    std::vector<piece_t> older;
+    if (auto it = replaced.find(rec_lsn); it != replaced.end()) {
+      older = std::move(it->second);
+      replaced.erase(it);
+    }
+    if (r < 0) {
+      // where the record is still indexed, the data from before the write
+      // is back: in the older records it took over, or on the slow device
+      uint64_t data = rec_lsn + block_size;
+      std::vector<piece_t> gone;
+      index_map(off, len, [&](uint64_t o, uint64_t l, uint64_t lsn) {
+        if (lsn >= data && lsn < data + len) {
+          gone.push_back(piece_t{o, l, lsn});
+        }
+      });
+      for (auto &g : gone) {
+        index_remove(g.off, g.len);
+        std::vector<piece_t> back;
+        for (auto &p : older) {
+          intersect(p, g.off, g.len, back);
+        }
+        for (auto &b : back) {
+          index_insert(b.off, b.len, b.lsn);
+        }
+      }
+      // the newer records being written took over from this one, for them
+      // it is what this one took over
+      for (auto &[lsn, pieces] : replaced) {
+        std::vector<piece_t> fixed;
+        for (auto &p : pieces) {
+          if (p.lsn < data || p.lsn >= data + len) {
+            fixed.push_back(p);
+            continue;
+          }
+          for (auto &o : older) {
+            intersect(o, p.off, p.len, fixed);
+          }
+        }
+        pieces = std::move(fixed);
+      }
+      // neither replay nor the acks of the newer records get past it before
+      // the tail does
+      failed.insert(rec_lsn);
+      destage_cond.notify_all();
+    } else {
+      ++logged;
+      held.emplace(rec_lsn, std::move(ack));
+      if (dirty() > blk_options.bdev_wb_destage_ratio * log_size) {
+        destage_cond.notify_all();
+      }
+    }
+    ack_ready(acks);
+  }
+  if (r < 0) {
+    ack(r);
+  }
+  for (auto &a : acks) {
+    a(0);
+  }
+}
+
+int WriteBackBlockDevice::log_sync(uint64_t off, uint64_t len, const char *buf, const trim_t *trim)
+{
+  uint64_t rec_lsn;
+  char *rec;
+  {
+    std::unique_lock l(lock);
+    if (int r = log_reserve(l, off, len, buf, trim, &rec_lsn, &rec); r < 0) {
+      return r;
+    }
+  }
+  uint64_t data_len = buf ? len : 0;
+  int r = members[FAST]->write(phys(rec_lsn), block_size + data_len, rec, false);
+  free(rec);
+  bool acked = false;
+  log_written(rec_lsn, off, data_len, r, [this, &acked, &r](int e) {
+    std::lock_guard l(lock);
+    acked = true;
+    r = e;
+    ack_cond.notify_all();
+  });
+  std::unique_lock l(lock);
+  ack_cond.wait(l, [&acked] { return acked; });
+  return r;
+}
+
+uint64_t WriteBackBlockDevice::bypass_prepare(uint64_t off, uint64_t len)
+{
+  std::unique_lock l(lock);
+  auto overlaps = [&]() {
+    for (auto &[o, n] : destaging) {
+      if (o < off + len && off < o + n) {
+        return true;
+      }
+    }
+    return false;
+  };
+  while (overlaps()) {
+    space_cond.wait(l);
+  }
+  // the older data in the log must not be read or destaged any more
+  index_remove(off, len);
+  for (auto &[lsn, pieces] : replaced) {
+    std::vector<piece_t> kept;
+    for (auto &p : pieces) {
+      intersect(p, p.off, off - std::min(off, p.off), kept);
+      if (p.off + p.len > off + len) {
+        intersect(p, off + len, p.off + p.len - (off + len), kept);
+      }
+    }
+    pieces = std::move(kept);
+  }
+  ++bypassed;
+  return head;
+}
+
+void WriteBackBlockDevice::bypass_done(uint64_t off, uint64_t len, uint64_t before)
+{
+  // failed or not, the slow device may have the new data now
+  std::lock_guard l(lock);
+  trims.push_back(trim_t{off, len, before});
+}
+
+int WriteBackBlockDevice::destage(std::unique_lock<stupid::common::mutex>& l)
+{
+  // only the records written completely, oldest first
+  uint64_t durable = writing.empty() ? head : *writing.begin();
+  uint64_t end = tail, end_seq = tail_seq;
+  size_t nr = 0;
+  for (auto &[lsn, rec_end] : records) {
+    if (rec_end > durable || (nr > 0 && rec_end - tail > blk_options.bdev_wb_destage_batch)) {
+      break;
+    }
+    end = rec_end;
+    ++end_seq;
+    ++nr;
+  }
+  if (nr == 0) {
+    return 0;
+  }
+
+  // what is still indexed there is the latest data of those extents; in
+  // offset order, for the slow device's sake
+  struct item_t {
+    uint64_t off, len, lsn;
+  };
+  std::vector<item_t> items;
+  for (auto &[o, e] : index) {
+    if (e.lsn >= tail && e.lsn < end) {
+      items.push_back(item_t{o, e.len, e.lsn});
+      destaging.emplace_back(o, e.len);
+    }
+  }
+  // and what the records being written took over, should they fail
+  for (auto &[lsn, pieces] : replaced) {
+    for (auto &p : pieces) {
+      if (p.lsn >= tail && p.lsn < end) {
+        items.push_back(item_t{p.off, p.len, p.lsn});
+        destaging.emplace_back(p.off, p.len);
+      }
+    }
+  }
+  const uint64_t start = tail;
+  l.unlock();
+
+  // read the batch in one go, a lap at a time; the space is not reused
+  // before the tail moves
+  int r = 0;
+  char *data = items.empty() ? nullptr : alloc_block_buf(end - start);
+  if (!items.empty() && !data) {
+    r = -ENOMEM;
+  }
+  for (uint64_t lsn = start; data && r >= 0 && lsn < end; ) {
+    uint64_t n = std::min(end, (lsn / log_size + 1) * log_size) - lsn;
+    r = members[FAST]->read_random(phys(lsn), n, data + (lsn - start), false);
+    lsn += n;
+  }
+  if (r >= 0 && !items.empty()) {
+    IOContext ioc(nullptr);
+    for (auto &it : items) {
+      r = members[SLOW]->aio_write(it.off, it.len, data + (it.lsn - start), &ioc, false);
+      if (r < 0) {
+        break;
+      }
+    }
+    members[SLOW]->aio_submit(&ioc);
+    ioc.aio_wait();
+    if (r >= 0) {
+      r = ioc.get_return_value();
+    }
+    if (r >= 0) {
+      r = members[SLOW]->flush();
+    }
+  }
+  free(data);
+  // the slow device has the data before the superblock forgets the records
+  if (r >= 0) {
+    r = write_superblock(end, end_seq);
+  }
+
+  l.lock();
+  destaging.clear();
+  if (r < 0) {
+    std::cerr << __func__ << " failed: " << r << std::endl;
+    space_cond.notify_all();
+    return r;
+  }
+
+  // the extents rewritten meanwhile have left [start, end) already
+  for (auto it = index.begin(); it != index.end(); ) {
+    if (it->second.lsn >= start && it->second.lsn < end) {
+      destaged += it->second.len;
+      it = index.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto &[lsn, pieces] : replaced) {
+    // on the slow device now
+    pieces.erase(std::remove_if(pieces.begin(), pieces.end(), [end](const piece_t &p) {
+      return p.lsn < end;
+    }), pieces.end());
+  }
+  records.erase(records.begin(), records.begin() + nr);
+  tail = end;
+  tail_seq = end_seq;
+  failed.erase(failed.begin(), failed.lower_bound(tail));
+  space_cond.notify_all();
+  return nr;
+}
+
+void WriteBackBlockDevice::_destage_thread()
+{
+  std::cout << __func__ << " start" << std::endl;
+
+  auto interval = std::chrono::milliseconds(blk_options.bdev_wb_destage_interval_ms);
+  // always destage when the log fills up, or past a failed record holding
+  // the acks of the newer ones; otherwise in the background, once every
+  // interval
+  auto urgent = [this]() {
+    return dirty() > blk_options.bdev_wb_destage_ratio * log_size || !failed.empty();
+  };
+  std::unique_lock l(lock);
+  while (!stop) {
+    if (!urgent()) {
+      destage_cond.wait_for(l, interval);
+      if (stop) {
+        break;
+      }
+    }
+    int r = destage(l);
+    if (r > 0) {
+      std::vector<std::function<void(int)>> acks;
+      ack_ready(acks);
+      l.unlock();
+      for (auto &a : acks) {
+        a(0);
+      }
+      l.lock();
+    }
+    if (r < 0) {
+      // retry, but not in a tight loop
+      destage_cond.wait_for(l, interval);
+    } else if (r == 0 && urgent()) {
+      // the oldest records are still being written
+      destage_cond.wait_for(l, std::chrono::milliseconds(1));
+    }
+  }
+
+  std::cout << __func__ << " end" << std::endl;
+}
+
+int WriteBackBlockDevice::read_pieces(uint64_t off, uint64_t len, char *buf, IOContext *ioc)
+{
+  struct piece_t {
+    uint64_t off, len, lsn;
+  };
+  std::vector<piece_t> pieces;
+  {
+    std::lock_guard l(lock);
+    index_map(off, len, [&](uint64_t o, uint64_t n, uint64_t lsn) {
+      pieces.push_back(piece_t{o, n, lsn});
+      if (lsn) {
+        pins.insert(lsn);
+      }
+    });
+  }
+
+  int ret = 0;
+  for (auto &p : pieces) {
+    int r;
+    if (p.lsn) {
+      ++log_reads;
+      r = members[FAST]->read_random(phys(p.lsn), p.len, buf + (p.off - off), false);
+      unpin(p.lsn);
+    } else if (ioc) {
+      r = members[SLOW]->read(p.off, p.len, buf + (p.off - off), ioc, false);
+    } else {
+      r = members[SLOW]->read_random(p.off, p.len, buf + (p.off - off), false);
+    }
+    if (r < 0 && ret == 0) {
+      ret = r;
+    }
+  }
+  return ret;
+}
+
+int WriteBackBlockDevice::read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << std::endl;
+  assert(is_valid_io(off, len));
+  return read_pieces(off, len, buf, ioc);
+}
+
+int WriteBackBlockDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered)
+{
+  std::cout << __func__ << " " << off << "~" << len << std::endl;
+  assert(len > 0);
+  assert(off + len <= size);
+
+  uint64_t aligned_off = stupid::common::p2align(off, block_size);
+  uint64_t aligned_len = stupid::common::p2roundup(off + len, block_size) - aligned_off;
+  if (aligned_off == off && aligned_len == len) {
+    return read_pieces(off, len, buf, nullptr);
+  }
+
+  // the index is in whole blocks, widen to them
+  char *tmp = static_cast<char*>(aligned_alloc(4096, stupid::common::p2roundup<uint64_t>(aligned_len, 4096)));
+  if (!tmp) {
+    return -ENOMEM;
+  }
+  int r = read_pieces(aligned_off, aligned_len, tmp, nullptr);
+  if (r >= 0) {
+    memcpy(buf, tmp + (off - aligned_off), len);
+  }
+  free(tmp);
+  return r;
+}
+
+void WriteBackBlockDevice::start_read(fanout_t *f, uint64_t off, uint64_t len, char *buf, uint8_t prio)
+{
+  struct piece_t {
+    uint64_t off, len, lsn;
+  };
+  std::vector<piece_t> pieces;
+  {
+    std::lock_guard l(lock);
+    index_map(off, len, [&](uint64_t o, uint64_t n, uint64_t lsn) {
+      pieces.push_back(piece_t{o, n, lsn});
+      if (lsn) {
+        pins.insert(lsn);
+        ++log_reads;
+      }
+    });
+  }
+
+  // all the pieces make one unit of f
+  auto left = std::make_shared<std::atomic_int>(pieces.size());
+  for (auto &p : pieces) {
+    uint64_t lsn = p.lsn;
+    start_member_io(lsn ? FAST : SLOW, false, lsn ? phys(lsn) : p.off, p.len, buf + (p.off - off), prio,
+      [this, f, lsn, left](int r) {
+        if (lsn) {
+          unpin(lsn);
+        }
+        if (r < 0) {
+          f->parent->set_return_value(r);
+        }
+        if (--*left == 0) {
+          unit_finished(f);
+        }
+      });
+  }
+}
+
+int WriteBackBlockDevice::aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << std::endl;
+  assert(is_valid_io(off, len));
+
+  // mapped on aio_submit(), after the writes queued before it; the log is
+  // pinned only while the reads of it are actually running, so a write of
+  // the same thread waiting for log space does not wait for them
+  fanout_t *f = fanout_of(ioc);
+  uint8_t prio = ioc->prio;
+  f->deferred.push_back([this, f, off, len, buf, prio] {
+    start_read(f, off, len, buf, prio);
+  });
+  ++ioc->num_pending;
+  return 0;
+}
+
+int WriteBackBlockDevice::write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint)
+{
+  std::cout << __func__ << " " << off << "~" << len << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  if (len > blk_options.bdev_wb_max_write) {
+    uint64_t before = bypass_prepare(off, len);
+    int r = members[SLOW]->write(off, len, buf, buffered, write_hint);
+    bypass_done(off, len, before);
+    return r;
+  }
+  return log_sync(off, len, buf, nullptr);
+}
+
+int WriteBackBlockDevice::aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint)
+{
+  std::cout << __func__ << " " << off << "~" << len << " ioc " << ioc << " buffered " << buffered << std::endl;
+  assert(is_valid_io(off, len));
+
+  fanout_t *f = fanout_of(ioc);
+  uint8_t prio = ioc->prio;
+  if (len > blk_options.bdev_wb_max_write) {
+    // on aio_submit() as well, in order with the records of ioc; a
+    // tombstone is due once it is done
+    f->deferred.push_back([this, f, off, len, buf, prio] {
+      uint64_t before = bypass_prepare(off, len);
+      start_member_io(SLOW, true, off, len, buf, prio, [this, f, off, len, before](int r) {
+        bypass_done(off, len, before);
+        if (r < 0) {
+          f->parent->set_return_value(r);
+        }
+        unit_finished(f);
+      });
+    });
+    ++ioc->num_pending;
+    return 0;
+  }
+
+  // the log space is reserved on aio_submit(): waiting for it here could
+  // wait for the destage of the records of ioc, not submitted yet
+  f->deferred.push_back([this, f, off, len, buf, prio] {
+    uint64_t rec_lsn;
+    char *rec;
+    int r;
+    {
+      std::unique_lock l(lock);
+      r = log_reserve(l, off, len, buf, nullptr, &rec_lsn, &rec);
+    }
+    if (r < 0) {
+      f->parent->set_return_value(r);
+      unit_finished(f);
+      return;
+    }
+    start_member_io(FAST, true, phys(rec_lsn), block_size + len, rec, prio, [this, f, rec_lsn, rec, off, len](int r) {
+      free(rec);
+      log_written(rec_lsn, off, len, r, [this, f](int r) {
+        if (r < 0) {
+          f->parent->set_return_value(r);
+        }
+        unit_finished(f);
+      });
+    });
+  });
+  ++ioc->num_pending;
+  return 0;
+}
+
+int WriteBackBlockDevice::flush()
+{
+  // the bypassing writes are on the slow device; they must be durable
+  // before their tombstones are
+  if (int r = members[SLOW]->flush(); r < 0) {
+    return r;
+  }
+
+  std::vector<trim_t> done;
+  {
+    std::lock_guard l(lock);
+    for (auto &t : trims) {
+      // nothing older than the tail is replayed
+      if (t.before > tail) {
+        done.push_back(t);
+      }
+    }
+    trims.clear();
+  }
+  for (size_t i = 0; i < done.size(); ++i) {
+    if (int r = log_sync(0, 0, nullptr, &done[i]); r < 0) {
+      std::lock_guard l(lock);
+      trims.insert(trims.end(), done.begin() + i, done.end());
+      return r;
+    }
+  }
+  return members[FAST]->flush();
+}
+
+int WriteBackBlockDevice::invalidate_cache(uint64_t off, uint64_t len)
+{
+  return members[SLOW]->invalidate_cache(off, len);
+}
+
+int WriteBackBlockDevice::collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const
+{
+  CompositeBlockDevice::collect_metadata(prefix, pm);
+  (*pm)[prefix + "driver"] = "WriteBackBlockDevice";
+  (*pm)[prefix + "wb_log_size"] = std::to_string(log_size);
+  (*pm)[prefix + "wb_dirty"] = std::to_string(dirty());
+  (*pm)[prefix + "wb_logged"] = std::to_string(logged.load());
+  (*pm)[prefix + "wb_bypassed"] = std::to_string(bypassed.load());
+  (*pm)[prefix + "wb_log_reads"] = std::to_string(log_reads.load());
+  (*pm)[prefix + "wb_destaged"] = std::to_string(destaged.load());
+  return 0;
+}
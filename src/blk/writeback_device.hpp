@@ -0,0 +1,187 @@
+#ifndef STUPID__BLK_WRITEBACK_DEVICE_HPP
+#define STUPID__BLK_WRITEBACK_DEVICE_HPP
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "common/mutex.hpp"
+#include "common/thread.hpp"
+
+#include "blk/composite_device.hpp"
+
+// Write-back cache of a slow device (HDD) on a fast one (NVMe), opened on
+// "writeback:<fast path>,<slow path>" (or with the type name "writeback");
+// the size is the slow device's.
+//
+// Writes of up to bdev_wb_max_write bytes are appended to a log taking the
+// whole fast device and acknowledged once there; bigger ones go straight to
+// the slow device. An in-memory index maps the dirty extents to their place
+// in the log, reads are served from the log for them and from the slow
+// device for the rest. A destage thread moves the oldest part of the log to
+// the slow device in offset order, bdev_wb_destage_batch bytes at a time,
+// and then frees it.
+//
+// Log layout on the fast device: block 0 is the superblock, holding where
+// the oldest record not destaged yet (the tail) is; then each record is a
+// header block followed by the data, written as one IO. Positions in the log
+// (lsn) grow forever, the place on the device is lsn modulo the log size; a
+// record never wraps, one not fitting before the end of the lap starts the
+// next lap. Each header carries a crc32c of the record. On open the records
+// following the tail are replayed for as long as their sequence numbers
+// follow each other and their crcs match, which rebuilds the index.
+//
+// The records are written in parallel, but a write is only acknowledged
+// once every older record is in the log too, so replay stopping at the
+// first missing or torn record loses nothing acknowledged. The write of a
+// record failing leaves a hole replay cannot get past: the newer records
+// are held until the destager has moved the tail beyond it. The extents a
+// record took over in the index are indexed again if it fails, and until
+// then the destager writes them back as if they were still indexed.
+//
+// A bypassing write leaves the older records of its blocks in the log.
+// flush() flushes the slow device, then logs a tombstone record for every
+// bypassing write done since the last flush. On replay, a tombstone drops
+// the log data of its blocks that is older than the write.
+class WriteBackBlockDevice : public CompositeBlockDevice {
+  enum { FAST = 0, SLOW = 1 };
+
+  struct extent_t {
+    uint64_t len;
+    uint64_t lsn;       // of the data for the first byte
+  };
+  struct piece_t {
+    uint64_t off, len, lsn;
+  };
+  // a bypassing write of [off, off + len), newer than the log data before lsn
+  struct trim_t {
+    uint64_t off, len, before;
+  };
+
+  stupid::common::mutex lock = stupid::common::make_mutex("WriteBackBlockDevice::lock");
+  stupid::common::condition_variable space_cond;    // log space freed
+  stupid::common::condition_variable destage_cond;  // work for the destager, or a destage done
+  stupid::common::condition_variable ack_cond;      // a sync write acknowledged
+  std::map<uint64_t, extent_t> index;               // dirty extents by offset, not overlapping
+  std::set<uint64_t> writing;                       // lsn of the records being written
+  std::set<uint64_t> failed;                        // lsn of the records which failed, until the tail passes them
+  std::map<uint64_t, std::vector<piece_t>> replaced;  // log extents the records being written took over, by lsn
+  std::vector<trim_t> trims;                        // bypassing writes done, to log as tombstones
+  std::map<uint64_t, std::function<void(int)>> held;  // acks of the records written, by lsn, waiting for older ones
+  std::multiset<uint64_t> pins;                     // lsn of the data being read from the log
+  std::vector<std::pair<uint64_t, uint64_t>> destaging; // extents the destager is writing back
+  std::deque<std::pair<uint64_t, uint64_t>> records;    // lsn, end lsn; from the tail on
+
+  uint64_t log_start = 0;                           // on the fast device
+  uint64_t log_size = 0;
+  uint64_t head = 0, tail = 0;                      // lsn
+  uint64_t next_seq = 0, tail_seq = 0;
+  bool stop = false;
+
+  std::atomic<uint64_t> logged = {0}, bypassed = {0}, log_reads = {0}, destaged = {0};
+
+  struct DestageThread : public stupid::common::Thread {
+    WriteBackBlockDevice *bdev;
+    explicit DestageThread(WriteBackBlockDevice *b) : bdev(b) {}
+    void *entry() override {
+      bdev->_destage_thread();
+      return nullptr;
+    }
+  } destage_thread;
+
+  void _destage_thread();
+  int destage(std::unique_lock<stupid::common::mutex>& l);
+
+  uint64_t phys(uint64_t lsn) const { return log_start + lsn % log_size; }
+  uint64_t dirty() const { return head - tail; }
+
+  int load_superblock();
+  int write_superblock(uint64_t tail, uint64_t tail_seq);
+  int replay();
+
+  void index_insert(uint64_t off, uint64_t len, uint64_t lsn);
+  void index_remove(uint64_t off, uint64_t len);
+  // drop the log data of [off, off + len) older than before
+  void index_trim(uint64_t off, uint64_t len, uint64_t before);
+  // the part of p within [off, off + len), if any
+  static void intersect(const piece_t &p, uint64_t off, uint64_t len, std::vector<piece_t>& out);
+  // the pieces of [off, off + len): f(offset, length, lsn of the data, or 0
+  // when it is on the slow device)
+  void index_map(uint64_t off, uint64_t len,
+    const std::function<void(uint64_t, uint64_t, uint64_t)>& f) const;
+  void unpin(uint64_t lsn);
+
+  // Take room for a record of len data bytes, waiting for the destager if
+  // the log is full, and index it; *rec_lsn is the lsn of the header, *rec
+  // the record buffer to write. With buf nullptr the record is the tombstone
+  // of trim.
+  int log_reserve(std::unique_lock<stupid::common::mutex>& l, uint64_t off, uint64_t len, const char *buf,
+    const trim_t *trim, uint64_t *rec_lsn, char **rec);
+  // The record at rec_lsn is written (r < 0 if that failed); ack(r) is called
+  // once the write may be acknowledged, right away if it failed.
+  void log_written(uint64_t rec_lsn, uint64_t off, uint64_t len, int r, std::function<void(int)> ack);
+  // take the held acks no older record holds back any more
+  void ack_ready(std::vector<std::function<void(int)>>& acks);
+  // write a record and wait for its ack
+  int log_sync(uint64_t off, uint64_t len, const char *buf, const trim_t *trim);
+
+  // a write going to the slow device must not race the destage of an older
+  // version of the same blocks; returns the head, see trim_t
+  uint64_t bypass_prepare(uint64_t off, uint64_t len);
+  void bypass_done(uint64_t off, uint64_t len, uint64_t before);
+
+  int read_pieces(uint64_t off, uint64_t len, char *buf, IOContext *ioc);
+  // start the reads of an aio_read of f, one unit of it
+  void start_read(fanout_t *f, uint64_t off, uint64_t len, char *buf, uint8_t prio);
+
+public:
+  WriteBackBlockDevice(aio_callback_t cb, void *cbpriv)
+    : CompositeBlockDevice(cb, cbpriv), destage_thread(this) {}
+
+  int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
+
+  int read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered) override;
+
+  int read_random(
+    uint64_t off,
+    uint64_t len,
+    char *buf,
+    bool buffered) override;
+
+  int aio_read(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc) override;
+
+  int write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  int aio_write(
+    uint64_t off,
+    uint64_t len,
+    char* buf,
+    IOContext *ioc,
+    bool buffered,
+    int write_hint = WRITE_LIFE_NOT_SET) override;
+
+  // the log is where written data is durable
+  int flush() override;
+  int invalidate_cache(uint64_t off, uint64_t len) override;
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif //STUPID__BLK_WRITEBACK_DEVICE_HPP
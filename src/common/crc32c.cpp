@@ -0,0 +1,241 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "common/crc32c.hpp"
+
+namespace stupid {
+namespace common {
+
+// reflected polynomial
+static const uint32_t POLY = 0x82f63b78;
+
+// lengths of the 3 streams the hardware paths interleave; MEDIUM covers a
+// 4K block but for 16 bytes
+static const size_t LONG = 8192;
+static const size_t MEDIUM = 1360;
+static const size_t SHORT = 256;
+
+namespace {
+
+// Tables for appending zeros to a CRC, i.e. multiplying it by x^(8 * len)
+// modulo the polynomial, a 32x32 matrix over GF(2) applied byte by byte.
+// crc(A || B) is then shift(crc(A), len(B)) ^ crc(B) with crc(B) started
+// from 0, which is how the 3 streams are folded.
+struct shift_table_t {
+  uint32_t t[4][256];
+
+  static uint32_t times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+      if (vec & 1) {
+        sum ^= *mat;
+      }
+      vec >>= 1;
+      ++mat;
+    }
+    return sum;
+  }
+
+  static void square(uint32_t *sq, const uint32_t *mat) {
+    for (int n = 0; n < 32; ++n) {
+      sq[n] = times(mat, mat[n]);
+    }
+  }
+
+  explicit shift_table_t(size_t len) {
+    // the operator for one zero bit, squared up to one zero byte
+    uint32_t pow[32], tmp[32], op[32];
+    pow[0] = POLY;
+    for (int n = 1; n < 32; ++n) {
+      pow[n] = 1u << (n - 1);
+    }
+    for (int i = 0; i < 3; ++i) {
+      square(tmp, pow);
+      memcpy(pow, tmp, sizeof(pow));
+    }
+    // op = the product of the operators for 2^k bytes, k the bits of len
+    for (int n = 0; n < 32; ++n) {
+      op[n] = 1u << n;
+    }
+    while (len) {
+      if (len & 1) {
+        for (int n = 0; n < 32; ++n) {
+          tmp[n] = times(pow, op[n]);
+        }
+        memcpy(op, tmp, sizeof(op));
+      }
+      len >>= 1;
+      if (len) {
+        square(tmp, pow);
+        memcpy(pow, tmp, sizeof(pow));
+      }
+    }
+    for (uint32_t n = 0; n < 256; ++n) {
+      t[0][n] = times(op, n);
+      t[1][n] = times(op, n << 8);
+      t[2][n] = times(op, n << 16);
+      t[3][n] = times(op, n << 24);
+    }
+  }
+
+  uint32_t shift(uint32_t crc) const {
+    return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+  }
+};
+
+struct sw_table_t {
+  uint32_t t[8][256];
+
+  sw_table_t() {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t crc = n;
+      for (int k = 0; k < 8; ++k) {
+        crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+      }
+      t[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t crc = t[0][n];
+      for (int k = 1; k < 8; ++k) {
+        crc = t[0][crc & 0xff] ^ (crc >> 8);
+        t[k][n] = crc;
+      }
+    }
+  }
+};
+
+} //namespace
+
+static const shift_table_t shift_long(LONG);
+static const shift_table_t shift_medium(MEDIUM);
+static const shift_table_t shift_short(SHORT);
+static const sw_table_t sw;
+
+static const struct {
+  size_t len;
+  const shift_table_t *table;
+} streams[] = {{LONG, &shift_long}, {MEDIUM, &shift_medium}, {SHORT, &shift_short}};
+
+static uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+  const unsigned char *next = static_cast<const unsigned char*>(data);
+  crc = ~crc;
+  while (len && ((uintptr_t)next & 7)) {
+    crc = sw.t[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    --len;
+  }
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, next, 8);
+    word ^= crc;
+    crc = sw.t[7][word & 0xff] ^ sw.t[6][(word >> 8) & 0xff] ^
+      sw.t[5][(word >> 16) & 0xff] ^ sw.t[4][(word >> 24) & 0xff] ^
+      sw.t[3][(word >> 32) & 0xff] ^ sw.t[2][(word >> 40) & 0xff] ^
+      sw.t[1][(word >> 48) & 0xff] ^ sw.t[0][word >> 56];
+    next += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc = sw.t[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// The 3-way interleaved loop, over the byte and word instructions of the
+// CPU. Little endian only, as both ISAs are.
+#define CRC32C_HW_BODY(CRC_BYTE, CRC_WORD)                                    \
+  const unsigned char *next = static_cast<const unsigned char*>(data);        \
+  uint64_t crc0 = ~crc;                                                       \
+  while (len && ((uintptr_t)next & 7)) {                                      \
+    crc0 = CRC_BYTE(crc0, *next++);                                           \
+    --len;                                                                    \
+  }                                                                           \
+  for (auto &s : streams) {                                                   \
+    const size_t stream = s.len;                                              \
+    while (len >= stream * 3) {                                               \
+      uint64_t crc1 = 0, crc2 = 0;                                            \
+      const unsigned char *end = next + stream;                               \
+      do {                                                                    \
+        crc0 = CRC_WORD(crc0, *(const uint64_t*)next);                        \
+        crc1 = CRC_WORD(crc1, *(const uint64_t*)(next + stream));             \
+        crc2 = CRC_WORD(crc2, *(const uint64_t*)(next + 2 * stream));         \
+        next += 8;                                                            \
+      } while (next < end);                                                   \
+      crc0 = s.table->shift(crc0) ^ crc1;                                     \
+      crc0 = s.table->shift(crc0) ^ crc2;                                     \
+      next += stream * 2;                                                     \
+      len -= stream * 3;                                                      \
+    }                                                                         \
+  }                                                                           \
+  while (len >= 8) {                                                          \
+    crc0 = CRC_WORD(crc0, *(const uint64_t*)next);                            \
+    next += 8;                                                                \
+    len -= 8;                                                                 \
+  }                                                                           \
+  while (len--) {                                                             \
+    crc0 = CRC_BYTE(crc0, *next++);                                           \
+  }                                                                           \
+  return ~(uint32_t)crc0;
+
+#if defined(__x86_64__)
+#define SSE42_BYTE(c, b) _mm_crc32_u8((uint32_t)(c), (b))
+#define SSE42_WORD(c, w) _mm_crc32_u64((c), (w))
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len)
+{
+  CRC32C_HW_BODY(SSE42_BYTE, SSE42_WORD)
+}
+#elif defined(__aarch64__) && defined(__linux__)
+#define ARMV8_BYTE(c, b) __crc32cb((uint32_t)(c), (b))
+#define ARMV8_WORD(c, w) __crc32cd((uint32_t)(c), (w))
+
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const void *data, size_t len)
+{
+  CRC32C_HW_BODY(ARMV8_BYTE, ARMV8_WORD)
+}
+#endif
+
+typedef uint32_t (*crc32c_func_t)(uint32_t, const void*, size_t);
+
+struct crc32c_impl_t {
+  crc32c_func_t func = crc32c_sw;
+  const char *name = "software";
+
+  crc32c_impl_t() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+      func = crc32c_sse42;
+      name = "sse4.2";
+    }
+#elif defined(__aarch64__) && defined(__linux__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+      func = crc32c_armv8;
+      name = "armv8";
+    }
+#endif
+  }
+};
+
+static const crc32c_impl_t impl;
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+  return impl.func(crc, data, len);
+}
+
+const char *crc32c_impl()
+{
+  return impl.name;
+}
+
+} //namespace common
+} //namespace stupid
@@ -0,0 +1,27 @@
+#ifndef STUPID__CRC32C_HPP
+#define STUPID__CRC32C_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace stupid {
+namespace common {
+
+/*
+ * CRC-32C (Castagnoli) of len bytes at data, continuing from crc; start
+ * with 0. crc32c(0, "123456789", 9) == 0xe3069283.
+ *
+ * The CRC instructions of SSE 4.2 or ARMv8 are used if the CPU has them,
+ * slicing by 8 otherwise. They take 3 cycles to finish but a new one may
+ * start every cycle, so the hardware paths run 3 streams over the 3 thirds
+ * of the buffer and fold the CRCs together at the end.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// "sse4.2", "armv8" or "software"
+const char *crc32c_impl();
+
+} //namespace common
+} //namespace stupid
+
+#endif //STUPID__CRC32C_HPP
@@ -0,0 +1,113 @@
+#ifndef STUPID__HISTOGRAM_HPP
+#define STUPID__HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+namespace stupid {
+namespace common {
+
+/*
+ * Power-of-two latency histogram: bucket b counts samples in [2^(b-1), 2^b)
+ * nanoseconds, bucket 0 counts zeros. It is written by the thread owning it
+ * and may be read concurrently from others, hence the relaxed atomics.
+ */
+class LatencyHistogram {
+public:
+  static constexpr int nr_buckets = 64;
+
+private:
+  std::atomic<uint64_t> buckets[nr_buckets] = {};
+  std::atomic<uint64_t> sum = {0};
+
+  static int bucket_of(uint64_t ns) {
+    if (ns == 0) {
+      return 0;
+    }
+    int b = 64 - __builtin_clzll(ns);
+    return b < nr_buckets ? b : nr_buckets - 1;
+  }
+
+public:
+  static uint64_t bucket_upper(int b) {
+    return b == 0 ? 0 : (b >= 64 ? UINT64_MAX : (1ull << b) - 1);
+  }
+
+  void add(uint64_t ns) {
+    buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  // start over; racing add()s may land on either side
+  void reset() {
+    for (int b = 0; b < nr_buckets; ++b) {
+      buckets[b].store(0, std::memory_order_relaxed);
+    }
+    sum.store(0, std::memory_order_relaxed);
+  }
+
+  void merge(const LatencyHistogram& other) {
+    for (int b = 0; b < nr_buckets; ++b) {
+      buckets[b].fetch_add(other.buckets[b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+
+  uint64_t count() const {
+    uint64_t n = 0;
+    for (int b = 0; b < nr_buckets; ++b) {
+      n += buckets[b].load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  uint64_t avg() const {
+    uint64_t n = count();
+    return n ? sum.load(std::memory_order_relaxed) / n : 0;
+  }
+
+  // upper bound of the bucket holding the p-th percentile (0 < p <= 100)
+  uint64_t percentile(double p) const {
+    uint64_t n = count();
+    if (n == 0) {
+      return 0;
+    }
+    uint64_t want = (uint64_t)(n * p / 100.0);
+    if (want == 0) {
+      want = 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < nr_buckets; ++b) {
+      seen += buckets[b].load(std::memory_order_relaxed);
+      if (seen >= want) {
+        return bucket_upper(b);
+      }
+    }
+    return bucket_upper(nr_buckets - 1);
+  }
+
+  // one line summary
+  void summary(std::ostream& out) const {
+    out << "count=" << count()
+        << " avg_ns=" << avg()
+        << " p50_ns=" << percentile(50)
+        << " p99_ns=" << percentile(99)
+        << " p999_ns=" << percentile(99.9);
+  }
+
+  // every non empty bucket, one per line
+  void dump(std::ostream& out, const char *indent = "") const {
+    for (int b = 0; b < nr_buckets; ++b) {
+      uint64_t n = buckets[b].load(std::memory_order_relaxed);
+      if (n) {
+        out << indent << "<= " << bucket_upper(b) << "ns: " << n << "\n";
+      }
+    }
+  }
+};
+
+} //namespace common
+} //namespace stupid
+
+#endif //STUPID__HISTOGRAM_HPP
@@ -0,0 +1,94 @@
+#ifndef STUPID__MPSC_RING_HPP
+#define STUPID__MPSC_RING_HPP
+
+#include <assert.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace stupid {
+namespace common {
+
+/*
+ * Bounded lock-free ring with many producers and a single consumer.
+ *
+ * Every slot carries a sequence number telling whose turn it is: a producer
+ * claims position pos with a CAS on tail once slot pos has sequence pos, and
+ * publishes it by setting the sequence to pos + 1; the consumer takes it when
+ * it sees pos + 1, and frees the slot for the next lap with pos + capacity.
+ * A producer never waits for another one, only for a full ring.
+ */
+template <typename T>
+class MpscRing {
+  struct alignas(64) slot_t {
+    std::atomic<uint64_t> seq;
+    T value;
+  };
+
+  const uint64_t mask;
+  std::unique_ptr<slot_t[]> slots;
+  alignas(64) std::atomic<uint64_t> tail = {0};  // producers
+  alignas(64) uint64_t head = 0;                 // consumer
+
+public:
+  // capacity is rounded up to a power of 2
+  explicit MpscRing(size_t capacity)
+    : mask((capacity < 2 ? 2 : (1ull << (64 - __builtin_clzll(capacity - 1)))) - 1),
+      slots(new slot_t[mask + 1])
+  {
+    for (uint64_t i = 0; i <= mask; ++i) {
+      slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscRing(const MpscRing&) = delete;
+  MpscRing& operator=(const MpscRing&) = delete;
+
+  size_t capacity() const { return mask + 1; }
+
+  // false if the ring is full
+  bool push(const T& v) {
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      slot_t &s = slots[pos & mask];
+      int64_t diff = (int64_t)s.seq.load(std::memory_order_acquire) - (int64_t)pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          s.value = v;
+          s.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+        // pos was reloaded by the failed CAS
+      } else if (diff < 0) {
+        // the consumer has not freed this slot yet
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // consumer only; false if nothing has been published at the head
+  bool pop(T *v) {
+    slot_t &s = slots[head & mask];
+    if (s.seq.load(std::memory_order_acquire) != head + 1) {
+      return false;
+    }
+    *v = s.value;
+    s.seq.store(head + mask + 1, std::memory_order_release);
+    ++head;
+    return true;
+  }
+
+  // consumer only
+  bool empty() const {
+    return slots[head & mask].seq.load(std::memory_order_acquire) != head + 1;
+  }
+};
+
+} //namespace common
+} //namespace stupid
+
+#endif //STUPID__MPSC_RING_HPP
@@ -0,0 +1,59 @@
+#ifndef STUPID__TOKEN_BUCKET_HPP
+#define STUPID__TOKEN_BUCKET_HPP
+
+#include <algorithm>
+#include <cstdint>
+
+namespace stupid {
+namespace common {
+
+/*
+ * Token bucket filled at rate tokens per second, holding at most burst
+ * tokens. A request is admitted as soon as the bucket is not in debt, and
+ * takes its whole cost at once, going into debt if need be; a request bigger
+ * than the burst thus passes, and the ones after it wait for the debt to be
+ * paid back. Not thread safe, rate 0 means no limit.
+ */
+class TokenBucket {
+  double rate = 0;       // per ns
+  double burst = 0;
+  double tokens = 0;
+  uint64_t last = 0;     // ns
+
+  void refill(uint64_t now) {
+    if (now > last) {
+      tokens = std::min(burst, tokens + (now - last) * rate);
+      last = now;
+    }
+  }
+
+public:
+  void configure(uint64_t per_sec, uint64_t burst_ns, uint64_t now) {
+    rate = per_sec / 1e9;
+    burst = std::max(rate * burst_ns, 1.0);
+    tokens = burst;
+    last = now;
+  }
+
+  bool unlimited() const { return rate == 0; }
+
+  // how long until a request may be admitted, 0 if it may now
+  uint64_t wait_ns(uint64_t now) {
+    if (unlimited()) {
+      return 0;
+    }
+    refill(now);
+    return tokens >= 0 ? 0 : (uint64_t)(-tokens / rate) + 1;
+  }
+
+  void take(double cost) {
+    if (!unlimited()) {
+      tokens -= cost;
+    }
+  }
+};
+
+} //namespace common
+} //namespace stupid
+
+#endif //STUPID__TOKEN_BUCKET_HPP
@@ -1,6 +1,7 @@
 #ifndef STUPID__UTIL_HPP
 #define STUPID__UTIL_HPP
 
+#include <cstdint>
 #include <string>
 
 #ifndef TEMP_FAILURE_RETRY
@@ -29,6 +30,12 @@ int pipe_cloexec(int pipefd[2], int flags);
 
 std::string get_process_name_by_pid(pid_t pid);
 
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t mono_ns();
+
+/* CLOCK_THREAD_CPUTIME_ID in nanoseconds */
+uint64_t thread_cpu_ns();
+
 
 } //namespace common
 } //namespace stupid
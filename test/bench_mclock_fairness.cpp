@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/init.hpp"
+#include "common/code_environment.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/block_device.hpp"
+
+// Shares of the device which the mClock scheduler gives tenants competing
+// for it, against what their reservation, weight and limit entitle them to:
+//     bench_mclock_fairness [path] [seconds]
+// path is the device, by default a null device of 32 channels serving an IO
+// in 1ms (32000 IOPS), so that it runs anywhere.
+
+struct client_t {
+  uint32_t id;
+  const char *name;
+  double reservation, weight, limit;
+
+  std::mutex lock;
+  std::condition_variable cond;
+  int inflight = 0;
+  std::atomic<uint64_t> done = {0};
+  double expected = 0;
+};
+
+struct io_t {
+  client_t *c;
+  IOContext *ioc;
+};
+
+static BlockDevice *bdev;
+
+static void aio_cb(void *priv, void *priv2)
+{
+  io_t *io = static_cast<io_t*>(priv2);
+  client_t *c = io->c;
+  bdev->queue_reap_ioc(io->ioc);
+  delete io;
+
+  ++c->done;
+  std::lock_guard l(c->lock);
+  --c->inflight;
+  c->cond.notify_one();
+}
+
+// each tenant gets max(reservation, weight share of what is left), within
+// its limit
+static void water_fill(std::vector<client_t*>& clients, double capacity)
+{
+  std::map<client_t*, bool> fixed;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    double left = capacity, weights = 0;
+    for (auto c : clients) {
+      if (fixed[c]) {
+        left -= c->expected;
+      } else {
+        weights += c->weight;
+      }
+    }
+    for (auto c : clients) {
+      if (fixed[c]) {
+        continue;
+      }
+      c->expected = left * c->weight / weights;
+      if (c->expected < c->reservation) {
+        c->expected = c->reservation;
+        fixed[c] = changed = true;
+      } else if (c->limit > 0 && c->expected > c->limit) {
+        c->expected = c->limit;
+        fixed[c] = changed = true;
+      }
+      if (changed) {
+        break;
+      }
+    }
+  }
+}
+
+static void run_client(client_t *c, std::atomic_bool *stop)
+{
+  const int qd = 64;
+  const uint64_t io_size = 4096;
+  uint64_t nr_blocks = bdev->get_size() / io_size;
+  char *buf = static_cast<char*>(aligned_alloc(4096, io_size));
+  uint64_t n = 0;
+
+  while (!*stop) {
+    {
+      std::unique_lock l(c->lock);
+      while (c->inflight >= qd) {
+        c->cond.wait(l);
+      }
+      ++c->inflight;
+    }
+    io_t *io = new io_t{c, nullptr};
+    io->ioc = new IOContext(io);
+    io->ioc->qos_client = c->id;
+    // all the tenants read into the same buffer, the data does not matter
+    int r = bdev->aio_read((n++ * 7919 % nr_blocks) * io_size, io_size, buf, io->ioc);
+    if (r < 0) {
+      std::cerr << "aio_read failed: " << r << std::endl;
+      exit(1);
+    }
+    bdev->aio_submit(io->ioc);
+  }
+
+  std::unique_lock l(c->lock);
+  while (c->inflight > 0) {
+    c->cond.wait(l);
+  }
+  free(buf);
+}
+
+int main(int argc, char** argv)
+{
+  std::string path = "null:1G";
+  int seconds = 10;
+  if (argc >= 2) {
+    path = argv[1];
+  }
+  if (argc >= 3) {
+    seconds = std::atoi(argv[2]);
+  }
+
+  stupid::common::initialize(stupid::global::CODE_ENVIRONMENT_UTILITY);
+
+  blk_options.bdev_mclock = true;
+  blk_options.bdev_null_latency_us = 1000;
+  blk_options.bdev_null_channels = 32;
+
+  bdev = BlockDevice::create("", path, aio_cb, nullptr, nullptr, nullptr);
+  if (int r = bdev->open(path); r != 0) {
+    std::cerr << "failed to open " << path << ": " << r << std::endl;
+    return 1;
+  }
+
+  // a limited tenant, a reserved one of small weight, and two sharing the
+  // rest 1:2
+  std::vector<client_t*> clients = {
+    new client_t{1, "weight 1", 0, 1, 0},
+    new client_t{2, "weight 2", 0, 2, 0},
+    new client_t{3, "weight 1, limit 500", 0, 1, 500},
+    new client_t{4, "weight 0.1, reservation 4000", 4000, 0.1, 0},
+  };
+  for (auto c : clients) {
+    if (int r = bdev->set_qos_client(c->id, c->reservation, c->weight, c->limit); r < 0) {
+      std::cerr << "set_qos_client failed: " << r << std::endl;
+      return 1;
+    }
+  }
+
+  std::atomic_bool stop = {false};
+  std::vector<std::thread> threads;
+  for (auto c : clients) {
+    threads.emplace_back(run_client, c, &stop);
+  }
+  // skip the time the queue depth takes to settle
+  sleep(1);
+  std::vector<uint64_t> start;
+  for (auto c : clients) {
+    start.push_back(c->done.load());
+  }
+  sleep(seconds);
+  std::vector<uint64_t> end;
+  for (auto c : clients) {
+    end.push_back(c->done.load());
+  }
+  stop = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  double total = 0;
+  for (size_t i = 0; i < clients.size(); ++i) {
+    total += double(end[i] - start[i]) / seconds;
+  }
+  water_fill(clients, total);
+
+  std::map<std::string, std::string> meta;
+  bdev->collect_metadata("", &meta);
+
+  // stdout carries the per-IO debug log, the results go to stderr
+  std::cerr << "total " << (uint64_t)total << " IOPS, queue depth " << meta["mclock_depth"] << std::endl;
+  for (size_t i = 0; i < clients.size(); ++i) {
+    double iops = double(end[i] - start[i]) / seconds;
+    std::cerr << "  " << clients[i]->name << ": " << (uint64_t)iops << " IOPS, expected "
+      << (uint64_t)clients[i]->expected << " (" << (int)(iops * 100 / clients[i]->expected) << "%)"
+      << ", by reservation " << meta["mclock_client" + std::to_string(clients[i]->id) + "_reserved_ios"]
+      << " of " << meta["mclock_client" + std::to_string(clients[i]->id) + "_ios"] << std::endl;
+  }
+
+  bdev->close();
+  delete bdev;
+  for (auto c : clients) {
+    delete c;
+  }
+  return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+
+#include "common/init.hpp"
+#include "common/code_environment.hpp"
+#include "common/util.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/block_device.hpp"
+
+// Per-IO cost of 4K random reads, with and without the small IO fast path:
+//     bench_small_io [path] [nr_ios]
+// path is the file holding the transport id, /tmp/nvme by default.
+
+static void run(BlockDevice *bdev, bool fast_path, int nr_ios)
+{
+  blk_options.spdk_fast_path = fast_path;
+
+  const uint64_t io_size = 4096;
+  uint64_t nr_blocks = bdev->get_size() / io_size;
+  std::mt19937_64 rng(42);
+  char buf[io_size];
+
+  // warm up the queue and the latency estimates
+  for (int i = 0; i < 1000; ++i) {
+    bdev->read_random((rng() % nr_blocks) * io_size, io_size, buf, false);
+  }
+
+  uint64_t wall = stupid::common::mono_ns();
+  uint64_t cpu = stupid::common::thread_cpu_ns();
+  for (int i = 0; i < nr_ios; ++i) {
+    int r = bdev->read_random((rng() % nr_blocks) * io_size, io_size, buf, false);
+    if (r < 0) {
+      std::cerr << "read_random failed: " << r << std::endl;
+      exit(1);
+    }
+  }
+  cpu = stupid::common::thread_cpu_ns() - cpu;
+  wall = stupid::common::mono_ns() - wall;
+
+  std::map<std::string, std::string> meta;
+  bdev->collect_metadata("", &meta);
+
+  std::cerr << (fast_path ? "fast path: " : "task path: ")
+    << nr_ios << " x 4K random read, "
+    << wall / nr_ios << " ns/io wall, "
+    << cpu / nr_ios << " ns/io cpu, "
+    << "poll cpu (cumulative) " << meta["nvme_poll_cpu_ns_per_io"] << " ns/io"
+    << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  std::string path = "/tmp/nvme";
+  int nr_ios = 100000;
+  if (argc >= 2) {
+    path = argv[1];
+  }
+  if (argc >= 3) {
+    nr_ios = std::atoi(argv[2]);
+  }
+
+  stupid::common::initialize(stupid::global::CODE_ENVIRONMENT_UTILITY);
+
+  BlockDevice *bdev = BlockDevice::create("spdk", "", nullptr, nullptr, nullptr, nullptr);
+  if (int r = bdev->open(path); r != 0) {
+    std::cerr << "failed to open " << path << ": " << r << std::endl;
+    return 1;
+  }
+
+  // stdout carries the per-IO debug log, the results go to stderr
+  run(bdev, false, nr_ios);
+  run(bdev, true, nr_ios);
+
+  bdev->close();
+  delete bdev;
+  return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# Run the spdk test against a local NVMe/TCP target: start spdk's nvmf_tgt
+# with a malloc namespace listening on 127.0.0.1, write the transport id
+# file, and run ./Debug/stupid on it.
+#
+#   SPDK_DIR=/path/to/spdk-20.07 test/spdk/nvmf_tcp_loopback.sh [threads]
+#
+# Needs root (hugepages); run spdk's scripts/setup.sh once beforehand.
+
+set -e
+
+SPDK_DIR=${SPDK_DIR:-/home/yuanguo.hyg/local/spdk-20.07}
+BIN=${BIN:-./Debug/stupid}
+THREADS=${1:-4}
+ADDR=127.0.0.1
+PORT=4420
+NQN=nqn.2016-06.io.spdk:stupid
+TRID_FILE=/tmp/nvme_tcp
+RPC="$SPDK_DIR/scripts/rpc.py"
+
+# the target runs on core 1, the test's spdk environment on core 0
+"$SPDK_DIR/build/bin/nvmf_tgt" -m 0x2 &
+tgt_pid=$!
+trap 'kill $tgt_pid; wait $tgt_pid 2>/dev/null; rm -f $TRID_FILE' EXIT
+
+for i in $(seq 50); do
+  if $RPC rpc_get_methods > /dev/null 2>&1; then
+    break
+  fi
+  sleep 0.2
+done
+
+$RPC nvmf_create_transport -t TCP -q 128
+$RPC bdev_malloc_create -b Malloc0 256 4096
+$RPC nvmf_create_subsystem $NQN -a -s STUPID0001
+$RPC nvmf_subsystem_add_ns $NQN Malloc0
+$RPC nvmf_subsystem_add_listener $NQN -t TCP -a $ADDR -s $PORT
+
+echo "trtype:TCP adrfam:IPv4 traddr:$ADDR trsvcid:$PORT subnqn:$NQN" > $TRID_FILE
+
+$BIN $THREADS $TRID_FILE
@@ -70,9 +70,15 @@ int main(int argc, char** argv)
   pthread_setname_wrapper(pthread_self(), "stupid_main");
 
   int num_threads = 4;
-  if (argc == 2) {
+  if (argc >= 2) {
     num_threads = std::atoi(argv[1]);
   }
+  // the file holding the transport id, e.g. a NVMe/TCP one written by
+  // nvmf_tcp_loopback.sh
+  std::string path = "/tmp/nvme";
+  if (argc >= 3) {
+    path = argv[2];
+  }
 
   stupid::common::initialize(stupid::global::CODE_ENVIRONMENT_DAEMON);
 
@@ -82,8 +88,8 @@ int main(int argc, char** argv)
   //blk test
   bdev = BlockDevice::create("spdk", "", nullptr, nullptr, nullptr, nullptr);
 
-  std::cout << "open /tmp/nvme" << std::endl;
-  int r = bdev->open("/tmp/nvme");
+  std::cout << "open " << path << std::endl;
+  int r = bdev->open(path);
   if (r != 0) {
       std::cerr << __func__ << " failed to open nvme device" << std::endl;
       return -1;
@@ -0,0 +1,493 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/init.hpp"
+#include "common/code_environment.hpp"
+
+#include "blk/blk_options.hpp"
+#include "blk/block_device.hpp"
+#include "blk/cached_device.hpp"
+#include "blk/device_decorator.hpp"
+#include "blk/mirrored_device.hpp"
+#include "blk/writeback_device.hpp"
+
+// Checks of the composite and decorator devices over files, through the
+// kernel aio backend:
+//     test_blk_devices [dir] [test]
+// The member files are created in dir (/tmp by default) and removed at the
+// end. Faults (failing or stalling IOs) are injected by putting a
+// FaultyDevice in front of a member.
+
+static void aio_cb(void *priv, void *priv2)
+{
+}
+
+// fails the IOs or holds the aio_submit()s while told to
+class FaultyDevice : public BlockDeviceDecorator {
+  std::atomic_int stalled = {0};
+
+public:
+  std::atomic_bool fail_reads = {false}, fail_writes = {false};
+  std::atomic<uint32_t> stall_us = {0};
+
+  explicit FaultyDevice(BlockDevice *dev) : BlockDeviceDecorator(dev, aio_cb, nullptr) {
+    // wrapped once open
+    copy_geometry();
+  }
+
+  // the IOs still held are submitted before the device goes
+  void close() override {
+    while (stalled.load()) {
+      usleep(1000);
+    }
+    dev->close();
+  }
+
+  void aio_submit(IOContext *ioc) override {
+    uint32_t us = stall_us.load();
+    if (!us) {
+      dev->aio_submit(ioc);
+      return;
+    }
+    ++stalled;
+    std::thread([this, ioc, us] {
+      usleep(us);
+      dev->aio_submit(ioc);
+      --stalled;
+    }).detach();
+  }
+
+  int read(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered) override {
+    return fail_reads ? -EIO : dev->read(off, len, buf, ioc, buffered);
+  }
+  int read_random(uint64_t off, uint64_t len, char *buf, bool buffered) override {
+    return fail_reads ? -EIO : dev->read_random(off, len, buf, buffered);
+  }
+  int aio_read(uint64_t off, uint64_t len, char* buf, IOContext *ioc) override {
+    return fail_reads ? -EIO : dev->aio_read(off, len, buf, ioc);
+  }
+  int write(uint64_t off, uint64_t len, char* buf, bool buffered, int write_hint) override {
+    return fail_writes ? -EIO : dev->write(off, len, buf, buffered, write_hint);
+  }
+  int aio_write(uint64_t off, uint64_t len, char* buf, IOContext *ioc, bool buffered, int write_hint) override {
+    return fail_writes ? -EIO : dev->aio_write(off, len, buf, ioc, buffered, write_hint);
+  }
+};
+
+// T with a FaultyDevice in front of a member (composite devices) or of the
+// wrapped device (decorators), once open
+template <class T>
+struct WithFaults : public T {
+  using T::T;
+  FaultyDevice *fault_member(unsigned m) {
+    FaultyDevice *f = new FaultyDevice(this->members[m].release());
+    this->members[m].reset(f);
+    return f;
+  }
+  FaultyDevice *fault_inner() {
+    FaultyDevice *f = new FaultyDevice(this->dev.release());
+    this->dev.reset(f);
+    return f;
+  }
+};
+
+static std::string dir = "/tmp";
+static int failures = 0;
+
+static bool check(bool ok, const std::string& what)
+{
+  if (!ok) {
+    std::cerr << "  FAILED: " << what << std::endl;
+    ++failures;
+  }
+  return ok;
+}
+
+static std::string make_file(const std::string& name, uint64_t size)
+{
+  std::string path = dir + "/test_blk_devices." + name;
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ::ftruncate(fd, size) < 0) {
+    std::cerr << "cannot create " << path << ": " << strerror(errno) << std::endl;
+    exit(1);
+  }
+  ::close(fd);
+  return path;
+}
+
+static int file_io(const std::string& path, bool write, char *buf, uint64_t len, uint64_t off)
+{
+  int fd = ::open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    return -errno;
+  }
+  ssize_t r = write ? ::pwrite(fd, buf, len, off) : ::pread(fd, buf, len, off);
+  ::close(fd);
+  return r == (ssize_t)len ? 0 : -EIO;
+}
+
+static char *alloc_buf(uint64_t len)
+{
+  return static_cast<char*>(aligned_alloc(4096, len));
+}
+
+static std::string meta(BlockDevice *b, const std::string& key)
+{
+  std::map<std::string, std::string> pm;
+  b->collect_metadata("", &pm);
+  return pm[key];
+}
+
+// one IOContext of aios, waited for
+static int aio_batch(BlockDevice *b, const std::function<int(IOContext*)>& queue)
+{
+  IOContext ioc(nullptr);
+  int r = queue(&ioc);
+  b->aio_submit(&ioc);
+  ioc.aio_wait();
+  return r < 0 ? r : ioc.get_return_value();
+}
+
+static void pattern(char *buf, uint64_t len, int seed)
+{
+  for (uint64_t i = 0; i < len; ++i) {
+    buf[i] = (char)(seed * 131 + i / 512);
+  }
+}
+
+static const uint64_t L = 16384;
+
+// writes survive a close and are replayed from the log, not destaged yet
+static void test_writeback_replay()
+{
+  std::string fast = make_file("wb_fast", 16 << 20), slow = make_file("wb_slow", 16 << 20);
+  std::string path = "writeback:" + fast + "," + slow;
+  const int n = 32;
+  std::unique_ptr<char[], decltype(&free)> w(alloc_buf(n * L), free), r(alloc_buf(n * L), free);
+  for (int i = 0; i < n; ++i) {
+    pattern(w.get() + i * L, L, i);
+  }
+
+  std::unique_ptr<BlockDevice> b(BlockDevice::create("", path, aio_cb, nullptr, nullptr, nullptr));
+  check(b->open(path) == 0, "open " + path);
+  for (int i = 0; i < n / 2; ++i) {
+    check(b->write(i * L, L, w.get() + i * L, false) == 0, "sync write");
+  }
+  check(aio_batch(b.get(), [&](IOContext *ioc) {
+    for (int i = n / 2; i < n; ++i) {
+      b->aio_write(i * L, L, w.get() + i * L, ioc, false);
+    }
+    return 0;
+  }) == 0, "aio writes");
+  b->close();
+
+  check(b->open(path) == 0, "reopen");
+  check(meta(b.get(), "wb_dirty") != "0", "log replayed, not destaged");
+  check(b->read(0, n * L, r.get(), nullptr, false) == 0, "read");
+  check(memcmp(w.get(), r.get(), n * L) == 0, "replayed data");
+  b->close();
+}
+
+// a record torn by a crash ends the replay, the older ones are kept
+static void test_writeback_torn()
+{
+  std::string fast = make_file("wb_fast", 16 << 20), slow = make_file("wb_slow", 16 << 20);
+  std::string path = "writeback:" + fast + "," + slow;
+  const int n = 8;
+  std::unique_ptr<char[], decltype(&free)> w(alloc_buf(n * L), free), r(alloc_buf(n * L), free);
+  for (int i = 0; i < n; ++i) {
+    pattern(w.get() + i * L, L, i + 100);
+  }
+
+  std::unique_ptr<BlockDevice> b(BlockDevice::create("", path, aio_cb, nullptr, nullptr, nullptr));
+  check(b->open(path) == 0, "open " + path);
+  for (int i = 0; i < n; ++i) {
+    b->write(i * L, L, w.get() + i * L, false);
+  }
+  uint64_t block_size = b->get_block_size();
+  b->close();
+
+  // after the superblock, each record is a header block and the data
+  uint64_t last = block_size + (n - 1) * (block_size + L);
+  char c;
+  file_io(fast, false, &c, 1, last + block_size + 100);
+  c ^= 1;
+  file_io(fast, true, &c, 1, last + block_size + 100);
+
+  check(b->open(path) == 0, "reopen");
+  check(b->read(0, n * L, r.get(), nullptr, false) == 0, "read");
+  check(memcmp(w.get(), r.get(), (n - 1) * L) == 0, "records before the torn one");
+  std::unique_ptr<char[], decltype(&free)> zero(alloc_buf(L), free);
+  memset(zero.get(), 0, L);
+  check(memcmp(zero.get(), r.get() + (n - 1) * L, L) == 0, "torn record dropped");
+  b->close();
+}
+
+// several laps of a small log, destaged on the way
+static void test_writeback_lap()
+{
+  std::string fast = make_file("wb_fast", 1 << 20), slow = make_file("wb_slow", 16 << 20);
+  std::string path = "writeback:" + fast + "," + slow;
+  const uint64_t unit = 65536;
+  const int n = 48;
+  std::unique_ptr<char[], decltype(&free)> w(alloc_buf(n * unit), free), r(alloc_buf(n * unit), free);
+  for (int i = 0; i < n; ++i) {
+    pattern(w.get() + i * unit, unit, i + 200);
+  }
+
+  std::unique_ptr<BlockDevice> b(BlockDevice::create("", path, aio_cb, nullptr, nullptr, nullptr));
+  check(b->open(path) == 0, "open " + path);
+  for (int i = 0; i < n; ++i) {
+    if (!check(b->write(i * unit, unit, w.get() + i * unit, false) == 0, "write " + std::to_string(i))) {
+      break;
+    }
+  }
+  check(meta(b.get(), "wb_destaged") != "0", "destaged");
+  check(b->read(0, n * unit, r.get(), nullptr, false) == 0, "read");
+  check(memcmp(w.get(), r.get(), n * unit) == 0, "data after wrapping");
+  b->close();
+
+  check(b->open(path) == 0, "reopen");
+  memset(r.get(), 0, n * unit);
+  check(b->read(0, n * unit, r.get(), nullptr, false) == 0, "read");
+  check(memcmp(w.get(), r.get(), n * unit) == 0, "data after replay");
+  b->close();
+}
+
+// a failed record gives the blocks back to the older data, in the log
+static void test_writeback_failed()
+{
+  std::string fast = make_file("wb_fast", 16 << 20), slow = make_file("wb_slow", 16 << 20);
+  std::string path = "writeback:" + fast + "," + slow;
+  std::unique_ptr<char[], decltype(&free)> a(alloc_buf(L), free), x(alloc_buf(L), free), r(alloc_buf(L), free);
+  pattern(a.get(), L, 1);
+  pattern(x.get(), L, 2);
+
+  std::unique_ptr<WithFaults<WriteBackBlockDevice>> b(new WithFaults<WriteBackBlockDevice>(aio_cb, nullptr));
+  check(b->open(path) == 0, "open " + path);
+  FaultyDevice *f = b->fault_member(0);
+  check(b->write(0, L, a.get(), false) == 0, "write");
+
+  f->fail_writes = true;
+  check(b->write(0, L, x.get(), false) < 0, "sync write fails");
+  check(aio_batch(b.get(), [&](IOContext *ioc) {
+    return b->aio_write(0, L, x.get(), ioc, false);
+  }) < 0, "aio write fails");
+  f->fail_writes = false;
+
+  check(b->read(0, L, r.get(), nullptr, false) == 0, "read");
+  check(memcmp(a.get(), r.get(), L) == 0, "acknowledged data kept");
+  // held until the destager has moved past the failed records
+  check(b->write(L, L, x.get(), false) == 0, "write after the failed ones");
+  check(b->read(0, L, r.get(), nullptr, false) == 0 && memcmp(a.get(), r.get(), L) == 0, "data kept once destaged");
+  b->close();
+}
+
+// a bypassing write is not undone by the replay of the older records
+static void test_writeback_bypass()
+{
+  std::string fast = make_file("wb_fast", 16 << 20), slow = make_file("wb_slow", 16 << 20);
+  std::string path = "writeback:" + fast + "," + slow;
+  const uint64_t big = blk_options.bdev_wb_max_write * 2;
+  std::unique_ptr<char[], decltype(&free)> a(alloc_buf(L), free), w(alloc_buf(big), free), r(alloc_buf(big), free);
+  pattern(a.get(), L, 3);
+  pattern(w.get(), big, 4);
+
+  std::unique_ptr<BlockDevice> b(BlockDevice::create("", path, aio_cb, nullptr, nullptr, nullptr));
+  check(b->open(path) == 0, "open " + path);
+  b->write(0, L, a.get(), false);
+  b->write(big, L, a.get(), false);
+  check(b->write(0, big, w.get(), false) == 0, "sync bypass");
+  check(aio_batch(b.get(), [&](IOContext *ioc) {
+    return b->aio_write(big, big, w.get(), ioc, false);
+  }) == 0, "aio bypass");
+  check(b->flush() == 0, "flush");
+  b->close();
+
+  check(b->open(path) == 0, "reopen");
+  check(b->read(0, big, r.get(), nullptr, false) == 0 && memcmp(w.get(), r.get(), big) == 0, "sync bypass kept");
+  check(b->read(big, big, r.get(), nullptr, false) == 0 && memcmp(w.get(), r.get(), big) == 0, "aio bypass kept");
+  b->close();
+}
+
+// the stripe units go round robin to the members
+static void test_stripe_mapping()
+{
+  const uint64_t unit = blk_options.bdev_stripe_unit;
+  std::string m0 = make_file("stripe0", 4 << 20), m1 = make_file("stripe1", 4 << 20);
+  std::string path = "stripe:" + m0 + "," + m1;
+  const int n = 8;
+  std::unique_ptr<char[], decltype(&free)> w(alloc_buf(n * unit), free), r(alloc_buf(n * unit), free);
+  for (int i = 0; i < n; ++i) {
+    pattern(w.get() + i * unit, unit, i + 300);
+  }
+
+  std::unique_ptr<BlockDevice> b(BlockDevice::create("", path, aio_cb, nullptr, nullptr, nullptr));
+  check(b->open(path) == 0, "open " + path);
+  check(b->get_size() == 8 << 20, "size");
+  // one aio across all the units, one sync write straddling two
+  check(aio_batch(b.get(), [&](IOContext *ioc) {
+    return b->aio_write(0, n * unit, w.get(), ioc, false);
+  }) == 0, "aio write");
+  check(b->write(unit / 2, unit, w.get() + unit / 2, false) == 0, "sync write");
+  check(b->read(0, n * unit, r.get(), nullptr, false) == 0, "read");
+  check(memcmp(w.get(), r.get(), n * unit) == 0, "data");
+  b->close();
+
+  for (int i = 0; i < n; ++i) {
+    file_io(i % 2 ? m1 : m0, false, r.get(), unit, (i / 2) * unit);
+    check(memcmp(w.get() + i * unit, r.get(), unit) == 0, "unit " + std::to_string(i) + " on its member");
+  }
+}
+
+// reads go to the other replica when one fails, or stalls
+static void test_mirror()
+{
+  std::string m0 = make_file("mirror0", 4 << 20), m1 = make_file("mirror1", 4 << 20);
+  std::string path = "mirror:" + m0 + "," + m1;
+  std::unique_ptr<char[], decltype(&free)> w(alloc_buf(L), free), r(alloc_buf(L), free);
+  pattern(w.get(), L, 5);
+
+  std::unique_ptr<WithFaults<MirroredBlockDevice>> b(new WithFaults<MirroredBlockDevice>(aio_cb, nullptr));
+  check(b->open(path) == 0, "open " + path);
+  check(b->write(0, L, w.get(), false) == 0, "write");
+  for (auto &m : {m0, m1}) {
+    file_io(m, false, r.get(), L, 0);
+    check(memcmp(w.get(), r.get(), L) == 0, "written to " + m);
+  }
+
+  FaultyDevice *f = b->fault_member(0);
+  f->fail_reads = true;
+  for (int i = 0; i < 16; ++i) {
+    memset(r.get(), 0, L);
+    check(b->read(0, L, r.get(), nullptr, false) == 0 && memcmp(w.get(), r.get(), L) == 0, "read, replica failing");
+  }
+  check(meta(b.get(), "mirror_failovers") != "0", "failed over");
+  f->fail_reads = false;
+
+  f->stall_us = 20000;
+  for (int i = 0; i < 16; ++i) {
+    memset(r.get(), 0, L);
+    check(aio_batch(b.get(), [&](IOContext *ioc) {
+      return b->aio_read(0, L, r.get(), ioc);
+    }) == 0 && memcmp(w.get(), r.get(), L) == 0, "aio read, replica stalling");
+  }
+  check(meta(b.get(), "mirror_hedge_wins") != "0", "hedged");
+  f->stall_us = 0;
+  b->close();
+}
+
+// a read going by an aio write in flight does not cache the old data
+static void test_cache_coherence()
+{
+  std::string file = make_file("cache", 4 << 20);
+  std::unique_ptr<char[], decltype(&free)> a(alloc_buf(L), free), x(alloc_buf(L), free), r(alloc_buf(L), free);
+  pattern(a.get(), L, 6);
+  pattern(x.get(), L, 7);
+
+  BlockDevice *inner = BlockDevice::create("", file, aio_cb, nullptr, nullptr, nullptr);
+  std::unique_ptr<WithFaults<CachedBlockDevice>> b(new WithFaults<CachedBlockDevice>(inner, aio_cb, nullptr));
+  check(b->open(file) == 0, "open " + file);
+  FaultyDevice *f = b->fault_inner();
+  check(b->write(0, L, a.get(), false) == 0, "write");
+  check(b->read(0, L, r.get(), nullptr, false) == 0 && memcmp(a.get(), r.get(), L) == 0, "read");
+
+  // the aio write reaches the file only once the stall is over
+  f->stall_us = 50000;
+  IOContext ioc(nullptr);
+  b->aio_write(0, L, x.get(), &ioc, false);
+  b->aio_submit(&ioc);
+  check(b->read(0, L, r.get(), nullptr, false) == 0, "read during the write");
+  ioc.aio_wait();
+  f->stall_us = 0;
+
+  check(b->read(0, L, r.get(), nullptr, false) == 0 && memcmp(x.get(), r.get(), L) == 0, "new data once written");
+  b->close();
+}
+
+// a block changed behind the checksums' back fails its reads
+static void test_csum()
+{
+  std::string file = make_file("csum", 4 << 20);
+  std::string table = dir + "/test_blk_devices.csum_table";
+  ::unlink(table.c_str());
+  std::unique_ptr<char[], decltype(&free)> w(alloc_buf(L), free), r(alloc_buf(L), free);
+  pattern(w.get(), L, 8);
+
+  blk_options.bdev_csum = true;
+  blk_options.bdev_csum_path = table;
+  std::unique_ptr<BlockDevice> b(BlockDevice::create("", file, aio_cb, nullptr, nullptr, nullptr));
+  blk_options.bdev_csum = false;
+  check(b->open(file) == 0, "open " + file);
+  check(b->write(0, L, w.get(), false) == 0, "write");
+  check(b->read(0, L, r.get(), nullptr, false) == 0, "clean read");
+  b->close();
+
+  char c;
+  file_io(file, false, &c, 1, 4096 + 7);
+  c ^= 1;
+  file_io(file, true, &c, 1, 4096 + 7);
+
+  // the table was written out by close()
+  check(b->open(file) == 0, "reopen");
+  check(b->read(0, L, r.get(), nullptr, false) == -EIO, "sync read of the bad block");
+  check(b->read_random(4096 + 100, 10, r.get(), false) == -EIO, "unaligned read of the bad block");
+  check(b->read(0, 4096, r.get(), nullptr, false) == 0, "read of a good block");
+  check(aio_batch(b.get(), [&](IOContext *ioc) {
+    return b->aio_read(0, L, r.get(), ioc);
+  }) == -EIO, "aio read of the bad block");
+  check(meta(b.get(), "csum_errors") == "3", "errors counted");
+  b->close();
+  blk_options.bdev_csum_path.clear();
+  ::unlink(table.c_str());
+}
+
+int main(int argc, char** argv)
+{
+  stupid::common::initialize(stupid::global::CODE_ENVIRONMENT_UTILITY);
+  if (argc > 1) {
+    dir = argv[1];
+  }
+  std::string only = argc > 2 ? argv[2] : "";
+
+  // the destager only runs when the log fills up, so that the log is
+  // replayed on reopen
+  blk_options.bdev_wb_destage_interval_ms = 1000000;
+
+  std::vector<std::pair<const char*, void(*)()>> tests = {
+    {"writeback_replay", test_writeback_replay},
+    {"writeback_torn", test_writeback_torn},
+    {"writeback_lap", test_writeback_lap},
+    {"writeback_failed", test_writeback_failed},
+    {"writeback_bypass", test_writeback_bypass},
+    {"stripe_mapping", test_stripe_mapping},
+    {"mirror", test_mirror},
+    {"cache_coherence", test_cache_coherence},
+    {"csum", test_csum},
+  };
+  for (auto &[name, f] : tests) {
+    if (!only.empty() && only != name) {
+      continue;
+    }
+    int before = failures;
+    f();
+    std::cerr << name << ": " << (failures == before ? "ok" : "FAILED") << std::endl;
+  }
+
+  for (auto name : {"wb_fast", "wb_slow", "stripe0", "stripe1", "mirror0", "mirror1", "cache", "csum"}) {
+    ::unlink((dir + "/test_blk_devices." + name).c_str());
+  }
+  return failures ? 1 : 0;
+}